@@ -1169,10 +1169,14 @@ void CUDTUnited::removeSocket(const UDTSOCKET u)
    m->m_iRefCount --;
    if (0 == m->m_iRefCount)
    {
-      m->m_pChannel->close();
+      for (int k = 0; k < m->m_iRcvWorkers; ++ k)
+         m->m_pRcvChannel[k]->close();
       delete m->m_pSndQueue;
       delete m->m_pRcvQueue;
       delete m->m_pTimer;
+      for (int k = 1; k < m->m_iRcvWorkers; ++ k)
+         delete m->m_pRcvChannel[k];
+      delete [] m->m_pRcvChannel;
       delete m->m_pChannel;
       m_vMultiplexer.erase(m);
    }
@@ -1267,9 +1271,15 @@ void CUDTUnited::updateMux(CUDT* u, const sockaddr* addr, const UDPSOCKET* udpso
    m.m_iRefCount = 1;
    m.m_bReusable = u->m_bReuseAddr;
 
+   // several receiving workers need a port shared by as many UDP sockets; an existing socket is used alone
+   int workers = (NULL == udpsock) ? u->m_iRcvWorkers : 1;
+
    m.m_pChannel = new CChannel(u->m_iIPversion);
    m.m_pChannel->setSndBufSize(u->m_iUDPSndBufSize);
    m.m_pChannel->setRcvBufSize(u->m_iUDPRcvBufSize);
+   // a coalesced datagram would be steered by its first packet only
+   m.m_pChannel->setOffload(u->m_bGSO, u->m_bGRO && (1 == workers));
+   m.m_pChannel->setReusePort(workers > 1);
 
    try
    {
@@ -1285,6 +1295,34 @@ void CUDTUnited::updateMux(CUDT* u, const sockaddr* addr, const UDPSOCKET* udpso
       throw e;
    }
 
+   m.m_pRcvChannel = new CChannel*[workers];
+   m.m_pRcvChannel[0] = m.m_pChannel;
+   m.m_iRcvWorkers = 1;
+   try
+   {
+      while (m.m_iRcvWorkers < workers)
+      {
+         CChannel* c = new CChannel(u->m_iIPversion);
+         c->setSndBufSize(u->m_iUDPSndBufSize);
+         c->setRcvBufSize(u->m_iUDPRcvBufSize);
+         m.m_pRcvChannel[m.m_iRcvWorkers ++] = c;
+         c->join(m.m_pChannel);
+      }
+
+      if ((workers > 1) && !m.m_pChannel->shard(workers))
+         throw CUDTException(1, 3, 0);
+   }
+   catch (CUDTException&)
+   {
+      // no port sharing on this system, one worker receives everything
+      for (int k = 1; k < m.m_iRcvWorkers; ++ k)
+      {
+         m.m_pRcvChannel[k]->close();
+         delete m.m_pRcvChannel[k];
+      }
+      m.m_iRcvWorkers = 1;
+   }
+
    sockaddr* sa = (AF_INET == u->m_iIPversion) ? (sockaddr*) new sockaddr_in : (sockaddr*) new sockaddr_in6;
    m.m_pChannel->getSockAddr(sa);
    m.m_iPort = (AF_INET == u->m_iIPversion) ? ntohs(((sockaddr_in*)sa)->sin_port) : ntohs(((sockaddr_in6*)sa)->sin6_port);
@@ -1295,7 +1333,7 @@ void CUDTUnited::updateMux(CUDT* u, const sockaddr* addr, const UDPSOCKET* udpso
    m.m_pSndQueue = new CSndQueue;
    m.m_pSndQueue->init(m.m_pChannel, m.m_pTimer);
    m.m_pRcvQueue = new CRcvQueue;
-   m.m_pRcvQueue->init(32, u->m_iPayloadSize, m.m_iIPversion, 1024, m.m_pChannel, m.m_pTimer);
+   m.m_pRcvQueue->init(32, u->m_iPayloadSize, m.m_iIPversion, 1024, m.m_pRcvChannel, m.m_iRcvWorkers, m.m_pTimer);
 
    m_vMultiplexer.insert(m_vMultiplexer.end(), m);
 
@@ -1763,6 +1801,32 @@ int64_t CUDT::sendfile(UDTSOCKET u, FILE* ifd, const int64_t& offset, const int6
    }
 }
 
+#ifndef WIN32
+int64_t CUDT::sendfile(UDTSOCKET u, int fd, const int64_t& offset, const int64_t& size, const int& block)
+{
+   try
+   {
+      CUDT* udt = s_UDTUnited.lookup(u);
+      return udt->sendfile(fd, offset, size, block);
+   }
+   catch (CUDTException e)
+   {
+      s_UDTUnited.setError(new CUDTException(e));
+      return ERROR;
+   }
+   catch (bad_alloc&)
+   {
+      s_UDTUnited.setError(new CUDTException(3, 2, 0));
+      return ERROR;
+   }
+   catch (...)
+   {
+      s_UDTUnited.setError(new CUDTException(-1, 0, 0));
+      return ERROR;
+   }
+}
+#endif
+
 int64_t CUDT::recvfile(UDTSOCKET u, fstream& ofs, const int64_t& offset, const int64_t& size, const int& block)
 {
    try
@@ -1977,6 +2041,13 @@ int64_t sendfile(UDTSOCKET u, FILE* ifd, int64_t offset, int64_t size, int block
    return CUDT::sendfile(u, ifd, offset, size, block);
 }
 
+#ifndef WIN32
+int64_t sendfile(UDTSOCKET u, int fd, int64_t offset, int64_t size, int block)
+{
+   return CUDT::sendfile(u, fd, offset, size, block);
+}
+#endif
+
 int64_t recvfile(UDTSOCKET u, fstream& ofs, int64_t offset, int64_t size, int block)
 {
    return CUDT::recvfile(u, ofs, offset, size, block);
@@ -40,6 +40,10 @@ written by
 
 #include <cstring>
 #include <cmath>
+#ifndef WIN32
+   #include <unistd.h>
+   #include <sys/uio.h>
+#endif
 #include "buffer.h"
 
 using namespace std;
@@ -246,6 +250,80 @@ int CSndBuffer::addBufferFromFile(FILE* ifd, const int& len)
    return total;
 }
 
+#ifndef WIN32
+int CSndBuffer::addBufferFromFd(int fd, const int64_t& offset, const int& len)
+{
+   int size = len / m_iMSS;
+   if ((len % m_iMSS) != 0)
+      size ++;
+
+   // dynamically increase sender buffer
+   while (size + m_iCount >= m_iSize)
+      increase();
+
+   // one preadv() fills up to 1024 slots, no copy through a user buffer
+   const int maxiov = 1024;
+   struct iovec iov[maxiov];
+   Block* s = m_pLastBlock;
+   int total = 0;
+   int packets = 0;
+   bool failed = false;
+
+   while (packets < size)
+   {
+      int n = 0;
+      ssize_t want = 0;
+      Block* p = s;
+      for (; (n < maxiov) && (packets + n < size); ++ n)
+      {
+         int pktlen = len - (packets + n) * m_iMSS;
+         if (pktlen > m_iMSS)
+            pktlen = m_iMSS;
+         iov[n].iov_base = p->m_pcData;
+         iov[n].iov_len = pktlen;
+         want += pktlen;
+         p = p->m_pNext;
+      }
+
+      ssize_t got = preadv(fd, iov, n, offset + total);
+      if (got <= 0)
+      {
+         failed = (got < 0);
+         break;
+      }
+
+      // the slots filled, the last one maybe partly
+      ssize_t left = got;
+      for (int i = 0; (i < n) && (left > 0); ++ i)
+      {
+         int pktlen = (left >= (ssize_t)iov[i].iov_len) ? (int)iov[i].iov_len : (int)left;
+         s->m_iLength = pktlen;
+         s->m_iTTL = -1;
+         s = s->m_pNext;
+         left -= pktlen;
+         total += pktlen;
+         ++ packets;
+      }
+
+      // end of file
+      if (got < want)
+         break;
+   }
+
+   // a read error drops the whole block, the slots filled so far are not sent
+   if (failed)
+      return -1;
+
+   m_pLastBlock = s;
+
+   CGuard::enterCS(m_BufLock);
+   m_iCount += packets;
+   CGuard::leaveCS(m_BufLock);
+
+   return total;
+}
+#endif
+
 int CSndBuffer::readData(char** data, int32_t& msgno)
 {
    // No data to read
@@ -76,6 +76,19 @@ public:
    int addBufferFromFile(std::fstream& ifs, const int& len);
    int addBufferFromFile(FILE* ifd, const int& len);
 
+#ifndef WIN32
+      // Functionality:
+      //    Read a block of data at an offset of a file descriptor straight into the packet slots.
+      // Parameters:
+      //    0) [in] fd: file descriptor, its file position is not used.
+      //    1) [in] offset: where to read.
+      //    2) [in] len: size of the block.
+      // Returned value:
+      //    actual size of data added from the file, -1 on a read error, and then nothing is added.
+
+   int addBufferFromFd(int fd, const int64_t& offset, const int& len);
+#endif
+
       // Functionality:
       //    Find data position to pack a DATA packet from the furthest reading point.
       // Parameters:
@@ -53,6 +53,11 @@ written by
       #include <wspiapi.h>
    #endif
 #endif
+#ifdef LINUX
+   #include <netinet/udp.h>
+   #include <linux/filter.h>
+#endif
+
 #include "channel.h"
 #include "packet.h"
 
@@ -71,7 +76,14 @@ CChannel::CChannel():
 m_iIPversion(AF_INET),
 m_iSocket(),
 m_iSndBufSize(65536),
-m_iRcvBufSize(65536)
+m_iRcvBufSize(65536),
+m_bGSO(false),
+m_bGRO(false),
+m_pGROBuf(NULL),
+m_iGROOffset(0),
+m_iGROLength(0),
+m_iGROSegment(0),
+m_bReusePort(false)
 {
 }
 
@@ -79,12 +91,20 @@ CChannel::CChannel(const int& version):
 m_iIPversion(version),
 m_iSocket(),
 m_iSndBufSize(65536),
-m_iRcvBufSize(65536)
+m_iRcvBufSize(65536),
+m_bGSO(false),
+m_bGRO(false),
+m_pGROBuf(NULL),
+m_iGROOffset(0),
+m_iGROLength(0),
+m_iGROSegment(0),
+m_bReusePort(false)
 {
 }
 
 CChannel::~CChannel()
 {
+   delete [] m_pGROBuf;
 }
 
 void CChannel::open(const sockaddr* addr)
@@ -99,6 +119,12 @@ void CChannel::open(const sockaddr* addr)
    #endif
       throw CUDTException(1, 0, NET_ERROR);
 
+   #ifdef SO_REUSEPORT
+      int reuse = 1;
+      if (m_bReusePort && (0 != setsockopt(m_iSocket, SOL_SOCKET, SO_REUSEPORT, (char*)&reuse, sizeof(int))))
+         throw CUDTException(1, 3, NET_ERROR);
+   #endif
+
    if (NULL != addr)
    {
       socklen_t namelen = (AF_INET == m_iIPversion) ? sizeof(sockaddr_in) : sizeof(sockaddr_in6);
@@ -136,6 +162,34 @@ void CChannel::open(UDPSOCKET udpsock)
    setUDPSockOpt();
 }
 
+void CChannel::join(const CChannel* c)
+{
+   sockaddr_in6 addr;
+   c->getSockAddr((sockaddr*)&addr);
+
+   m_bReusePort = true;
+   open((sockaddr*)&addr);
+}
+
+bool CChannel::shard(const int& n) const
+{
+   #if defined(LINUX) && defined(SO_ATTACH_REUSEPORT_CBPF)
+      // the destination socket ID is the 4th word of the UDT header; short packets go to the first socket
+      sock_filter code[] = {
+         BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 3 * 4),
+         BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)n),
+         BPF_STMT(BPF_RET | BPF_A, 0)
+      };
+      sock_fprog prog;
+      prog.len = sizeof(code) / sizeof(sock_filter);
+      prog.filter = code;
+
+      return 0 == setsockopt(m_iSocket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, (char*)&prog, sizeof(prog));
+   #else
+      return n <= 1;
+   #endif
+}
+
 void CChannel::setUDPSockOpt()
 {
    #if defined(BSD) || defined(OSX)
@@ -177,6 +231,25 @@ void CChannel::setUDPSockOpt()
       if (0 != setsockopt(m_iSocket, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof(timeval)))
          throw CUDTException(1, 3, NET_ERROR);
    #endif
+
+   // segmentation offload, where the kernel has it (Linux 4.18 for UDP_SEGMENT, 5.0 for UDP_GRO)
+   #if defined(LINUX) && defined(UDP_SEGMENT)
+      int nogso = 0;
+      if (m_bGSO && (0 != setsockopt(m_iSocket, SOL_UDP, UDP_SEGMENT, (char*)&nogso, sizeof(int))))
+         m_bGSO = false;
+   #else
+      m_bGSO = false;
+   #endif
+
+   #if defined(LINUX) && defined(UDP_GRO)
+      int gro = 1;
+      if (m_bGRO && (0 != setsockopt(m_iSocket, SOL_UDP, UDP_GRO, (char*)&gro, sizeof(int))))
+         m_bGRO = false;
+      if (m_bGRO && (NULL == m_pGROBuf))
+         m_pGROBuf = new char[m_iMaxDatagram];
+   #else
+      m_bGRO = false;
+   #endif
 }
 
 void CChannel::close() const
@@ -216,6 +289,17 @@ void CChannel::setRcvBufSize(const int& size)
    m_iRcvBufSize = size;
 }
 
+void CChannel::setOffload(const bool& gso, const bool& gro)
+{
+   m_bGSO = gso;
+   m_bGRO = gro;
+}
+
+void CChannel::setReusePort(const bool& reuse)
+{
+   m_bReusePort = reuse;
+}
+
 void CChannel::getSockAddr(sockaddr* addr) const
 {
    socklen_t namelen = (AF_INET == m_iIPversion) ? sizeof(sockaddr_in) : sizeof(sockaddr_in6);
@@ -230,7 +314,11 @@ void CChannel::getPeerAddr(sockaddr* addr) const
    getpeername(m_iSocket, addr, &namelen);
 }
 
-int CChannel::sendto(const sockaddr* addr, CPacket& packet) const
+const int CChannel::m_iBatchSize;
+const int CChannel::m_iMaxDatagram;
+const int CChannel::m_iMaxSegments;
+
+void CChannel::toNetwork(CPacket& packet)
 {
    // convert control information into network order
    if (packet.getFlag())
@@ -238,14 +326,32 @@ int CChannel::sendto(const sockaddr* addr, CPacket& packet) const
          *((uint32_t *)packet.m_pcData + i) = htonl(*((uint32_t *)packet.m_pcData + i));
 
    // convert packet header into network order
-   //for (int j = 0; j < 4; ++ j)
-   //   packet.m_nHeader[j] = htonl(packet.m_nHeader[j]);
    uint32_t* p = packet.m_nHeader;
    for (int j = 0; j < 4; ++ j)
    {
       *p = htonl(*p);
       ++ p;
    }
+}
+
+void CChannel::toHost(CPacket& packet)
+{
+   // convert packet header into local host order
+   uint32_t* p = packet.m_nHeader;
+   for (int k = 0; k < 4; ++ k)
+   {
+      *p = ntohl(*p);
+      ++ p;
+   }
+
+   if (packet.getFlag())
+      for (int l = 0, n = packet.getLength() / 4; l < n; ++ l)
+         *((uint32_t *)packet.m_pcData + l) = ntohl(*((uint32_t *)packet.m_pcData + l));
+}
+
+int CChannel::sendto(const sockaddr* addr, CPacket& packet) const
+{
+   toNetwork(packet);
 
    #ifndef WIN32
       msghdr mh;
@@ -265,19 +371,7 @@ int CChannel::sendto(const sockaddr* addr, CPacket& packet) const
       res = (0 == res) ? size : -1;
    #endif
 
-   // convert back into local host order
-   //for (int k = 0; k < 4; ++ k)
-   //   packet.m_nHeader[k] = ntohl(packet.m_nHeader[k]);
-   p = packet.m_nHeader;
-   for (int k = 0; k < 4; ++ k)
-   {
-      *p = ntohl(*p);
-       ++ p;
-   }
-
-   if (packet.getFlag())
-      for (int l = 0, n = packet.getLength() / 4; l < n; ++ l)
-         *((uint32_t *)packet.m_pcData + l) = ntohl(*((uint32_t *)packet.m_pcData + l));
+   toHost(packet);
 
    return res;
 }
@@ -322,19 +416,228 @@ int CChannel::recvfrom(sockaddr* addr, CPacket& packet) const
 
    packet.setLength(res - CPacket::m_iPktHdrSize);
 
-   // convert back into local host order
-   //for (int i = 0; i < 4; ++ i)
-   //   packet.m_nHeader[i] = ntohl(packet.m_nHeader[i]);
-   uint32_t* p = packet.m_nHeader;
-   for (int i = 0; i < 4; ++ i)
+   toHost(packet);
+
+   return packet.getLength();
+}
+
+int CChannel::sendBatch(sockaddr* const* addrs, CPacket* const* packets, const int& n) const
+{
+   #ifdef LINUX
+      mmsghdr mh[m_iBatchSize];
+      iovec iov[2 * m_iBatchSize];
+      int first[m_iBatchSize + 1];        // first packet of each message
+      #ifdef UDP_SEGMENT
+         char ctrl[m_iBatchSize][CMSG_SPACE(sizeof(uint16_t))];
+      #endif
+      socklen_t namelen = (AF_INET == m_iIPversion) ? sizeof(sockaddr_in) : sizeof(sockaddr_in6);
+      // a GSO run is one UDP datagram, its payload must leave room for the UDP and IP headers
+      int maxpayload = m_iMaxDatagram - 8 - ((AF_INET == m_iIPversion) ? 20 : 40);
+      int msgs = 0;
+      int sent = 0;
+
+      for (int i = 0; i < n; ++ i)
+      {
+         toNetwork(*packets[i]);
+         iov[2 * i] = packets[i]->m_PacketVector[0];
+         iov[2 * i + 1] = packets[i]->m_PacketVector[1];
+      }
+
+      for (int i = 0; i < n; )
+      {
+         // with GSO, a run of packets to the same peer socket, all of the first one's size
+         // but the last that may be shorter, leaves as one datagram cut up by the kernel;
+         // a receiver sharding its port by socket ID sees only the first header
+         int size = CPacket::m_iPktHdrSize + packets[i]->getLength();
+         int total = size;
+         int j = i + 1;
+         while (m_bGSO && (j < n) && (j - i < m_iMaxSegments))
+         {
+            int next = CPacket::m_iPktHdrSize + packets[j]->getLength();
+            if ((next > size) || (total + next > maxpayload) || (packets[j]->m_iID != packets[i]->m_iID) ||
+                ((addrs[j] != addrs[i]) && (0 != memcmp(addrs[j], addrs[i], namelen))))
+               break;
+            total += next;
+            ++ j;
+            if (next < size)
+               break;
+         }
+
+         msghdr& h = mh[msgs].msg_hdr;
+         h.msg_name = addrs[i];
+         h.msg_namelen = namelen;
+         h.msg_iov = iov + 2 * i;
+         h.msg_iovlen = 2 * (j - i);
+         h.msg_control = NULL;
+         h.msg_controllen = 0;
+         h.msg_flags = 0;
+
+         #ifdef UDP_SEGMENT
+            if (j - i > 1)
+            {
+               h.msg_control = ctrl[msgs];
+               h.msg_controllen = sizeof(ctrl[msgs]);
+               cmsghdr* cm = CMSG_FIRSTHDR(&h);
+               cm->cmsg_level = SOL_UDP;
+               cm->cmsg_type = UDP_SEGMENT;
+               cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+               *(uint16_t*)CMSG_DATA(cm) = size;
+            }
+         #endif
+
+         first[msgs ++] = i;
+         i = j;
+      }
+      first[msgs] = n;
+
+      // a message the socket refuses is skipped, as sendto() would drop it
+      int done = 0;
+      while (done < msgs)
+      {
+         int res = sendmmsg(m_iSocket, mh + done, msgs - done, 0);
+         if (res > 0)
+         {
+            for (int k = done; k < done + res; ++ k)
+               sent += first[k + 1] - first[k];
+            done += res;
+         }
+         else if ((res < 0) && (EINTR == errno))
+            continue;
+         else if ((res < 0) && (NULL != mh[done].msg_hdr.msg_control) && ((EIO == errno) || (EINVAL == errno) || (EMSGSIZE == errno)))
+         {
+            // the run does not fit one datagram, or the device cannot segment (no checksum
+            // offload): send this run one by one, and in the latter case from now on
+            if (EMSGSIZE != errno)
+               m_bGSO = false;
+            for (int k = first[done]; k < first[done + 1]; ++ k)
+            {
+               msghdr one = mh[done].msg_hdr;
+               one.msg_iov = iov + 2 * k;
+               one.msg_iovlen = 2;
+               one.msg_control = NULL;
+               one.msg_controllen = 0;
+               if (sendmsg(m_iSocket, &one, 0) >= 0)
+                  ++ sent;
+            }
+            ++ done;
+         }
+         else
+            ++ done;
+      }
+
+      for (int j = 0; j < n; ++ j)
+         toHost(*packets[j]);
+
+      return sent;
+   #else
+      int sent = 0;
+      for (int i = 0; i < n; ++ i)
+         if (sendto(addrs[i], *packets[i]) >= 0)
+            ++ sent;
+      return sent;
+   #endif
+}
+
+int CChannel::recvBatch(sockaddr* const* addrs, CPacket* const* packets, const int& n) const
+{
+   #ifdef LINUX
+      #ifdef UDP_GRO
+         if (m_bGRO)
+            return recvGRO(addrs, packets, n);
+      #endif
+
+      mmsghdr mh[m_iBatchSize];
+
+      for (int i = 0; i < n; ++ i)
+      {
+         mh[i].msg_hdr.msg_name = addrs[i];
+         mh[i].msg_hdr.msg_namelen = (AF_INET == m_iIPversion) ? sizeof(sockaddr_in) : sizeof(sockaddr_in6);
+         mh[i].msg_hdr.msg_iov = packets[i]->m_PacketVector;
+         mh[i].msg_hdr.msg_iovlen = 2;
+         mh[i].msg_hdr.msg_control = NULL;
+         mh[i].msg_hdr.msg_controllen = 0;
+         mh[i].msg_hdr.msg_flags = 0;
+         mh[i].msg_len = 0;
+      }
+
+      // blocks (up to the socket's receive time-out) for the first packet only
+      int res = recvmmsg(m_iSocket, mh, n, MSG_WAITFORONE, NULL);
+      if (res <= 0)
+         return 0;
+
+      for (int j = 0; j < res; ++ j)
+      {
+         if (mh[j].msg_len < (unsigned int)CPacket::m_iPktHdrSize)
+         {
+            packets[j]->setLength(-1);
+            continue;
+         }
+
+         packets[j]->setLength(mh[j].msg_len - CPacket::m_iPktHdrSize);
+         toHost(*packets[j]);
+      }
+
+      return res;
+   #else
+      return (recvfrom(addrs[0], *packets[0]) < 0) ? 0 : 1;
+   #endif
+}
+
+#if defined(LINUX) && defined(UDP_GRO)
+int CChannel::recvGRO(sockaddr* const* addrs, CPacket* const* packets, const int& n) const
+{
+   socklen_t namelen = (AF_INET == m_iIPversion) ? sizeof(sockaddr_in) : sizeof(sockaddr_in6);
+
+   // a coalesced datagram can hold more packets than units were offered; the rest waits here
+   if (m_iGROOffset >= m_iGROLength)
    {
-      *p = ntohl(*p);
-      ++ p;
+      char ctrl[CMSG_SPACE(sizeof(int))];
+      iovec iov;
+      iov.iov_base = m_pGROBuf;
+      iov.iov_len = m_iMaxDatagram;
+
+      msghdr mh;
+      mh.msg_name = &m_GROAddr;
+      mh.msg_namelen = namelen;
+      mh.msg_iov = &iov;
+      mh.msg_iovlen = 1;
+      mh.msg_control = ctrl;
+      mh.msg_controllen = sizeof(ctrl);
+      mh.msg_flags = 0;
+
+      int res = recvmsg(m_iSocket, &mh, 0);
+      if (res <= 0)
+         return 0;
+
+      m_iGROSegment = res;
+      for (cmsghdr* cm = CMSG_FIRSTHDR(&mh); NULL != cm; cm = CMSG_NXTHDR(&mh, cm))
+         if ((SOL_UDP == cm->cmsg_level) && (UDP_GRO == cm->cmsg_type))
+            m_iGROSegment = *(int*)CMSG_DATA(cm);
+      m_iGROOffset = 0;
+      m_iGROLength = res;
    }
 
-   if (packet.getFlag())
-      for (int j = 0, n = packet.getLength() / 4; j < n; ++ j)
-         *((uint32_t *)packet.m_pcData + j) = ntohl(*((uint32_t *)packet.m_pcData + j));
+   // split it back into packets, one per unit
+   int count = 0;
+   for (; (m_iGROOffset < m_iGROLength) && (count < n); m_iGROOffset += m_iGROSegment, ++ count)
+   {
+      int len = (m_iGROLength - m_iGROOffset < m_iGROSegment) ? m_iGROLength - m_iGROOffset : m_iGROSegment;
+      char* seg = m_pGROBuf + m_iGROOffset;
 
-   return packet.getLength();
+      memcpy(addrs[count], &m_GROAddr, namelen);
+
+      if ((len < CPacket::m_iPktHdrSize) || (len - CPacket::m_iPktHdrSize > packets[count]->getLength()))
+      {
+         packets[count]->setLength(-1);
+         continue;
+      }
+
+      memcpy(packets[count]->m_nHeader, seg, CPacket::m_iPktHdrSize);
+      memcpy(packets[count]->m_pcData, seg + CPacket::m_iPktHdrSize, len - CPacket::m_iPktHdrSize);
+      packets[count]->setLength(len - CPacket::m_iPktHdrSize);
+      toHost(*packets[count]);
+   }
+
+   return count;
 }
+#endif
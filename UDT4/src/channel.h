@@ -71,6 +71,25 @@ public:
 
    void open(UDPSOCKET udpsock);
 
+      // Functionality:
+      //    Open one more UDP socket on the port of another channel, which was opened with setReusePort(true).
+      // Parameters:
+      //    0) [in] c: the channel whose port to share.
+      // Returned value:
+      //    None.
+
+   void join(const CChannel* c);
+
+      // Functionality:
+      //    Have the system hand each packet arriving on the port to socket (destination socket ID % n),
+      //    in the order the sockets were opened.
+      // Parameters:
+      //    0) [in] n: number of sockets on the port.
+      // Returned value:
+      //    true if the system supports it.
+
+   bool shard(const int& n) const;
+
       // Functionality:
       //    Disconnect and close the UDP entity.
       // Parameters:
@@ -116,6 +135,26 @@ public:
 
    void setRcvBufSize(const int& size);
 
+      // Functionality:
+      //    Ask for UDP segmentation offload on sending and receive offload on receiving;
+      //    what the system does not support stays off.
+      // Parameters:
+      //    0) [in] gso: send runs of same-size packets to one peer as one UDP_SEGMENT super-datagram.
+      //    1) [in] gro: accept coalesced datagrams (UDP_GRO) and split them into packets.
+      // Returned value:
+      //    None.
+
+   void setOffload(const bool& gso, const bool& gro);
+
+      // Functionality:
+      //    Let other sockets share the port (SO_REUSEPORT); must be set before open().
+      // Parameters:
+      //    0) [in] reuse: share or not.
+      // Returned value:
+      //    None.
+
+   void setReusePort(const bool& reuse);
+
       // Functionality:
       //    Query the socket address that the channel is using.
       // Parameters:
@@ -154,9 +193,53 @@ public:
 
    int recvfrom(sockaddr* addr, CPacket& packet) const;
 
+      // Functionality:
+      //    Send a number of packets, each to its own address, with as few system calls as possible.
+      // Parameters:
+      //    0) [in] addrs: destination address of each packet.
+      //    1) [in] packets: the packets.
+      //    2) [in] n: number of packets, at most m_iBatchSize.
+      // Returned value:
+      //    Number of packets sent.
+
+   int sendBatch(sockaddr* const* addrs, CPacket* const* packets, const int& n) const;
+
+      // Functionality:
+      //    Receive up to n packets, waiting only for the first one.
+      // Parameters:
+      //    0) [in] addrs: pointers to store the source address of each packet.
+      //    1) [in] packets: the packets to fill, with their buffer lengths set.
+      //    2) [in] n: number of packets, at most m_iBatchSize.
+      // Returned value:
+      //    Number of packets received; the length of each is set, -1 for a runt.
+
+   int recvBatch(sockaddr* const* addrs, CPacket* const* packets, const int& n) const;
+
+public:
+   static const int m_iBatchSize = 32;  // most packets per sendBatch/recvBatch
+
 private:
    void setUDPSockOpt();
 
+      // Functionality:
+      //    Convert a packet between host and network byte order.
+      // Parameters:
+      //    0) [in, out] packet: the packet; the control information is converted too.
+      // Returned value:
+      //    None.
+
+   static void toNetwork(CPacket& packet);
+   static void toHost(CPacket& packet);
+
+      // Functionality:
+      //    recvBatch() with UDP_GRO: receive one datagram, possibly coalesced, and split it into packets.
+      // Parameters:
+      //    As for recvBatch().
+      // Returned value:
+      //    Number of packets.
+
+   int recvGRO(sockaddr* const* addrs, CPacket* const* packets, const int& n) const;
+
 private:
    int m_iIPversion;                    // IP version
 
@@ -168,6 +251,18 @@ private:
 
    int m_iSndBufSize;                   // UDP sending buffer size
    int m_iRcvBufSize;                   // UDP receiving buffer size
+
+   mutable bool m_bGSO;                 // sending with UDP_SEGMENT, turned off if the device refuses it
+   bool m_bGRO;                         // receiving with UDP_GRO
+   char* m_pGROBuf;                     // coalesced datagrams land here before being split
+   mutable int m_iGROOffset;            // next packet in m_pGROBuf not yet handed out
+   mutable int m_iGROLength;            // bytes in m_pGROBuf
+   mutable int m_iGROSegment;           // size of each coalesced packet, the last may be shorter
+   mutable sockaddr_in6 m_GROAddr;      // sender of the datagram in m_pGROBuf
+
+   bool m_bReusePort;                   // SO_REUSEPORT, for a port read by several sockets
+   static const int m_iMaxDatagram = 65535;   // largest IP datagram, headers included
+   static const int m_iMaxSegments = 64; // kernel limit of segments per GSO datagram
 };
 
 
@@ -42,6 +42,10 @@ written by
 #ifndef WIN32
    #include <cstring>
    #include <cerrno>
+   #include <unistd.h>
+   #ifdef LINUX
+      #include <sys/timerfd.h>
+   #endif
 #else
    #include <winsock2.h>
    #include <ws2tcpip.h>
@@ -70,6 +74,9 @@ m_TickLock()
    #ifndef WIN32
       pthread_mutex_init(&m_TickLock, NULL);
       pthread_cond_init(&m_TickCond, NULL);
+      #ifdef LINUX
+         m_iTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+      #endif
    #else
       m_TickLock = CreateMutex(NULL, false, NULL);
       m_TickCond = CreateEvent(NULL, false, false, NULL);
@@ -81,6 +88,10 @@ CTimer::~CTimer()
    #ifndef WIN32
       pthread_mutex_destroy(&m_TickLock);
       pthread_cond_destroy(&m_TickCond);
+      #ifdef LINUX
+         if (m_iTimerFd >= 0)
+            close(m_iTimerFd);
+      #endif
    #else
       CloseHandle(m_TickLock);
       CloseHandle(m_TickCond);
@@ -168,6 +179,39 @@ void CTimer::sleepto(const uint64_t& nexttime)
    uint64_t t;
    rdtsc(t);
 
+   #if defined(NO_BUSY_WAITING) && defined(LINUX)
+      if (m_iTimerFd >= 0)
+      {
+         while (t < m_ullSchedTime)
+         {
+            // arm the timer at the deadline on the monotonic clock, to the nanosecond
+            uint64_t ns = (m_ullSchedTime - t) * 1000 / s_ullCPUFrequency;
+            timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            ns += now.tv_nsec;
+
+            itimerspec deadline;
+            memset(&deadline, 0, sizeof(itimerspec));
+            deadline.it_value.tv_sec = now.tv_sec + ns / 1000000000;
+            deadline.it_value.tv_nsec = ns % 1000000000;
+            timerfd_settime(m_iTimerFd, TFD_TIMER_ABSTIME, &deadline, NULL);
+
+            // interrupt() fires the timer at once, but it may have come before the timer was armed
+            rdtsc(t);
+            if (t < m_ullSchedTime)
+            {
+               uint64_t expirations;
+               if (read(m_iTimerFd, &expirations, sizeof(uint64_t)) < 0)
+                  expirations = 0;
+            }
+
+            rdtsc(t);
+         }
+
+         return;
+      }
+   #endif
+
    while (t < m_ullSchedTime)
    {
       #ifndef NO_BUSY_WAITING
@@ -210,6 +254,16 @@ void CTimer::interrupt()
    // schedule the sleepto time to the current CCs, so that it will stop
    rdtsc(m_ullSchedTime);
 
+   #if defined(NO_BUSY_WAITING) && defined(LINUX)
+      if (m_iTimerFd >= 0)
+      {
+         itimerspec now;
+         memset(&now, 0, sizeof(itimerspec));
+         now.it_value.tv_nsec = 1;
+         timerfd_settime(m_iTimerFd, 0, &now, NULL);
+      }
+   #endif
+
    tick();
 }
 
@@ -82,7 +82,8 @@ public:
    void sleep(const uint64_t& interval);
 
       // Functionality:
-      //    Seelp until CC "nexttime".
+      //    Seelp until CC "nexttime". Without busy waiting, Linux waits on a timerfd armed
+      //    at the deadline; packets falling behind meanwhile are sent together on wake up.
       // Parameters:
       //    0) [in] nexttime: next time the caller is waken up.
       // Returned value:
@@ -161,6 +162,10 @@ private:
    pthread_cond_t m_TickCond;
    pthread_mutex_t m_TickLock;
 
+   #ifdef LINUX
+      int m_iTimerFd;			// timerfd the non-busy sleep waits on, -1 if not available
+   #endif
+
    static pthread_cond_t m_EventCond;
    static pthread_mutex_t m_EventLock;
 
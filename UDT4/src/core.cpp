@@ -114,6 +114,9 @@ CUDT::CUDT()
    m_iRcvTimeOut = -1;
    m_bReuseAddr = true;
    m_llMaxBW = -1;
+   m_bGSO = true;
+   m_bGRO = false;
+   m_iRcvWorkers = 1;
 
    m_pCCFactory = new CCCFactory<CUDTCC>;
    m_pCC = NULL;
@@ -164,6 +167,9 @@ CUDT::CUDT(const CUDT& ancestor)
    m_iRcvTimeOut = ancestor.m_iRcvTimeOut;
    m_bReuseAddr = true;	// this must be true, because all accepted sockets shared the same port with the listener
    m_llMaxBW = ancestor.m_llMaxBW;
+   m_bGSO = ancestor.m_bGSO;
+   m_bGRO = ancestor.m_bGRO;
+   m_iRcvWorkers = ancestor.m_iRcvWorkers;
 
    m_pCCFactory = ancestor.m_pCCFactory->clone();
    m_pCC = NULL;
@@ -336,6 +342,26 @@ void CUDT::setOpt(UDTOpt optName, const void* optval, const int&)
          throw CUDTException(5, 1, 0);
       m_llMaxBW = *(int64_t*)optval;
       break;
+
+   case UDT_GSO:
+      if (m_bOpened)
+         throw CUDTException(5, 1, 0);
+      m_bGSO = *(bool*)optval;
+      break;
+
+   case UDT_GRO:
+      if (m_bOpened)
+         throw CUDTException(5, 1, 0);
+      m_bGRO = *(bool*)optval;
+      break;
+
+   case UDT_RCVWORKERS:
+      if (m_bOpened)
+         throw CUDTException(5, 1, 0);
+      if (*(int*)optval < 1)
+         throw CUDTException(5, 3, 0);
+      m_iRcvWorkers = *(int*)optval;
+      break;
     
    default:
       throw CUDTException(5, 0, 0);
@@ -428,6 +454,21 @@ void CUDT::getOpt(UDTOpt optName, void* optval, int& optlen)
       *(int64_t*)optval = m_llMaxBW;
       break;
 
+   case UDT_GSO:
+      *(bool *)optval = m_bGSO;
+      optlen = sizeof(bool);
+      break;
+
+   case UDT_GRO:
+      *(bool *)optval = m_bGRO;
+      optlen = sizeof(bool);
+      break;
+
+   case UDT_RCVWORKERS:
+      *(int*)optval = m_iRcvWorkers;
+      optlen = sizeof(int);
+      break;
+
    default:
       throw CUDTException(5, 0, 0);
    }
@@ -459,7 +500,10 @@ void CUDT::open()
       m_pSNode = new CSNode;
    m_pSNode->m_pUDT = this;
    m_pSNode->m_llTimeStamp = 1;
-   m_pSNode->m_iHeapLoc = -1;
+   m_pSNode->m_pPrev = m_pSNode->m_pNext = m_pSNode->m_pNextPending = NULL;
+   m_pSNode->m_iLevel = 0;
+   m_pSNode->m_iSlot = -1;
+   m_pSNode->m_iPending = m_pSNode->m_iReschedule = 0;
 
    if (NULL == m_pRNode)
       m_pRNode = new CRNode;
@@ -681,7 +725,7 @@ void CUDT::connect(const sockaddr* serv_addr)
    try
    {
       m_pSndBuffer = new CSndBuffer(32, m_iPayloadSize);
-      m_pRcvBuffer = new CRcvBuffer(m_iRcvBufSize, &(m_pRcvQueue->m_UnitQueue));
+      m_pRcvBuffer = new CRcvBuffer(m_iRcvBufSize, m_pRcvQueue->getUnitQueue(m_SocketID));
       // after introducing lite ACK, the sndlosslist may not be cleared in time, so it requires twice space.
       m_pSndLossList = new CSndLossList(m_iFlowWindowSize * 2);
       m_pRcvLossList = new CRcvLossList(m_iFlightFlagSize);
@@ -782,7 +826,7 @@ void CUDT::connect(const sockaddr* peer, CHandShake* hs)
    try
    {
       m_pSndBuffer = new CSndBuffer(32, m_iPayloadSize);
-      m_pRcvBuffer = new CRcvBuffer(m_iRcvBufSize, &(m_pRcvQueue->m_UnitQueue));
+      m_pRcvBuffer = new CRcvBuffer(m_iRcvBufSize, m_pRcvQueue->getUnitQueue(m_SocketID));
       m_pSndLossList = new CSndLossList(m_iFlowWindowSize * 2);
       m_pRcvLossList = new CRcvLossList(m_iFlightFlagSize);
       m_pACKWindow = new CACKWindow(4096);
@@ -1336,6 +1380,64 @@ int64_t CUDT::sendfile(FILE* ifd, const int64_t& offset, const int64_t& size, co
    return size - tosend;
 }
 
+#ifndef WIN32
+int64_t CUDT::sendfile(int fd, const int64_t& offset, const int64_t& size, const int& block)
+{
+   if (UDT_DGRAM == m_iSockType)
+      throw CUDTException(5, 10, 0);
+
+   if (m_bBroken || m_bClosing)
+      throw CUDTException(2, 1, 0);
+   else if (!m_bConnected)
+      throw CUDTException(2, 2, 0);
+
+   if (size <= 0)
+      return 0;
+
+   CGuard sendguard(m_SendLock);
+
+   int64_t tosend = size;
+   int unitsize;
+
+   // sending block by block, each read at its offset straight into the packet slots
+   while (tosend > 0)
+   {
+      unitsize = int((tosend >= block) ? block : tosend);
+
+      pthread_mutex_lock(&m_SendBlockLock);
+      while (!m_bBroken && m_bConnected && !m_bClosing && (m_iSndBufSize <= m_pSndBuffer->getCurrBufSize()))
+         pthread_cond_wait(&m_SendBlockCond, &m_SendBlockLock);
+      pthread_mutex_unlock(&m_SendBlockLock);
+
+      if (m_bBroken || m_bClosing)
+         throw CUDTException(2, 1, 0);
+      else if (!m_bConnected)
+         throw CUDTException(2, 2, 0);
+
+      // record total time used for sending
+      if (0 == m_pSndBuffer->getCurrBufSize())
+         m_llSndDurationCounter = CTimer::getTime();
+
+      // a read error fails the call even if earlier blocks went out, never a short count
+      int added = m_pSndBuffer->addBufferFromFd(fd, offset + (size - tosend), unitsize);
+      if (added < 0)
+         throw CUDTException(4, 2);
+
+      tosend -= added;
+
+      // insert this socket to snd list if it is not on the list yet
+      if (added > 0)
+         m_pSndQueue->m_pSndUList->update(this, false);
+
+      // end of file
+      if (added < unitsize)
+         break;
+   }
+
+   return size - tosend;
+}
+#endif
+
 int64_t CUDT::recvfile(fstream& ofs, const int64_t& offset, const int64_t& size, const int& block)
 {
    if (UDT_DGRAM == m_iSockType)
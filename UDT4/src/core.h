@@ -94,6 +94,9 @@ public: //API
    static int recvmsg(UDTSOCKET u, char* buf, int len);
    static int64_t sendfile(UDTSOCKET u, std::fstream& ifs, const int64_t& offset, const int64_t& size, const int& block = 364000);
    static int64_t sendfile(UDTSOCKET u, FILE* ifd, const int64_t& offset, const int64_t& size, const int& block = 364000);
+#ifndef WIN32
+   static int64_t sendfile(UDTSOCKET u, int fd, const int64_t& offset, const int64_t& size, const int& block = 364000);
+#endif
    static int64_t recvfile(UDTSOCKET u, std::fstream& ofs, const int64_t& offset, const int64_t& size, const int& block = 7280000);
    static int select(int nfds, ud_set* readfds, ud_set* writefds, ud_set* exceptfds, const timeval* timeout);
    static int selectEx(const std::vector<UDTSOCKET>& fds, std::vector<UDTSOCKET>* readfds, std::vector<UDTSOCKET>* writefds, std::vector<UDTSOCKET>* exceptfds, int64_t msTimeOut);
@@ -199,10 +202,15 @@ private:
       //    2) [in] size: How many data to be sent.
       //    3) [in] block: size of block per read from disk
       // Returned value:
-      //    Actual size of data sent.
+      //    Actual size of data sent. From "fd", a read error throws, and only the
+      //    blocks before it were sent: a caller that must know how much went out
+      //    passes "size" no larger than "block".
 
    int64_t sendfile(std::fstream& ifs, const int64_t& offset, const int64_t& size, const int& block = 366000);
    int64_t sendfile(FILE* ifd, const int64_t& offset, const int64_t& size, const int& block = 366000);
+#ifndef WIN32
+   int64_t sendfile(int fd, const int64_t& offset, const int64_t& size, const int& block = 366000);
+#endif
 
       // Functionality:
       //    Request UDT to receive data into a file described as "fd", starting from "offset", with expected size of "size".
@@ -281,6 +289,9 @@ private: // Options
    int m_iRcvTimeOut;                           // receiving timeout in milliseconds
    bool m_bReuseAddr;				// reuse an exiting port or not, for UDP multiplexer
    int64_t m_llMaxBW;				// maximum data transfer rate (threshold)
+   bool m_bGSO;					// UDP segmentation offload for the multiplexer
+   bool m_bGRO;					// UDP receive offload for the multiplexer
+   int m_iRcvWorkers;				// number of receiving threads for the multiplexer
 
 private: // congestion control
    CCCVirtualFactory* m_pCCFactory;             // Factory class to create a specific CC instance
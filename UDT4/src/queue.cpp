@@ -222,17 +222,133 @@ CUnit* CUnitQueue::getNextAvailUnit()
    return NULL;
 }
 
+int CUnitQueue::getAvailUnits(CUnit** units, const int& n)
+{
+   if (m_iCount * 10 > m_iSize * 9)
+      increase();
+
+   int want = (n < m_iSize - m_iCount) ? n : m_iSize - m_iCount;
+   int found = 0;
+
+   // walk all units once, starting from the recent available one
+   CQEntry* q = m_pCurrQueue;
+   CUnit* u = m_pAvailUnit;
+   for (int i = 0; (i < m_iSize) && (found < want); ++ i)
+   {
+      if (0 == u->m_iFlag)
+      {
+         if (0 == found)
+         {
+            m_pCurrQueue = q;
+            m_pAvailUnit = u;
+         }
+         units[found ++] = u;
+      }
+
+      if (++ u == q->m_pUnit + q->m_iSize)
+      {
+         q = q->m_pNext;
+         u = q->m_pUnit;
+      }
+   }
+
+   if (0 == found)
+      increase();
+
+   return found;
+}
+
+
+// atomic primitives of the lock-free update submission
+static inline bool casNode(CSNode* volatile* p, CSNode* o, CSNode* n)
+{
+   #ifndef WIN32
+      return __sync_bool_compare_and_swap(p, o, n);
+   #else
+      return InterlockedCompareExchangePointer((PVOID volatile*)p, n, o) == o;
+   #endif
+}
+
+static inline CSNode* swapNode(CSNode* volatile* p, CSNode* n)
+{
+   #ifndef WIN32
+      return __sync_lock_test_and_set(p, n);
+   #else
+      return (CSNode*)InterlockedExchangePointer((PVOID volatile*)p, n);
+   #endif
+}
+
+static inline bool casFlag(volatile int* p, int o, int n)
+{
+   #ifndef WIN32
+      return __sync_bool_compare_and_swap(p, o, n);
+   #else
+      return InterlockedCompareExchange((volatile LONG*)p, n, o) == o;
+   #endif
+}
+
+static inline int swapFlag(volatile int* p, int n)
+{
+   #ifndef WIN32
+      return __sync_lock_test_and_set(p, n);
+   #else
+      return InterlockedExchange((volatile LONG*)p, n);
+   #endif
+}
+
+static inline void fence()
+{
+   #ifndef WIN32
+      __sync_synchronize();
+   #else
+      MemoryBarrier();
+   #endif
+}
+
+// position of the first set bit at or after "from" in a bitmap of "size" bits, -1 if none
+static int firstSet(const uint64_t* map, const int& size, const int& from)
+{
+   for (int i = from; i < size; i = (i | 63) + 1)
+   {
+      uint64_t w = map[i >> 6] >> (i & 63);
+      if (0 != w)
+      {
+         #ifdef __GNUC__
+            return i + __builtin_ctzll(w);
+         #else
+            while (0 == (w & 1))
+            {
+               w >>= 1;
+               ++ i;
+            }
+            return i;
+         #endif
+      }
+   }
+
+   return -1;
+}
 
 CSndUList::CSndUList():
-m_pHeap(NULL),
-m_iArrayLength(4096),
-m_iLastEntry(-1),
+m_ullWheelTime(0),
+m_ullCPUFreq(1),
+m_iCount(0),
+m_pPending(NULL),
+m_ullNextProcTime(0),
 m_ListLock(),
 m_pWindowLock(NULL),
 m_pWindowCond(NULL),
 m_pTimer(NULL)
 {
-   m_pHeap = new CSNode*[m_iArrayLength];
+   memset(m_pSlot, 0, sizeof(m_pSlot));
+   memset(m_pSlotTail, 0, sizeof(m_pSlotTail));
+   memset(m_pullMap, 0, sizeof(m_pullMap));
+
+   m_ullCPUFreq = CTimer::getCPUFrequency();
+   if (0 == m_ullCPUFreq)
+      m_ullCPUFreq = 1;
+   CTimer::rdtsc(m_ullWheelTime);
+   m_ullWheelTime /= m_ullCPUFreq;
 
    #ifndef WIN32
       pthread_mutex_init(&m_ListLock, NULL);
@@ -243,8 +359,6 @@ m_pTimer(NULL)
 
 CSndUList::~CSndUList()
 {
-   delete [] m_pHeap;
-
    #ifndef WIN32
       pthread_mutex_destroy(&m_ListLock);
    #else
@@ -256,62 +370,91 @@ void CSndUList::insert(const int64_t& ts, const CUDT* u)
 {
    CGuard listguard(m_ListLock);
 
-   // increase the heap array size if necessary
-   if (m_iLastEntry == m_iArrayLength - 1)
-   {
-      CSNode** temp = NULL;
-
-      try
-      {
-         temp = new CSNode*[m_iArrayLength * 2];
-      }
-      catch(...)
-      {
-         return;
-      }
+   insert_(ts, u);
 
-      memcpy(temp, m_pHeap, sizeof(CSNode*) * m_iArrayLength);
-      m_iArrayLength *= 2;
-      delete [] m_pHeap;
-      m_pHeap = temp;
+   // first entry, activate the sending queue
+   if (1 == m_iCount)
+   {
+      #ifndef WIN32
+         pthread_mutex_lock(m_pWindowLock);
+         pthread_cond_signal(m_pWindowCond);
+         pthread_mutex_unlock(m_pWindowLock);
+      #else
+         SetEvent(*m_pWindowCond);
+      #endif
    }
-
-   insert_(ts, u);
 }
 
 void CSndUList::update(const CUDT* u, const bool& reschedule)
 {
-   CGuard listguard(m_ListLock);
-
    CSNode* n = u->m_pSNode;
 
-   if (n->m_iHeapLoc >= 0)
+   if (reschedule)
+      n->m_iReschedule = 1;
+   else
    {
-      if (!reschedule)
+      // a node on the wheel stays as it is; the barrier pairs with the one in pop(), so that
+      // a node popped meanwhile either sends what the caller added or is seen off the wheel
+      fence();
+      if (*(volatile int*)&n->m_iSlot >= 0)
          return;
+   }
 
-      if (n->m_iHeapLoc == 0)
-      {
-         n->m_llTimeStamp = 1;
-         m_pTimer->interrupt();
-         return;
-      }
+   // a node is submitted only once until the sending thread picks it up
+   if (!casFlag(&n->m_iPending, 0, 1))
+      return;
 
-      remove_(u);
-   }
+   CSNode* head;
+   do
+   {
+      head = m_pPending;
+      n->m_pNextPending = head;
+   } while (!casNode(&m_pPending, head, n));
 
-   insert_(1, u);
+   if (NULL != head)
+      return;
+
+   // first submission since the last drain: wake up the sending queue if it waits for sockets,
+   // or cut its sleep short if that ends after now, when the update is due
+   uint64_t next = m_ullNextProcTime;
+   if (0 == next)
+   {
+      #ifndef WIN32
+         pthread_mutex_lock(m_pWindowLock);
+         pthread_cond_signal(m_pWindowCond);
+         pthread_mutex_unlock(m_pWindowLock);
+      #else
+         SetEvent(*m_pWindowCond);
+      #endif
+   }
+   else
+   {
+      uint64_t now;
+      CTimer::rdtsc(now);
+      if (now < next)
+         m_pTimer->interrupt();
+   }
 }
 
 int CSndUList::pop(sockaddr*& addr, CPacket& pkt)
 {
    CGuard listguard(m_ListLock);
 
-   if (-1 == m_iLastEntry)
+   drain_();
+
+   if (0 == m_iCount)
       return -1;
 
-   CUDT* u = m_pHeap[0]->m_pUDT;
-   remove_(u);
+   uint64_t now;
+   CTimer::rdtsc(now);
+   CSNode* n = expire_(now / m_ullCPUFreq);
+   if (NULL == n)
+      return -1;
+
+   // pairs with update(): the node is off the wheel before its data is looked at
+   fence();
+
+   CUDT* u = n->m_pUDT;
 
    if (!u->m_bConnected || u->m_bBroken)
       return -1;
@@ -334,6 +477,9 @@ void CSndUList::remove(const CUDT* u)
 {
    CGuard listguard(m_ListLock);
 
+   // the node may still be waiting on the stack of submitted updates
+   drain_();
+
    remove_(u);
 }
 
@@ -341,10 +487,28 @@ uint64_t CSndUList::getNextProcTime()
 {
    CGuard listguard(m_ListLock);
 
-   if (-1 == m_iLastEntry)
-      return 0;
+   uint64_t ts;
+   for (;;)
+   {
+      drain_();
 
-   return m_pHeap[0]->m_llTimeStamp;
+      ts = 0;
+      if (m_iCount > 0)
+      {
+         ts = next_() * m_ullCPUFreq;
+         if (0 == ts)
+            ts = 1;
+      }
+
+      // publish until when the sending thread sleeps, then look again for updates
+      // submitted meanwhile, which may have seen the old time and not woken it up
+      m_ullNextProcTime = ts;
+      fence();
+      if (NULL == m_pPending)
+         break;
+   }
+
+   return ts;
 }
 
 void CSndUList::insert_(const int64_t& ts, const CUDT* u)
@@ -352,80 +516,185 @@ void CSndUList::insert_(const int64_t& ts, const CUDT* u)
    CSNode* n = u->m_pSNode;
 
    // do not insert repeated node
-   if (n->m_iHeapLoc >= 0)
+   if (n->m_iSlot >= 0)
       return;
 
-   m_iLastEntry ++;
-   m_pHeap[m_iLastEntry] = n;
    n->m_llTimeStamp = ts;
+   place_(n);
+}
 
-   int q = m_iLastEntry;
-   int p = q;
-   while (p != 0)
+void CSndUList::remove_(const CUDT* u)
+{
+   CSNode* n = u->m_pSNode;
+
+   if (n->m_iSlot < 0)
+      return;
+
+   if (NULL != n->m_pPrev)
+      n->m_pPrev->m_pNext = n->m_pNext;
+   else
+      m_pSlot[n->m_iLevel][n->m_iSlot] = n->m_pNext;
+   if (NULL != n->m_pNext)
+      n->m_pNext->m_pPrev = n->m_pPrev;
+   else
+      m_pSlotTail[n->m_iLevel][n->m_iSlot] = n->m_pPrev;
+
+   if (NULL == m_pSlot[n->m_iLevel][n->m_iSlot])
+      m_pullMap[n->m_iLevel][n->m_iSlot >> 6] &= ~(1ULL << (n->m_iSlot & 63));
+
+   n->m_iSlot = -1;
+   -- m_iCount;
+}
+
+void CSndUList::drain_()
+{
+   CSNode* n = swapNode(&m_pPending, NULL);
+
+   while (NULL != n)
    {
-      p = (q - 1) >> 1;
-      if (m_pHeap[p]->m_llTimeStamp > m_pHeap[q]->m_llTimeStamp)
+      CSNode* next = n->m_pNextPending;
+
+      // release the node before reading the flag, so that a concurrent reschedule
+      // request is either seen here or submitted again
+      casFlag(&n->m_iPending, 1, 0);
+      bool reschedule = (0 != swapFlag(&n->m_iReschedule, 0));
+
+      if (n->m_iSlot < 0)
+         insert_(1, n->m_pUDT);
+      else if (reschedule)
       {
-         CSNode* t = m_pHeap[p];
-         m_pHeap[p] = m_pHeap[q];
-         m_pHeap[q] = t;
-         t->m_iHeapLoc = q;
-         q = p;
+         remove_(n->m_pUDT);
+         insert_(1, n->m_pUDT);
       }
-      else
-         break;
-   }
 
-   n->m_iHeapLoc = q;
+      n = next;
+   }
+}
 
-   // first entry, activate the sending queue
-   if (0 == m_iLastEntry)
+void CSndUList::place_(CSNode* n)
+{
+   // nodes already due go to the current slot
+   uint64_t t = n->m_llTimeStamp / m_ullCPUFreq;
+   if (t < m_ullWheelTime)
+      t = m_ullWheelTime;
+
+   // pick the finest level whose span covers the distance, beyond the top level
+   // the node is parked in its last slot and placed again when cascaded from there
+   uint64_t delta = t - m_ullWheelTime;
+   int level = 0;
+   int bits = m_iL0Bits;
+   while ((level < m_iLevels - 1) && (delta >= (1ULL << bits)))
    {
-      #ifndef WIN32
-         pthread_mutex_lock(m_pWindowLock);
-         pthread_cond_signal(m_pWindowCond);
-         pthread_mutex_unlock(m_pWindowLock);
-      #else
-         SetEvent(*m_pWindowCond);
-      #endif
+      ++ level;
+      bits += m_iLnBits;
    }
+   if (delta >= (1ULL << bits))
+      t = m_ullWheelTime + (1ULL << bits) - 1;
+
+   int shift = (0 == level) ? 0 : bits - m_iLnBits;
+   int slot = (int)((t >> shift) & ((1ULL << (bits - shift)) - 1));
+
+   n->m_iLevel = level;
+   n->m_iSlot = slot;
+   // append, so that a socket made due again after a late send queues behind the others
+   n->m_pPrev = m_pSlotTail[level][slot];
+   n->m_pNext = NULL;
+   if (NULL != n->m_pPrev)
+      n->m_pPrev->m_pNext = n;
+   else
+      m_pSlot[level][slot] = n;
+   m_pSlotTail[level][slot] = n;
+   m_pullMap[level][slot >> 6] |= 1ULL << (slot & 63);
+
+   ++ m_iCount;
 }
 
-void CSndUList::remove_(const CUDT* u)
+uint64_t CSndUList::next_() const
 {
-   CSNode* n = u->m_pSNode;
+   // level 0: the rest of the current round, then the slots already wrapped into the next round
+   uint64_t base = m_ullWheelTime & ~((1ULL << m_iL0Bits) - 1);
+   int cur = (int)(m_ullWheelTime - base);
+   uint64_t first = 0;
+
+   int i = firstSet(m_pullMap[0], 1 << m_iL0Bits, cur);
+   if (i >= 0)
+      return base + i;
+   i = firstSet(m_pullMap[0], cur, 0);
+   if (i >= 0)
+      first = base + (1ULL << m_iL0Bits) + i;
+
+   // higher levels: a slot is processed when the wheel time reaches its start;
+   // the current slot has been cascaded already and now holds the next round
+   int shift = m_iL0Bits;
+   for (int level = 1; level < m_iLevels; ++ level, shift += m_iLnBits)
+   {
+      uint64_t round = (m_ullWheelTime >> shift) & ~((1ULL << m_iLnBits) - 1);
+      cur = (int)((m_ullWheelTime >> shift) - round);
+
+      i = firstSet(m_pullMap[level], 1 << m_iLnBits, cur + 1);
+      if (i < 0)
+      {
+         i = firstSet(m_pullMap[level], cur + 1, 0);
+         if (i < 0)
+            continue;
+         round += 1ULL << m_iLnBits;
+      }
+
+      uint64_t t = (round + i) << shift;
+      if ((0 == first) || (t < first))
+         first = t;
+   }
+
+   return first;
+}
 
-   if (n->m_iHeapLoc >= 0)
+CSNode* CSndUList::expire_(const uint64_t& now)
+{
+   while (m_iCount > 0)
    {
-      // remove the node from heap
-      m_pHeap[n->m_iHeapLoc] = m_pHeap[m_iLastEntry];
-      m_iLastEntry --;
-      m_pHeap[n->m_iHeapLoc]->m_iHeapLoc = n->m_iHeapLoc;
-
-      int q = n->m_iHeapLoc;
-      int p = q * 2 + 1;
-      while (p <= m_iLastEntry)
+      uint64_t t = next_();
+      if (t > now)
+         return NULL;
+
+      if (t != m_ullWheelTime)
       {
-         if ((p + 1 <= m_iLastEntry) && (m_pHeap[p]->m_llTimeStamp > m_pHeap[p + 1]->m_llTimeStamp))
-            p ++;
+         // all slots in between are empty, jump over them
+         m_ullWheelTime = t;
 
-         if (m_pHeap[q]->m_llTimeStamp > m_pHeap[p]->m_llTimeStamp)
+         // at a level boundary, move the nodes of the slot starting here one level down,
+         // and continue upwards while the higher levels wrap around too
+         int shift = m_iL0Bits;
+         for (int level = 1; (level < m_iLevels) && (0 == (t & ((1ULL << shift) - 1))); ++ level, shift += m_iLnBits)
          {
-            CSNode* t = m_pHeap[p];
-            m_pHeap[p] = m_pHeap[q];
-            m_pHeap[p]->m_iHeapLoc = p;
-            m_pHeap[q] = t;
-            m_pHeap[q]->m_iHeapLoc = q;
-
-            q = p;
-            p = q * 2 + 1;
+            int slot = (int)((t >> shift) & ((1ULL << m_iLnBits) - 1));
+            CSNode* n = m_pSlot[level][slot];
+            m_pSlot[level][slot] = NULL;
+            m_pSlotTail[level][slot] = NULL;
+            m_pullMap[level][0] &= ~(1ULL << slot);
+
+            while (NULL != n)
+            {
+               CSNode* next = n->m_pNext;
+               -- m_iCount;
+               place_(n);
+               n = next;
+            }
+
+            if (0 != slot)
+               break;
          }
-         else
-            break;
       }
 
-      n->m_iHeapLoc = -1;
+      int slot = (int)(t & ((1ULL << m_iL0Bits) - 1));
+      CSNode* n = m_pSlot[0][slot];
+      if (NULL != n)
+      {
+         remove_(n->m_pUDT);
+         return n;
+      }
    }
+
+   return NULL;
 }
 
 //
@@ -505,7 +774,11 @@ void CSndQueue::init(const CChannel* c, const CTimer* t)
 {
    CSndQueue* self = (CSndQueue*)param;
 
-   CPacket pkt;
+   CPacket pkts[CChannel::m_iBatchSize];
+   CPacket* pp[CChannel::m_iBatchSize];
+   sockaddr* addrs[CChannel::m_iBatchSize];
+   for (int i = 0; i < CChannel::m_iBatchSize; ++ i)
+      pp[i] = pkts + i;
 
    while (!self->m_bClosing)
    {
@@ -519,20 +792,26 @@ void CSndQueue::init(const CChannel* c, const CTimer* t)
          if (currtime < ts)
             self->m_pTimer->sleepto(ts);
 
-         // it is time to process it, pop it out/remove from the list
-         sockaddr* addr;
-         CPacket pkt;
-         if (self->m_pSndUList->pop(addr, pkt) < 0)
-            continue;
-
-         self->m_pChannel->sendto(addr, pkt);
+         // it is time to process it, pop it out/remove from the list; packets
+         // of this or other sockets that are due by now go out in the same call
+         int n = 0;
+         do
+         {
+            if (self->m_pSndUList->pop(addrs[n], pkts[n]) >= 0)
+               ++ n;
+            CTimer::rdtsc(currtime);
+            ts = self->m_pSndUList->getNextProcTime();
+         } while ((n < CChannel::m_iBatchSize) && (ts > 0) && (ts <= currtime));
+
+         if (n > 0)
+            self->m_pChannel->sendBatch(addrs, pp, n);
       }
       else
       {
          // wait here if there is no sockets with data to be sent
          #ifndef WIN32
             pthread_mutex_lock(&self->m_WindowLock);
-            if (!self->m_bClosing && (self->m_pSndUList->m_iLastEntry < 0))
+            if (!self->m_bClosing && (0 == self->m_pSndUList->m_iCount) && (NULL == self->m_pSndUList->m_pPending))
                pthread_cond_wait(&self->m_WindowCond, &self->m_WindowLock);
             pthread_mutex_unlock(&self->m_WindowLock);
          #else
@@ -821,20 +1100,14 @@ bool CRendezvousQueue::retrieve(const sockaddr* addr, UDTSOCKET& id)
 
 //
 CRcvQueue::CRcvQueue():
-m_WorkerThread(),
-m_UnitQueue(),
-m_pRcvUList(NULL),
-m_pHash(NULL),
-m_pChannel(NULL),
+m_pWorker(NULL),
+m_iWorkers(0),
 m_pTimer(NULL),
 m_iPayloadSize(),
 m_bClosing(false),
-m_ExitCond(),
 m_LSLock(),
 m_pListener(NULL),
 m_pRendezvousQueue(NULL),
-m_vNewEntry(),
-m_IDLock(),
 m_mBuffer(),
 m_PassLock(),
 m_PassCond()
@@ -843,13 +1116,10 @@ m_PassCond()
       pthread_mutex_init(&m_PassLock, NULL);
       pthread_cond_init(&m_PassCond, NULL);
       pthread_mutex_init(&m_LSLock, NULL);
-      pthread_mutex_init(&m_IDLock, NULL);
    #else
       m_PassLock = CreateMutex(NULL, false, NULL);
       m_PassCond = CreateEvent(NULL, false, false, NULL);
       m_LSLock = CreateMutex(NULL, false, NULL);
-      m_IDLock = CreateMutex(NULL, false, NULL);
-      m_ExitCond = CreateEvent(NULL, false, false, NULL);
    #endif
 }
 
@@ -857,26 +1127,37 @@ CRcvQueue::~CRcvQueue()
 {
    m_bClosing = true;
 
+   for (int k = 0; k < m_iWorkers; ++ k)
+   {
+      CWorker* w = m_pWorker + k;
+
+      #ifndef WIN32
+         if (0 != w->m_WorkerThread)
+            pthread_join(w->m_WorkerThread, NULL);
+         pthread_mutex_destroy(&w->m_IDLock);
+      #else
+         if (NULL != w->m_WorkerThread)
+            WaitForSingleObject(w->m_ExitCond, INFINITE);
+         CloseHandle(w->m_WorkerThread);
+         CloseHandle(w->m_IDLock);
+         CloseHandle(w->m_ExitCond);
+      #endif
+
+      delete w->m_pRcvUList;
+      delete w->m_pHash;
+   }
+   delete [] m_pWorker;
+
    #ifndef WIN32
-      if (0 != m_WorkerThread)
-         pthread_join(m_WorkerThread, NULL);
       pthread_mutex_destroy(&m_PassLock);
       pthread_cond_destroy(&m_PassCond);
       pthread_mutex_destroy(&m_LSLock);
-      pthread_mutex_destroy(&m_IDLock);
    #else
-      if (NULL != m_WorkerThread)
-         WaitForSingleObject(m_ExitCond, INFINITE);
-      CloseHandle(m_WorkerThread);
       CloseHandle(m_PassLock);
       CloseHandle(m_PassCond);
       CloseHandle(m_LSLock);
-      CloseHandle(m_IDLock);
-      CloseHandle(m_ExitCond);
    #endif
 
-   delete m_pRcvUList;
-   delete m_pHash;
    delete m_pRendezvousQueue;
 
    for (map<int32_t, CPacket*>::iterator i = m_mBuffer.begin(); i != m_mBuffer.end(); ++ i)
@@ -886,33 +1167,50 @@ CRcvQueue::~CRcvQueue()
    }
 }
 
-void CRcvQueue::init(const int& qsize, const int& payload, const int& version, const int& hsize, const CChannel* cc, const CTimer* t)
+void CRcvQueue::init(const int& qsize, const int& payload, const int& version, const int& hsize, CChannel* const* cc, const int& n, const CTimer* t)
 {
    m_iPayloadSize = payload;
 
-   m_UnitQueue.init(qsize, payload, version);
-
-   m_pHash = new CHash;
-   m_pHash->init(hsize);
-
-   m_pChannel = (CChannel*)cc;
    m_pTimer = (CTimer*)t;
 
-   m_pRcvUList = new CRcvUList;
    m_pRendezvousQueue = new CRendezvousQueue;
 
-   #ifndef WIN32
-      if (0 != pthread_create(&m_WorkerThread, NULL, CRcvQueue::worker, this))
-      {
-         m_WorkerThread = 0;
-         throw CUDTException(3, 1);
-      }
-   #else
-      DWORD threadID;
-      m_WorkerThread = CreateThread(NULL, 0, CRcvQueue::worker, this, 0, &threadID);
-      if (NULL == m_WorkerThread)
-         throw CUDTException(3, 1);
-   #endif
+   // each worker receives on its own channel and keeps its own sockets, units and timers
+   m_pWorker = new CWorker[n];
+   for (int k = 0; k < n; ++ k)
+   {
+      CWorker* w = m_pWorker + k;
+
+      w->m_pQueue = this;
+      w->m_UnitQueue.init(qsize, payload, version);
+      w->m_pHash = new CHash;
+      w->m_pHash->init(hsize);
+      w->m_pRcvUList = new CRcvUList;
+      w->m_pChannel = cc[k];
+
+      #ifndef WIN32
+         pthread_mutex_init(&w->m_IDLock, NULL);
+      #else
+         w->m_IDLock = CreateMutex(NULL, false, NULL);
+         w->m_ExitCond = CreateEvent(NULL, false, false, NULL);
+      #endif
+
+      // from here on the destructor cleans up this worker
+      ++ m_iWorkers;
+
+      #ifndef WIN32
+         if (0 != pthread_create(&w->m_WorkerThread, NULL, CRcvQueue::worker, w))
+         {
+            w->m_WorkerThread = 0;
+            throw CUDTException(3, 1);
+         }
+      #else
+         DWORD threadID;
+         w->m_WorkerThread = CreateThread(NULL, 0, CRcvQueue::worker, w, 0, &threadID);
+         if (NULL == w->m_WorkerThread)
+            throw CUDTException(3, 1);
+      #endif
+   }
 }
 
 #ifndef WIN32
@@ -921,9 +1219,16 @@ void CRcvQueue::init(const int& qsize, const int& payload, const int& version, c
    DWORD WINAPI CRcvQueue::worker(LPVOID param)
 #endif
 {
-   CRcvQueue* self = (CRcvQueue*)param;
-
-   sockaddr* addr = (AF_INET == self->m_UnitQueue.m_iIPversion) ? (sockaddr*) new sockaddr_in : (sockaddr*) new sockaddr_in6;
+   CWorker* w = (CWorker*)param;
+   CRcvQueue* self = w->m_pQueue;
+
+   // room for IPv4 and IPv6 source addresses alike
+   sockaddr_in6* addrbuf = new sockaddr_in6[CChannel::m_iBatchSize];
+   sockaddr* addrs[CChannel::m_iBatchSize];
+   CUnit* units[CChannel::m_iBatchSize];
+   CPacket* pkts[CChannel::m_iBatchSize];
+   for (int i = 0; i < CChannel::m_iBatchSize; ++ i)
+      addrs[i] = (sockaddr*)(addrbuf + i);
    CUDT* u = NULL;
    int32_t id;
 
@@ -934,71 +1239,84 @@ void CRcvQueue::init(const int& qsize, const int& payload, const int& version, c
       #endif
 
       // check waiting list, if new socket, insert it to the list
-      if (self->ifNewEntry())
+      if (self->ifNewEntry(w))
       {
-         CUDT* ne = self->getNewEntry();
+         CUDT* ne = self->getNewEntry(w);
          if (NULL != ne)
          {
-            self->m_pRcvUList->insert(ne);
-            self->m_pHash->insert(ne->m_SocketID, ne);
+            w->m_pRcvUList->insert(ne);
+            w->m_pHash->insert(ne->m_SocketID, ne);
          }
       }
 
-      // find next available slot for incoming packet
-      CUnit* unit = self->m_UnitQueue.getNextAvailUnit();
-      if (NULL == unit)
+      // find available slots for the incoming packets, as many as one call can fill
+      int n = w->m_UnitQueue.getAvailUnits(units, CChannel::m_iBatchSize);
+      if (0 == n)
       {
          // no space, skip this packet
          CPacket temp;
          temp.m_pcData = new char[self->m_iPayloadSize];
          temp.setLength(self->m_iPayloadSize);
-         self->m_pChannel->recvfrom(addr, temp);
+         w->m_pChannel->recvfrom(addrs[0], temp);
          delete [] temp.m_pcData;
          goto TIMER_CHECK;
       }
 
-      unit->m_Packet.setLength(self->m_iPayloadSize);
-
-      // reading next incoming packet
-      if (self->m_pChannel->recvfrom(addr, unit->m_Packet) <= 0)
-         goto TIMER_CHECK;
-
-      id = unit->m_Packet.m_iID;
-
-      // ID 0 is for connection request, which should be passed to the listening socket or rendezvous sockets
-      if (0 == id)
+      for (int i = 0; i < n; ++ i)
       {
-         if (NULL != self->m_pListener)
-            ((CUDT*)self->m_pListener)->listen(addr, unit->m_Packet);
-         else if (self->m_pRendezvousQueue->retrieve(addr, id))
-            self->storePkt(id, unit->m_Packet.clone());
+         units[i]->m_Packet.setLength(self->m_iPayloadSize);
+         pkts[i] = &units[i]->m_Packet;
       }
-      else if (id > 0)
+
+      // reading the next incoming packets
+      n = w->m_pChannel->recvBatch(addrs, pkts, n);
+
+      for (int i = 0; i < n; ++ i)
       {
-         if (NULL != (u = self->m_pHash->lookup(id)))
+         CUnit* unit = units[i];
+         sockaddr* addr = addrs[i];
+
+         if (unit->m_Packet.getLength() <= 0)
+            continue;
+
+         id = unit->m_Packet.m_iID;
+
+         // ID 0 is for connection request, which should be passed to the listening socket or rendezvous sockets;
+         // it always arrives at the first worker
+         if (0 == id)
+         {
+            if (NULL != self->m_pListener)
+               ((CUDT*)self->m_pListener)->listen(addr, unit->m_Packet);
+            else if (self->m_pRendezvousQueue->retrieve(addr, id))
+               self->storePkt(id, unit->m_Packet.clone());
+         }
+         else if (id > 0)
          {
-            if (CIPAddress::ipcmp(addr, u->m_pPeerAddr, u->m_iIPversion))
+            if (NULL != (u = w->m_pHash->lookup(id)))
             {
-               if (u->m_bConnected && !u->m_bBroken && !u->m_bClosing)
+               if (CIPAddress::ipcmp(addr, u->m_pPeerAddr, u->m_iIPversion))
                {
-                  if (0 == unit->m_Packet.getFlag())
-                     u->processData(unit);
-                  else
-                     u->processCtrl(unit->m_Packet);
-
-                  u->checkTimers();
-                  self->m_pRcvUList->update(u);
+                  if (u->m_bConnected && !u->m_bBroken && !u->m_bClosing)
+                  {
+                     if (0 == unit->m_Packet.getFlag())
+                        u->processData(unit);
+                     else
+                        u->processCtrl(unit->m_Packet);
+
+                     u->checkTimers();
+                     w->m_pRcvUList->update(u);
+                  }
                }
             }
+            else if (self->m_pRendezvousQueue->retrieve(addr, id))
+               self->storePkt(id, unit->m_Packet.clone());
          }
-         else if (self->m_pRendezvousQueue->retrieve(addr, id))
-            self->storePkt(id, unit->m_Packet.clone());
       }
 
 TIMER_CHECK:
-      // take care of the timing event for all UDT sockets
+      // take care of the timing event for all UDT sockets of this worker
 
-      CRNode* ul = self->m_pRcvUList->m_pUList;
+      CRNode* ul = w->m_pRcvUList->m_pUList;
       uint64_t currtime;
       CTimer::rdtsc(currtime);
       uint64_t ctime = currtime - 100000 * CTimer::getCPUFrequency();
@@ -1010,28 +1328,25 @@ TIMER_CHECK:
          if (u->m_bConnected && !u->m_bBroken && !u->m_bClosing)
          {
             u->checkTimers();
-            self->m_pRcvUList->update(u);
+            w->m_pRcvUList->update(u);
          }
          else
          {
             // the socket must be removed from Hash table first, then RcvUList
-            self->m_pHash->remove(u->m_SocketID);
-            self->m_pRcvUList->remove(u);
+            w->m_pHash->remove(u->m_SocketID);
+            w->m_pRcvUList->remove(u);
          }
 
-         ul = self->m_pRcvUList->m_pUList;
+         ul = w->m_pRcvUList->m_pUList;
       }
    }
 
-   if (AF_INET == self->m_UnitQueue.m_iIPversion)
-      delete (sockaddr_in*)addr;
-   else
-      delete (sockaddr_in6*)addr;
+   delete [] addrbuf;
 
    #ifndef WIN32
       return NULL;
    #else
-      SetEvent(self->m_ExitCond);
+      SetEvent(w->m_ExitCond);
       return 0;
    #endif
 }
@@ -1102,26 +1417,39 @@ void CRcvQueue::removeListener(const CUDT* u)
       m_pListener = NULL;
 }
 
+CRcvQueue::CWorker* CRcvQueue::getWorker(const int32_t& id)
+{
+   // the same choice the system makes for the worker's channel
+   return m_pWorker + (uint32_t)id % m_iWorkers;
+}
+
+CUnitQueue* CRcvQueue::getUnitQueue(const int32_t& id)
+{
+   return &(getWorker(id)->m_UnitQueue);
+}
+
 void CRcvQueue::setNewEntry(CUDT* u)
 {
-   CGuard listguard(m_IDLock);
-   m_vNewEntry.insert(m_vNewEntry.end(), u);
+   CWorker* w = getWorker(u->m_SocketID);
+
+   CGuard listguard(w->m_IDLock);
+   w->m_vNewEntry.insert(w->m_vNewEntry.end(), u);
 }
 
-bool CRcvQueue::ifNewEntry()
+bool CRcvQueue::ifNewEntry(CWorker* w)
 {
-   return !(m_vNewEntry.empty());
+   return !(w->m_vNewEntry.empty());
 }
 
-CUDT* CRcvQueue::getNewEntry()
+CUDT* CRcvQueue::getNewEntry(CWorker* w)
 {
-   CGuard listguard(m_IDLock);
+   CGuard listguard(w->m_IDLock);
 
-   if (m_vNewEntry.empty())
+   if (w->m_vNewEntry.empty())
       return NULL;
 
-   CUDT* u = (CUDT*)*(m_vNewEntry.begin());
-   m_vNewEntry.erase(m_vNewEntry.begin());
+   CUDT* u = (CUDT*)*(w->m_vNewEntry.begin());
+   w->m_vNewEntry.erase(w->m_vNewEntry.begin());
 
    return u;
 }
@@ -105,6 +105,16 @@ public:
 
    CUnit* getNextAvailUnit();
 
+      // Functionality:
+      //    find a number of different available units, for a batch of incoming packets.
+      // Parameters:
+      //    0) [out] units: the units found.
+      //    1) [in] n: how many are wanted.
+      // Returned value:
+      //    Number of units found; the first is also the next available unit.
+
+   int getAvailUnits(CUnit** units, const int& n);
+
 private:
    struct CQEntry
    {
@@ -136,7 +146,14 @@ struct CSNode
    CUDT* m_pUDT;		// Pointer to the instance of CUDT socket
    uint64_t m_llTimeStamp;      // Time Stamp
 
-   int m_iHeapLoc;		// location on the heap, -1 means not on the heap
+   CSNode* m_pPrev;		// previous node in the same wheel slot
+   CSNode* m_pNext;		// next node in the same wheel slot
+   int m_iLevel;		// wheel level of the node
+   int m_iSlot;			// wheel slot of the node, -1 means not on the wheel
+
+   CSNode* m_pNextPending;	// next node on the stack of submitted updates
+   volatile int m_iPending;	// if the node is on the stack of submitted updates
+   volatile int m_iReschedule;	// if a submitted update asks to reschedule the node
 };
 
 class CSndUList
@@ -160,7 +177,8 @@ public:
    void insert(const int64_t& ts, const CUDT* u);
 
       // Functionality:
-      //    Update the timestamp of the UDT instance on the list.
+      //    Update the timestamp of the UDT instance on the list. The update is submitted
+      //    without locking the list and applied by the sending thread.
       // Parameters:
       //    1) [in] u: pointer to the UDT instance
       //    2) [in] resechedule: if the timestampe shoudl be rescheduled
@@ -170,7 +188,7 @@ public:
    void update(const CUDT* u, const bool& reschedule = true);
 
       // Functionality:
-      //    Retrieve the next packet and peer address from the first entry, and reschedule it in the queue.
+      //    Retrieve the next packet and peer address from the first due entry, and reschedule it in the queue.
       // Parameters:
       //    0) [out] addr: destination address of the next packet
       //    1) [out] pkt: the next packet to be sent
@@ -193,7 +211,8 @@ public:
       // Parameters:
       //    None.
       // Returned value:
-      //    Scheduled processing time of the first UDT socket in the list.
+      //    Processing time of the first wheel slot, never later than that of any UDT socket
+      //    in the list; 0 if the list is empty.
 
    uint64_t getNextProcTime();
 
@@ -201,10 +220,57 @@ private:
    void insert_(const int64_t& ts, const CUDT* u);
    void remove_(const CUDT* u);
 
+      // Functionality:
+      //    Apply the updates submitted by update() since the last call.
+      // Parameters:
+      //    None.
+      // Returned value:
+      //    None.
+
+   void drain_();
+
+      // Functionality:
+      //    Link a node into the wheel slot matching its time stamp.
+      // Parameters:
+      //    1) [in] n: the node, with m_llTimeStamp set
+      // Returned value:
+      //    None.
+
+   void place_(CSNode* n);
+
+      // Functionality:
+      //    Find the wheel time of the first slot to process: a level 0 slot holding
+      //    due nodes, or the start of a higher level slot to be cascaded down.
+      // Parameters:
+      //    None.
+      // Returned value:
+      //    Wheel time in microseconds, a lower bound of the earliest time stamp on the wheel.
+
+   uint64_t next_() const;
+
+      // Functionality:
+      //    Move the wheel up to the current time and unlink the first due node.
+      // Parameters:
+      //    1) [in] now: current time in microseconds
+      // Returned value:
+      //    The due node, or NULL if none is due.
+
+   CSNode* expire_(const uint64_t& now);
+
 private:
-   CSNode** m_pHeap;			// The heap array
-   int m_iArrayLength;			// physical length of the array
-   int m_iLastEntry;			// position of last entry on the heap array
+   static const int m_iLevels = 4;		// levels of the timing wheel
+   static const int m_iL0Bits = 8;		// level 0 has 256 slots of one microsecond
+   static const int m_iLnBits = 6;		// each higher level has 64 slots, each spanning a whole level below
+
+   CSNode* m_pSlot[m_iLevels][1 << m_iL0Bits];	// node lists of the wheel slots, served first in first out
+   CSNode* m_pSlotTail[m_iLevels][1 << m_iL0Bits];	// last node of each slot list
+   uint64_t m_pullMap[m_iLevels][(1 << m_iL0Bits) / 64];	// bitmaps of non-empty slots
+   uint64_t m_ullWheelTime;		// wheel time in microseconds, slots before it have been processed
+   uint64_t m_ullCPUFreq;		// CPU clock cycles per microsecond
+   int m_iCount;			// number of nodes on the wheel
+
+   CSNode* volatile m_pPending;		// stack of updates submitted without the lock
+   volatile uint64_t m_ullNextProcTime;	// time the sending thread sleeps until, 0 if it waits for sockets
 
    pthread_mutex_t m_ListLock;
 
@@ -433,12 +499,14 @@ public:
       //    2) [in] mss: maximum packet size
       //    3) [in] version: IP version
       //    4) [in] hsize: hash table size
-      //    5) [in] c: UDP channel to be associated to the queue
-      //    6) [in] t: timer
+      //    5) [in] c: UDP channels sharing the port, one per worker; the system hands channel k
+      //           the packets for sockets with (ID % n == k)
+      //    6) [in] n: number of channels and workers
+      //    7) [in] t: timer
       // Returned value:
       //    None.
 
-   void init(const int& size, const int& payload, const int& version, const int& hsize, const CChannel* c, const CTimer* t);
+   void init(const int& size, const int& payload, const int& version, const int& hsize, CChannel* const* c, const int& n, const CTimer* t);
 
       // Functionality:
       //    Read a packet for a specific UDT socket id.
@@ -451,34 +519,48 @@ public:
    int recvfrom(const int32_t& id, CPacket& packet);
 
 private:
+   struct CWorker
+   {
+      CRcvQueue* m_pQueue;		// the receiving queue this worker belongs to
+      pthread_t m_WorkerThread;
+
+      CUnitQueue m_UnitQueue;		// The received packet queue
+      CRcvUList* m_pRcvUList;		// List of UDT instances that will read packets from the queue
+      CHash* m_pHash;			// Hash table for UDT socket looking up
+      CChannel* m_pChannel;		// UDP channel for receving packets
+
+      std::vector<CUDT*> m_vNewEntry;	// newly added entries, to be inserted
+      pthread_mutex_t m_IDLock;
+
+      pthread_cond_t m_ExitCond;
+   };
+
 #ifndef WIN32
    static void* worker(void* param);
 #else
    static DWORD WINAPI worker(LPVOID param);
 #endif
 
-   pthread_t m_WorkerThread;
+   CWorker* m_pWorker;			// the receiving workers, each serving the sockets pinned to it by ID
+   int m_iWorkers;			// number of workers
 
 private:
-   CUnitQueue m_UnitQueue;		// The received packet queue
-
-   CRcvUList* m_pRcvUList;		// List of UDT instances that will read packets from the queue
-   CHash* m_pHash;			// Hash table for UDT socket looking up
-   CChannel* m_pChannel;		// UDP channel for receving packets
    CTimer* m_pTimer;			// shared timer with the snd queue
 
    int m_iPayloadSize;                  // packet payload size
 
    volatile bool m_bClosing;            // closing the workder
-   pthread_cond_t m_ExitCond;
 
 private:
    int setListener(const CUDT* u);
    void removeListener(const CUDT* u);
 
+   CWorker* getWorker(const int32_t& id);
+   CUnitQueue* getUnitQueue(const int32_t& id);
+
    void setNewEntry(CUDT* u);
-   bool ifNewEntry();
-   CUDT* getNewEntry();
+   bool ifNewEntry(CWorker* w);
+   CUDT* getNewEntry(CWorker* w);
 
    void storePkt(const int32_t& id, CPacket* pkt);
 
@@ -487,9 +569,6 @@ private:
    volatile CUDT* m_pListener;			// pointer to the (unique, if any) listening UDT entity
    CRendezvousQueue* m_pRendezvousQueue;	// The list of sockets in rendezvous mode
 
-   std::vector<CUDT*> m_vNewEntry;              // newly added entries, to be inserted
-   pthread_mutex_t m_IDLock;
-
    std::map<int32_t, CPacket*> m_mBuffer;	// temporary buffer for rendezvous connection request
    pthread_mutex_t m_PassLock;
    pthread_cond_t m_PassCond;
@@ -504,6 +583,8 @@ struct CMultiplexer
    CSndQueue* m_pSndQueue;	// The sending queue
    CRcvQueue* m_pRcvQueue;	// The receiving queue
    CChannel* m_pChannel;	// The UDP channel for sending and receiving
+   CChannel** m_pRcvChannel;	// The UDP channels for receiving, one per receiving worker; the first is m_pChannel
+   int m_iRcvWorkers;		// number of receiving channels and workers
    CTimer* m_pTimer;		// The timer
 
    int m_iPort;			// The UDP port number of this multiplexer
@@ -132,7 +132,10 @@ enum UDTOpt
    UDT_SNDTIMEO,        // send() timeout
    UDT_RCVTIMEO,        // recv() timeout
    UDT_REUSEADDR,	// reuse an existing port or create a new one
-   UDT_MAXBW		// maximum bandwidth (bytes per second) that the connection can use
+   UDT_MAXBW,		// maximum bandwidth (bytes per second) that the connection can use
+   UDT_GSO,		// send with UDP segmentation offload where available
+   UDT_GRO,		// receive with UDP receive offload where available
+   UDT_RCVWORKERS	// number of threads receiving on the UDP port, sockets are spread over them by ID
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -297,6 +300,11 @@ UDT_API int sendmsg(UDTSOCKET u, const char* buf, int len, int ttl = -1, bool in
 UDT_API int recvmsg(UDTSOCKET u, char* buf, int len);
 UDT_API int64_t sendfile(UDTSOCKET u, std::fstream& ifs, int64_t offset, int64_t size, int block = 364000);
 UDT_API int64_t sendfile(UDTSOCKET u, FILE* ifd, int64_t offset, int64_t size, int block = 364000);
+#ifndef WIN32
+// reads with preadv() straight into the send buffer, the file position of 'fd' is not used;
+// a read error fails the call, the blocks read before it are sent
+UDT_API int64_t sendfile(UDTSOCKET u, int fd, int64_t offset, int64_t size, int block = 364000);
+#endif
 UDT_API int64_t recvfile(UDTSOCKET u, std::fstream& ofs, int64_t offset, int64_t size, int block = 7280000);
 UDT_API int select(int nfds, UDSET* readfds, UDSET* writefds, UDSET* exceptfds, const struct timeval* timeout);
 UDT_API int selectEx(const std::vector<UDTSOCKET>& fds, std::vector<UDTSOCKET>* readfds, std::vector<UDTSOCKET>* writefds, std::vector<UDTSOCKET>* exceptfds, int64_t msTimeOut);
@@ -0,0 +1,251 @@
+/*
+* Client-side attribute and dentry cache
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "attrcache.h"
+
+/* Attributes are keyed (node id, ""), names (parent id, name) */
+typedef struct ac_entry_tt {
+    uint64_t id;
+    char*  name;
+    int    negative;
+    double expires;
+    uint64_t nodeid;
+    struct stat st;
+    struct ac_entry_tt* next;
+} ac_entry_t;
+
+typedef struct ac_shard_tt {
+    pthread_mutex_t lock;
+    ac_entry_t* buckets[AC_BUCKETS];
+    int nentries;
+    unsigned long long hits;
+    unsigned long long neghits;
+    unsigned long long misses;
+} ac_shard_t;
+
+static ac_shard_t* _shards = NULL;
+static double _ttl = AC_DEFAULT_TTL;
+
+static double ac_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+static uint64_t ac_hash(uint64_t id, const char* name)
+{
+    uint64_t h = 0xCBF29CE484222325ULL ^ (id * 0x9E3779B97F4A7C15ULL);
+    while (*name != '\0') {
+        h ^= (unsigned char)(*name++);
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+
+static void ac_free_entry(ac_entry_t* e)
+{
+    free(e->name);
+    free(e);
+}
+
+/* Caller holds the shard lock */
+static void ac_purge(ac_shard_t* s, int all)
+{
+    double now = ac_now();
+    int i;
+    for (i = 0; i < AC_BUCKETS; i++) {
+        ac_entry_t** pp = &s->buckets[i];
+        while (*pp != NULL) {
+            ac_entry_t* e = *pp;
+            if (all || (e->expires < now)) {
+                *pp = e->next;
+                ac_free_entry(e);
+                s->nentries--;
+            } else {
+                pp = &e->next;
+            }
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// SETUP
+//////////////////////////////////////////////////////////////////////
+
+int acache_init(double ttl)
+{
+    int i;
+    _ttl = ttl;
+    _shards = (ac_shard_t*)calloc(AC_NUM_SHARDS, sizeof(ac_shard_t));
+    if (_shards == NULL) {
+        fprintf(stderr, "acache_init: out of memory\n");
+        return -1;
+    }
+    for (i = 0; i < AC_NUM_SHARDS; i++) {
+        pthread_mutex_init(&_shards[i].lock, NULL);
+    }
+    return 0;
+}
+
+void acache_destroy()
+{
+    int i;
+    if (_shards == NULL) { return; }
+    for (i = 0; i < AC_NUM_SHARDS; i++) {
+        ac_purge(&_shards[i], 1);
+        pthread_mutex_destroy(&_shards[i].lock);
+    }
+    free(_shards);
+    _shards = NULL;
+}
+
+//////////////////////////////////////////////////////////////////////
+// ACCESS
+//////////////////////////////////////////////////////////////////////
+
+/* Returns 1 on a positive hit, 0 on a negative hit and -1 on a miss */
+static int ac_find(uint64_t id, const char* name, struct stat* st, uint64_t* nodeid)
+{
+    uint64_t h = ac_hash(id, name);
+    ac_shard_t* s = &_shards[h % AC_NUM_SHARDS];
+    ac_entry_t* e;
+    int rc = -1;
+
+    if (_ttl <= 0) { return -1; }
+    pthread_mutex_lock(&s->lock);
+    for (e = s->buckets[(h / AC_NUM_SHARDS) % AC_BUCKETS]; e != NULL; e = e->next) {
+        if ((e->id == id) && (strcmp(e->name, name) == 0)) { break; }
+    }
+    if ((e != NULL) && (e->expires >= ac_now())) {
+        if (e->negative) {
+            s->neghits++;
+            rc = 0;
+        } else {
+            s->hits++;
+            if (st != NULL) { *st = e->st; }
+            if (nodeid != NULL) { *nodeid = e->nodeid; }
+            rc = 1;
+        }
+    } else {
+        s->misses++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return rc;
+}
+
+static void ac_store(uint64_t id, const char* name, const struct stat* st, uint64_t nodeid)
+{
+    uint64_t h = ac_hash(id, name);
+    ac_shard_t* s = &_shards[h % AC_NUM_SHARDS];
+    ac_entry_t** bucket = &s->buckets[(h / AC_NUM_SHARDS) % AC_BUCKETS];
+    ac_entry_t* e;
+
+    if (_ttl <= 0) { return; }
+    pthread_mutex_lock(&s->lock);
+    for (e = *bucket; e != NULL; e = e->next) {
+        if ((e->id == id) && (strcmp(e->name, name) == 0)) { break; }
+    }
+    if (e == NULL) {
+        if (s->nentries >= AC_MAX_ENTRIES) {
+            ac_purge(s, 0);
+            if (s->nentries >= AC_MAX_ENTRIES) { ac_purge(s, 1); }
+        }
+        e = (ac_entry_t*)calloc(1, sizeof(ac_entry_t));
+        if ((e == NULL) || ((e->name = strdup(name)) == NULL)) {
+            free(e);
+            pthread_mutex_unlock(&s->lock);
+            return;
+        }
+        e->id = id;
+        e->next = *bucket;
+        *bucket = e;
+        s->nentries++;
+    }
+    e->negative = (st == NULL) && (nodeid == 0);
+    if (st != NULL) { e->st = *st; }
+    e->nodeid = nodeid;
+    e->expires = ac_now() + _ttl;
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void ac_remove(uint64_t id, const char* name)
+{
+    uint64_t h = ac_hash(id, name);
+    ac_shard_t* s = &_shards[h % AC_NUM_SHARDS];
+    ac_entry_t** pp = &s->buckets[(h / AC_NUM_SHARDS) % AC_BUCKETS];
+
+    pthread_mutex_lock(&s->lock);
+    while (*pp != NULL) {
+        ac_entry_t* e = *pp;
+        if ((e->id == id) && (strcmp(e->name, name) == 0)) {
+            *pp = e->next;
+            ac_free_entry(e);
+            s->nentries--;
+            break;
+        }
+        pp = &e->next;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+int acache_getattr(uint64_t nodeid, struct stat* st)
+{
+    return ac_find(nodeid, "", st, NULL);
+}
+
+void acache_putattr(uint64_t nodeid, const struct stat* st)
+{
+    ac_store(nodeid, "", st, nodeid);
+}
+
+void acache_invalidate(uint64_t nodeid)
+{
+    ac_remove(nodeid, "");
+}
+
+int acache_lookup(uint64_t parent, const char* name, uint64_t* nodeid)
+{
+    return ac_find(parent, name, NULL, nodeid);
+}
+
+void acache_putentry(uint64_t parent, const char* name, uint64_t nodeid)
+{
+    ac_store(parent, name, NULL, nodeid);
+}
+
+void acache_invalidate_entry(uint64_t parent, const char* name)
+{
+    ac_remove(parent, name);
+}
+
+void acache_clear()
+{
+    int i;
+    for (i = 0; i < AC_NUM_SHARDS; i++) {
+        pthread_mutex_lock(&_shards[i].lock);
+        ac_purge(&_shards[i], 1);
+        pthread_mutex_unlock(&_shards[i].lock);
+    }
+}
+
+void acache_getstats(acache_stats_t* stats)
+{
+    int i;
+    memset(stats, 0, sizeof(acache_stats_t));
+    for (i = 0; i < AC_NUM_SHARDS; i++) {
+        pthread_mutex_lock(&_shards[i].lock);
+        stats->hits += _shards[i].hits;
+        stats->neghits += _shards[i].neghits;
+        stats->misses += _shards[i].misses;
+        pthread_mutex_unlock(&_shards[i].lock);
+    }
+}
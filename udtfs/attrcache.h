@@ -0,0 +1,45 @@
+/*
+* Client-side attribute and dentry cache
+*
+* Maps node ids to their last stat result, and (parent node, name) pairs
+* to the node found there or to "does not exist", for a fixed time-to-live.
+* The table is split into shards with a lock each.
+*/
+#ifndef ATTRCACHE_H
+#define ATTRCACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define AC_NUM_SHARDS 16
+#define AC_BUCKETS 4096           // per shard
+#define AC_MAX_ENTRIES (16*1024)  // per shard
+#define AC_DEFAULT_TTL 1.0        // seconds
+
+typedef struct acache_stats_tt {
+    unsigned long long hits;
+    unsigned long long neghits;
+    unsigned long long misses;
+} acache_stats_t;
+
+int  acache_init(double ttl);
+void acache_destroy();
+
+/* Returns 1 and fills 'st' if the attributes of the node are cached,
+ * -1 on a miss or when the entry expired */
+int  acache_getattr(uint64_t nodeid, struct stat* st);
+void acache_putattr(uint64_t nodeid, const struct stat* st);
+void acache_invalidate(uint64_t nodeid);
+
+/* Returns 1 and fills 'nodeid' if the name is cached, 0 if it is cached
+ * as non-existent, -1 on a miss or when the entry expired */
+int  acache_lookup(uint64_t parent, const char* name, uint64_t* nodeid);
+/* A 'nodeid' of 0 records that the name does not exist */
+void acache_putentry(uint64_t parent, const char* name, uint64_t nodeid);
+void acache_invalidate_entry(uint64_t parent, const char* name);
+void acache_clear();
+
+void acache_getstats(acache_stats_t* stats);
+
+#endif // ATTRCACHE_H
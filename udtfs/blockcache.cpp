@@ -0,0 +1,255 @@
+/*
+* Client-side block cache shared by all open files
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "blockcache.h"
+
+typedef struct bc_entry_tt {
+    uint64_t fileid;
+    uint64_t version;
+    off64_t  blockno;
+    int      valid;
+    int      ref;
+    size_t   len;
+    char*    data;
+    struct bc_entry_tt* next;
+} bc_entry_t;
+
+typedef struct bc_shard_tt {
+    pthread_mutex_t lock;
+    bc_entry_t*  slots;
+    int          nslots;
+    int          hand;
+    bc_entry_t** buckets;
+    int          nbuckets;
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+} bc_shard_t;
+
+static bc_shard_t _shards[BC_NUM_SHARDS];
+static size_t _budget = 0;
+
+static inline uint64_t bc_mix(uint64_t fileid, off64_t blockno)
+{
+    uint64_t h = fileid ^ ((uint64_t)blockno * 0x9E3779B97F4A7C15ULL);
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline bc_shard_t* bc_shard(uint64_t h)
+{
+    return &_shards[h % BC_NUM_SHARDS];
+}
+
+//////////////////////////////////////////////////////////////////////
+// SETUP
+//////////////////////////////////////////////////////////////////////
+
+int bcache_init(size_t budget)
+{
+    int i, nslots;
+    nslots = budget / BC_BLOCK_SIZE / BC_NUM_SHARDS;
+    if (nslots < 1) { nslots = 1; }
+    _budget = (size_t)nslots * BC_NUM_SHARDS * BC_BLOCK_SIZE;
+
+    for (i = 0; i < BC_NUM_SHARDS; i++) {
+        bc_shard_t* s = &_shards[i];
+        pthread_mutex_init(&s->lock, NULL);
+        s->nslots = nslots;
+        s->hand = 0;
+        s->nbuckets = 2*nslots;
+        s->slots = (bc_entry_t*)calloc(s->nslots, sizeof(bc_entry_t));
+        s->buckets = (bc_entry_t**)calloc(s->nbuckets, sizeof(bc_entry_t*));
+        s->hits = s->misses = s->evictions = 0;
+        if ((s->slots == NULL) || (s->buckets == NULL)) {
+            fprintf(stderr, "bcache_init: out of memory\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void bcache_destroy()
+{
+    int i, j;
+    for (i = 0; i < BC_NUM_SHARDS; i++) {
+        bc_shard_t* s = &_shards[i];
+        for (j = 0; j < s->nslots; j++) {
+            free(s->slots[j].data);
+        }
+        free(s->slots);
+        free(s->buckets);
+        s->slots = NULL;
+        s->buckets = NULL;
+        pthread_mutex_destroy(&s->lock);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// LOOKUP AND REPLACEMENT -- caller holds the shard lock
+//////////////////////////////////////////////////////////////////////
+
+static bc_entry_t* bc_find(bc_shard_t* s, uint64_t h, uint64_t fileid, off64_t blockno)
+{
+    bc_entry_t* e = s->buckets[(h / BC_NUM_SHARDS) % s->nbuckets];
+    while (e != NULL) {
+        if ((e->fileid == fileid) && (e->blockno == blockno)) { return e; }
+        e = e->next;
+    }
+    return NULL;
+}
+
+static void bc_unlink(bc_shard_t* s, bc_entry_t* victim)
+{
+    uint64_t h = bc_mix(victim->fileid, victim->blockno);
+    bc_entry_t** pp = &s->buckets[(h / BC_NUM_SHARDS) % s->nbuckets];
+    while (*pp != NULL) {
+        if (*pp == victim) {
+            *pp = victim->next;
+            break;
+        }
+        pp = &((*pp)->next);
+    }
+    victim->next = NULL;
+    victim->valid = 0;
+}
+
+static bc_entry_t* bc_evict(bc_shard_t* s)
+{
+    while (1) {
+        bc_entry_t* e = &s->slots[s->hand];
+        s->hand = (s->hand + 1) % s->nslots;
+        if (!e->valid) { return e; }
+        if (e->ref) {
+            e->ref = 0;
+            continue;
+        }
+        bc_unlink(s, e);
+        s->evictions++;
+        return e;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// ACCESS
+//////////////////////////////////////////////////////////////////////
+
+int bcache_get(uint64_t fileid, uint64_t version, off64_t blockno, char* dst, size_t off, size_t len)
+{
+    uint64_t h = bc_mix(fileid, blockno);
+    bc_shard_t* s = bc_shard(h);
+    bc_entry_t* e;
+
+    pthread_mutex_lock(&s->lock);
+    e = bc_find(s, h, fileid, blockno);
+    if ((e == NULL) || (e->version != version) || ((off + len) > e->len)) {
+        s->misses++;
+        pthread_mutex_unlock(&s->lock);
+        return -1;
+    }
+    memcpy(dst, e->data + off, len);
+    e->ref = 1;
+    s->hits++;
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+/* Like bcache_get() but without copying or counting a hit/miss */
+int bcache_contains(uint64_t fileid, uint64_t version, off64_t blockno)
+{
+    uint64_t h = bc_mix(fileid, blockno);
+    bc_shard_t* s = bc_shard(h);
+    bc_entry_t* e;
+    int found;
+
+    pthread_mutex_lock(&s->lock);
+    e = bc_find(s, h, fileid, blockno);
+    found = ((e != NULL) && (e->version == version));
+    pthread_mutex_unlock(&s->lock);
+    return found;
+}
+
+void bcache_put(uint64_t fileid, uint64_t version, off64_t blockno, const char* data, size_t len)
+{
+    uint64_t h = bc_mix(fileid, blockno);
+    bc_shard_t* s = bc_shard(h);
+    bc_entry_t* e;
+
+    if (len > BC_BLOCK_SIZE) { len = BC_BLOCK_SIZE; }
+
+    pthread_mutex_lock(&s->lock);
+    e = bc_find(s, h, fileid, blockno);
+    if (e == NULL) {
+        e = bc_evict(s);
+        if (e->data == NULL) {
+            e->data = (char*)memalign(128, BC_BLOCK_SIZE);
+            if (e->data == NULL) {
+                pthread_mutex_unlock(&s->lock);
+                return;
+            }
+        }
+        e->fileid = fileid;
+        e->blockno = blockno;
+        e->next = s->buckets[(h / BC_NUM_SHARDS) % s->nbuckets];
+        s->buckets[(h / BC_NUM_SHARDS) % s->nbuckets] = e;
+    }
+    memcpy(e->data, data, len);
+    e->version = version;
+    e->len = len;
+    e->valid = 1;
+    e->ref = 1;
+    pthread_mutex_unlock(&s->lock);
+}
+
+void bcache_invalidate(uint64_t fileid, off64_t blockno)
+{
+    uint64_t h = bc_mix(fileid, blockno);
+    bc_shard_t* s = bc_shard(h);
+    bc_entry_t* e;
+
+    pthread_mutex_lock(&s->lock);
+    e = bc_find(s, h, fileid, blockno);
+    if (e != NULL) {
+        bc_unlink(s, e);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+void bcache_getstats(bcache_stats_t* stats)
+{
+    int i;
+    memset(stats, 0, sizeof(bcache_stats_t));
+    for (i = 0; i < BC_NUM_SHARDS; i++) {
+        pthread_mutex_lock(&_shards[i].lock);
+        stats->hits += _shards[i].hits;
+        stats->misses += _shards[i].misses;
+        stats->evictions += _shards[i].evictions;
+        pthread_mutex_unlock(&_shards[i].lock);
+    }
+    stats->budget = _budget;
+}
+
+//////////////////////////////////////////////////////////////////////
+// KEYS
+//////////////////////////////////////////////////////////////////////
+
+/* Blocks cached under an older size/mtime/ctime no longer match after a
+ * change. The nanoseconds count: overwrites of the same size often land
+ * within one second. */
+uint64_t bcache_version(const struct stat* st)
+{
+    uint64_t v = bc_mix((uint64_t)st->st_size, st->st_mtim.tv_sec);
+    v = bc_mix(v, st->st_mtim.tv_nsec);
+    v = bc_mix(v, st->st_ctim.tv_sec);
+    return bc_mix(v, st->st_ctim.tv_nsec);
+}
@@ -0,0 +1,39 @@
+/*
+* Client-side block cache shared by all open files
+*
+* File data is cached in fixed-size blocks identified by (node id, block#).
+* The cache is split into shards, each with its own lock, hash table and
+* CLOCK replacement over a fixed number of block slots.
+*/
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define BC_BLOCK_SIZE (256*1024)
+#define BC_NUM_SHARDS 16
+#define BC_DEFAULT_BUDGET (256*1024*1024)
+
+typedef struct bcache_stats_tt {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    size_t budget;
+} bcache_stats_t;
+
+int  bcache_init(size_t budget);
+void bcache_destroy();
+
+/* Copy 'len' bytes at 'off' within a cached block to 'dst'. Returns 0 on a hit,
+ * -1 on a miss. 'version' must match the version the block was inserted with. */
+int  bcache_get(uint64_t fileid, uint64_t version, off64_t blockno, char* dst, size_t off, size_t len);
+int  bcache_contains(uint64_t fileid, uint64_t version, off64_t blockno);
+void bcache_put(uint64_t fileid, uint64_t version, off64_t blockno, const char* data, size_t len);
+void bcache_invalidate(uint64_t fileid, off64_t blockno);
+
+void bcache_getstats(bcache_stats_t* stats);
+
+uint64_t bcache_version(const struct stat* st);
+
+#endif // BLOCKCACHE_H
@@ -38,6 +38,27 @@
 
 #include <udt.h>
 #include "common.h"
+#include "rpc.h"
+
+/* Walk 'path' from the root one lookup at a time */
+static int resolve(rpc_client_t* rpc, const char* path, uint64_t* nodeid, struct stat* st)
+{
+    char buf[512];
+    char* save = NULL;
+    char* name;
+    *nodeid = 1;
+    strncpy(buf, path, sizeof(buf)-1);
+    buf[sizeof(buf)-1] = '\0';
+    if (client_reqattr(rpc, *nodeid, st) != 0) { return -1; }
+    for (name = strtok_r(buf, "/", &save); name != NULL; name = strtok_r(NULL, "/", &save)) {
+        if (strcmp(name, ".") == 0) { continue; }
+        if (client_reqlookup(rpc, *nodeid, name, nodeid, st) != 0) {
+            fprintf(stderr, " -- '%s' not found\n", name);
+            return -1;
+        }
+    }
+    return 0;
+}
 
 int main(int argc, char** argv)
 {
@@ -45,62 +66,68 @@ int main(int argc, char** argv)
     char input[512];
     int n;
     UDTSOCKET ufd;
+    rpc_client_t rpc;
+    uint64_t session = 0;
 
     if (argc != 2) {
         fprintf(stderr, "client <hostname>\n");
         return -1;
     }
 
-    fd = client_open_socket(argv[1]);
-
     /* "auth" */
-    if (exchange_versions(fd) != 0) {
-        close(fd);
+    UDT::startup();
+    if (client_open_connection(argv[1], &session, &fd, &ufd) != 0) {
         return 0;
     }
-    UDT::startup();
-    ufd = client_connect_udt(fd);
+    rpc_client_start(&rpc, fd, ufd, NULL);
 
-    /* commands */
+    /* commands: "dir [path]", "getattr [path]", "read [path]" */
     while (1) {
         if (fgets(input, sizeof(input)-1, stdin) == NULL) { break; }
         n = strlen(input);
         if (n < 1) { continue; }
         if (input[n-1] == '\n') { input[n-1] = '\0'; }
 
-        n = send(fd, input, strlen(input)+1, 0);
-        if (n < (int)strlen(input)) {
-            perror("talker: send()");
-            break;
-        }
+        char* arg = strchr(input, ' ');
+        if (arg != NULL) { *(arg++) = '\0'; }
 
         fprintf(stderr, "echo: '%s'\n", input);
 
+        uint64_t nodeid;
+        struct stat s;
+        if (resolve(&rpc, (arg != NULL) ? arg : ".", &nodeid, &s) != 0) { continue; }
+
         if (strcasecmp(input, "dir") == 0) {
-            char* entry;
-            if (client_reqdir(fd, ".") != 0) { continue; }
-            while ((entry = client_recvdirentry(fd)) != NULL) {
-                fprintf(stderr, " -- '%s'\n", entry);
-                free(entry);
+            rpc_msg_t* entries = client_reqdirplus(&rpc, nodeid);
+            rpc_msg_t* chunk;
+            char* name;
+            for (chunk = entries; chunk != NULL; chunk = chunk->next) {
+                while (!rpc_at_end(chunk) && ((name = rpc_get_str(chunk)) != NULL)) {
+                    uint64_t child = rpc_get_u64(chunk);
+                    rpc_get_stat(chunk, &s);
+                    fprintf(stderr, " -- '%s' node %llu, %llu byte\n", name, (unsigned long long)child, (unsigned long long)s.st_size);
+                    free(name);
+                }
             }
+            rpc_msg_free(entries);
         } else
         if (strcasecmp(input, "getattr") == 0) {
-            struct stat s;
-            if (client_reqattr(fd, "common.c", &s) != 0) { continue; }
-            fprintf(stderr, " -- %lld byte, mode %lld\n", (unsigned long long)s.st_size, (unsigned long long)s.st_mode);
+            fprintf(stderr, " -- node %llu, %lld byte, mode %lld\n", (unsigned long long)nodeid, (unsigned long long)s.st_size, (unsigned long long)s.st_mode);
         } else
         if (strcasecmp(input, "read") == 0) {
-            std::ifstream testfile("common.c");
-            testfile.seekg(0, std::ios::end);
-            int testlen = testfile.tellg();
-            testlen += 16;
-            char *buf = new char[testlen];
-            client_reqsegment(fd, ufd, "common.c", 0, testlen);
-            client_recvsegment(fd, ufd, testlen, buf);
-            delete buf;
+            char *buf = new char[s.st_size + 16];
+            uint64_t fh;
+            n = -1;
+            if (client_reqopen(&rpc, nodeid, O_RDONLY, &fh, &s) == 0) {
+                n = client_reqsegment(&rpc, fh, 0, s.st_size + 16, buf);
+                client_reqrelease(&rpc, fh);
+            }
+            fprintf(stderr, " -- read %d of %lld bytes\n", n, (unsigned long long)s.st_size + 16);
+            delete[] buf;
         }
     }
 
-    close(fd);
+    rpc_client_stop(&rpc);
+    UDT::cleanup();
     return 0;
 }
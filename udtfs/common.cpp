@@ -17,29 +17,22 @@
 #include <signal.h>
 #include <unistd.h>
 #include <utime.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/time.h>
 
 
 #include <udt.h>
 
 #include "udt_congestionctrl.h"
 #include "common.h"
+#include "rpc.h"
+#include "nodes.h"
+#include "fileio.h"
 
 #define DEBUG 0
 typedef unsigned long long ull_t;
 
-char* path_to_local(char* p)
-{
-    if (p == NULL) { return NULL; }
-    if (p[0] == '/') {
-        char np[M_MAX_PATH + M_MAX_FILE];
-        np[0] = '.'; np[1] = '\0';
-        strncat(np, p, sizeof(np)-1);
-        return strdup(np);
-    } else {
-        return strdup(p);
-    }
-}
-
 int recv_str(int fd, char* buf, int maxlen, int flags)
 {
     char tmp[1]; // could be made larger...
@@ -58,17 +51,6 @@ int recv_str(int fd, char* buf, int maxlen, int flags)
     return nrx;
 }
 
-int send_cmd(int fd, const char* str)
-{
-    ssize_t n;
-    if (strlen(str) <= 0) { return 0; }
-    n = send(fd, str, strlen(str)+1, 0);
-    if (n < 0) {
-        perror("send_cmd: send");
-    }
-    return n;
-}
-
 //////////////////////////////////////////////////////////////////////
 // SOCKET -- TCP
 //////////////////////////////////////////////////////////////////////
@@ -177,67 +159,215 @@ void close_socket(int fd)
 // SOCKET -- UDTv4
 //////////////////////////////////////////////////////////////////////
 
-UDTSOCKET server_accept_udt(int tcp_fd, const int port)
+/* All data connections come in on one UDT listener and share its UDP port.
+ * The control connection hands the client a random token, which the client
+ * sends as the first 8 bytes on its UDT socket; the greeter matches it to
+ * the control connection waiting for it. */
+
+typedef struct udt_wait_tt {
+    uint64_t  token;
+    UDTSOCKET ufd;
+    struct udt_wait_tt* next;
+} udt_wait_t;
+
+static UDTSOCKET _udtlisten = UDT::INVALID_SOCK;
+static int _udtport = 0;
+static int _urandom = -1;
+static pthread_mutex_t _udtwaitlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _udtwaitcond = PTHREAD_COND_INITIALIZER;
+static udt_wait_t* _udtwaits = NULL;
+
+static void udt_setrate(UDTSOCKET ufd)
 {
-    /* Send our port# */
-    char portstr[24];
-    snprintf(portstr, sizeof(portstr)-1, "%d", port);
-    send(tcp_fd, portstr, strlen(portstr)+1, 0);
+    /* Set the speed for our sending direction */
+    CUDPBlast* cchandle = NULL;
+    int temp;
+    int rc = UDT::getsockopt(ufd, 0, UDT_CC, &cchandle, &temp);
+    if (rc != 0) {
+         fprintf(stderr, "getsockopt UDT_CC error '%s'\n", UDT::getlasterror().getErrorMessage());
+    }
+    if (NULL != cchandle) {
+         cchandle->setRate(M_UDT_RATE);
+    }
+}
 
-    /* Initial UDT socket */
-    UDTSOCKET ufd = UDT::socket(AF_INET, SOCK_STREAM, 0);
+static uint64_t udt_token()
+{
+    static uint64_t counter = 0;
+    uint64_t token = 0;
+    struct timeval tv;
+    if ((_urandom < 0) || (read(_urandom, &token, sizeof(token)) != sizeof(token))) {
+        gettimeofday(&tv, NULL);
+        token = ((uint64_t)tv.tv_sec << 32) ^ ((uint64_t)tv.tv_usec << 12) ^ (uint64_t)getpid();
+    }
+    token ^= __sync_add_and_fetch(&counter, 1);
+    return (token != 0) ? token : 1;
+}
+
+/* Reads the token of one new data connection and hands the socket over */
+static void* udt_greeter(void* arg)
+{
+    UDTSOCKET ufd = (UDTSOCKET)(intptr_t)arg;
+    unsigned char tb[8];
+    uint64_t token = 0;
+    udt_wait_t* w;
+    int got = 0, n, i;
+    int timeout = M_UDT_TOKEN_MS, forever = -1;
+
+    UDT::setsockopt(ufd, 0, UDT_RCVTIMEO, &timeout, sizeof(int));
+    while (got < (int)sizeof(tb)) {
+        n = UDT::recv(ufd, (char*)tb + got, sizeof(tb) - got, 0);
+        if (n <= 0) { break; }
+        got += n;
+    }
+    for (i = 7; i >= 0; i--) { token = (token << 8) | tb[i]; }
+
+    pthread_mutex_lock(&_udtwaitlock);
+    for (w = _udtwaits; (got == (int)sizeof(tb)) && (w != NULL); w = w->next) {
+        if ((w->token == token) && (w->ufd == UDT::INVALID_SOCK)) {
+            UDT::setsockopt(ufd, 0, UDT_RCVTIMEO, &forever, sizeof(int));
+            udt_setrate(ufd);
+            w->ufd = ufd;
+            pthread_cond_broadcast(&_udtwaitcond);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&_udtwaitlock);
+    if ((got != (int)sizeof(tb)) || (w == NULL)) {
+        fprintf(stderr, "udt_greeter: data connection without a valid token, closed\n");
+        UDT::close(ufd);
+    }
+    return NULL;
+}
+
+static void* udt_acceptor(void* arg)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    struct sockaddr_in raddr;
+    int raddr_len;
+    UDTSOCKET cli;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while (1) {
+        raddr_len = sizeof(raddr);
+        cli = UDT::accept(_udtlisten, (sockaddr*)&raddr, &raddr_len);
+        if (cli == UDT::INVALID_SOCK) {
+            fprintf(stderr, "udt_acceptor: UDT::accept() failed: %s\n", UDT::getlasterror().getErrorMessage());
+            usleep(100000);
+            continue;
+        }
+        if (pthread_create(&thread, &attr, udt_greeter, (void*)(intptr_t)cli) != 0) {
+            perror("udt_acceptor: pthread_create");
+            UDT::close(cli);
+        }
+    }
+    return NULL;
+}
+
+int server_listen_udt(const int port)
+{
+    pthread_t thread;
+    bool reuse = true;
+    int workers;
+
+    /* The listener's settings carry over to the accepted sockets */
+    _udtlisten = UDT::socket(AF_INET, SOCK_STREAM, 0);
     struct sockaddr_in maddr;
     maddr.sin_family = AF_INET;
     maddr.sin_port = htons(port);
     maddr.sin_addr.s_addr = INADDR_ANY;
     memset(&(maddr.sin_zero), '\0', 8);
     if (M_UDT_RATE>0) {
-        UDT::setsockopt(ufd, 0, UDT_CC, new CCCFactory<CUDPBlast>, sizeof(CCCFactory<CUDPBlast>));
+        UDT::setsockopt(_udtlisten, 0, UDT_CC, new CCCFactory<CUDPBlast>, sizeof(CCCFactory<CUDPBlast>));
     }
-    UDT::setsockopt(ufd, 0, UDT_MSS, new int(M_MTU_UDT), sizeof(int));
-    UDT::setsockopt(ufd, 0, UDT_RCVBUF, new int(10000000), sizeof(int));
-    UDT::setsockopt(ufd, 0, UDP_RCVBUF, new int(10000000), sizeof(int));
+    UDT::setsockopt(_udtlisten, 0, UDT_MSS, new int(M_MTU_UDT), sizeof(int));
+    UDT::setsockopt(_udtlisten, 0, UDT_RCVBUF, new int(10000000), sizeof(int));
+    UDT::setsockopt(_udtlisten, 0, UDP_RCVBUF, new int(10000000), sizeof(int));
+    UDT::setsockopt(_udtlisten, 0, UDT_REUSEADDR, &reuse, sizeof(bool));
+    /* All clients' writes arrive on this one port: receive them on several cores,
+     * no more threads than there are cores to run them; a single one takes them coalesced */
+    workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if ((workers < 1) || (workers > M_UDT_RCVWORKERS)) {
+        workers = M_UDT_RCVWORKERS;
+    }
+    UDT::setsockopt(_udtlisten, 0, UDT_RCVWORKERS, &workers, sizeof(int));
+    UDT::setsockopt(_udtlisten, 0, UDT_GRO, new bool(true), sizeof(bool));
 
     /* Bind set to listen mode */
-    if (UDT::ERROR == UDT::bind(ufd, (sockaddr*)&maddr, sizeof(maddr))) {
-        fprintf(stderr, "server_accept_udt: UDT::bind() failed\n");
-        return UDT::INVALID_SOCK;
+    if (UDT::ERROR == UDT::bind(_udtlisten, (sockaddr*)&maddr, sizeof(maddr))) {
+        fprintf(stderr, "server_listen_udt: UDT::bind() failed: %s\n", UDT::getlasterror().getErrorMessage());
+        return -1;
     }
-    if (UDT::ERROR == UDT::listen(ufd, 10)) {
-        fprintf(stderr, "server_accept_udt: UDT::listen() failed\n");
-        return UDT::INVALID_SOCK;
+    if (UDT::ERROR == UDT::listen(_udtlisten, M_BACKLOG_UDT)) {
+        fprintf(stderr, "server_listen_udt: UDT::listen() failed\n");
+        return -1;
     }
-    struct sockaddr_in raddr;
-    int raddr_len = sizeof(raddr);
-
-    /* Wait for a connection */
-    UDTSOCKET cli = UDT::accept(ufd, (sockaddr*)&raddr, &raddr_len);
-    UDT::close(ufd);
-    if (cli == UDT::INVALID_SOCK) {
-        fprintf(stderr, "server_accept_udt: UDT::accept() failed\n");
-        return UDT::ERROR;
+    _udtport = port;
+    _urandom = open("/dev/urandom", O_RDONLY);
+    if (pthread_create(&thread, NULL, udt_acceptor, NULL) != 0) {
+        perror("server_listen_udt: pthread_create");
+        return -1;
     }
+    pthread_detach(thread);
+    fprintf(stderr, "Accepting UDT data connections on port %d\n", port);
+    return 0;
+}
 
-    /* Set the speed for the "server=>client" direction */
-    CUDPBlast* cchandle = NULL;
-    int temp;
-    int rc = UDT::getsockopt(cli, 0, UDT_CC, &cchandle, &temp);
-    if (rc != 0) {
-         fprintf(stderr, "getsockopt UDT_CC error '%s'\n", UDT::getlasterror().getErrorMessage());
+UDTSOCKET server_accept_udt(int tcp_fd)
+{
+    char str[M_MAX_VAL];
+    udt_wait_t w;
+    udt_wait_t** pw;
+    struct timespec ts;
+    int rc = 0;
+
+    /* Wait for the token before the client can know it */
+    w.token = udt_token();
+    w.ufd = UDT::INVALID_SOCK;
+    pthread_mutex_lock(&_udtwaitlock);
+    w.next = _udtwaits;
+    _udtwaits = &w;
+    pthread_mutex_unlock(&_udtwaitlock);
+
+    /* Send our port# and the token */
+    snprintf(str, sizeof(str), "%d %llu", _udtport, (ull_t)w.token);
+    if (send(tcp_fd, str, strlen(str)+1, 0) < 0) {
+        perror("send UDT port");
+        rc = -1;
     }
-    if (NULL != cchandle) {
-         cchandle->setRate(M_UDT_RATE);
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += M_UDT_TOKEN_MS / 1000;
+    pthread_mutex_lock(&_udtwaitlock);
+    while ((rc == 0) && (w.ufd == UDT::INVALID_SOCK)) {
+        rc = pthread_cond_timedwait(&_udtwaitcond, &_udtwaitlock, &ts);
     }
+    for (pw = &_udtwaits; *pw != &w; pw = &(*pw)->next) { }
+    *pw = w.next;
+    pthread_mutex_unlock(&_udtwaitlock);
 
-    /* Done */
-    return cli;
+    if (w.ufd == UDT::INVALID_SOCK) {
+        fprintf(stderr, "server_accept_udt: no data connection from the client\n");
+    }
+    return w.ufd;
 }
 
 UDTSOCKET client_connect_udt(int tcp_fd)
 {
-    /* Receive port# */
-    char portstr[24];
-    if (recv_str(tcp_fd, portstr, sizeof(portstr)-1, 0) <= 0) {
+    /* Receive port# and token */
+    char str[M_MAX_VAL];
+    int port;
+    ull_t token;
+    unsigned char tb[8];
+    int i;
+    if (recv_str(tcp_fd, str, sizeof(str)-1, 0) <= 0) {
+        return UDT::INVALID_SOCK;
+    }
+    str[sizeof(str)-1] = '\0';
+    if (sscanf(str, "%d %llu", &port, &token) != 2) {
+        fprintf(stderr, "client_connect_udt: bad port/token '%s'\n", str);
         return UDT::INVALID_SOCK;
     }
 
@@ -248,31 +378,29 @@ UDTSOCKET client_connect_udt(int tcp_fd)
     getpeername(tcp_fd, (struct sockaddr*)&raddr, &raddrlen);
     // inet_pton(AF_INET, "127.0.0.1", &raddr.sin_addr);
     raddr.sin_family = AF_INET;
-    raddr.sin_port = htons(atoi(portstr));
+    raddr.sin_port = htons(port);
     memset(&(raddr.sin_zero), '\0', 8); 
     UDT::setsockopt(ufd, 0, UDT_CC, new CCCFactory<CUDPBlast>, sizeof(CCCFactory<CUDPBlast>));
     UDT::setsockopt(ufd, 0, UDT_MSS, new int(M_MTU_UDT), sizeof(int));
     UDT::setsockopt(ufd, 0, UDT_SNDBUF, new int(10000000), sizeof(int));
     UDT::setsockopt(ufd, 0, UDP_SNDBUF, new int(10000000), sizeof(int));
+    UDT::setsockopt(ufd, 0, UDT_GRO, new bool(true), sizeof(bool));
 
-    /* Connect to server IP & port */
+    /* Connect to server IP & port, then tell whose data connection this is */
     if (UDT::ERROR == UDT::connect(ufd, (sockaddr*)&raddr, sizeof(raddr))) {
         fprintf(stderr, "client_connect_udt: UDT::connect() failed\n");
+        UDT::close(ufd);
         return UDT::INVALID_SOCK;
     }
-    fprintf(stdout, "TCP and UDT connected to server.\n");
-
-    /* Set the speed for the "client=>server" direction */
-    CUDPBlast* cchandle = NULL;
-    int temp;
-    int rc = UDT::getsockopt(ufd, 0, UDT_CC, &cchandle, &temp);
-    if (rc != 0) {
-         fprintf(stderr, "getsockopt UDT_CC error '%s'\n", UDT::getlasterror().getErrorMessage());
-    }
-    if (NULL != cchandle) {
-         cchandle->setRate(M_UDT_RATE);
+    for (i = 0; i < 8; i++) { tb[i] = (unsigned char)(token >> (8*i)); }
+    if (UDT::send(ufd, (char*)tb, sizeof(tb), 0) != (int)sizeof(tb)) {
+        fprintf(stderr, "client_connect_udt: sending the token failed\n");
+        UDT::close(ufd);
+        return UDT::INVALID_SOCK;
     }
+    fprintf(stdout, "TCP and UDT connected to server.\n");
 
+    udt_setrate(ufd);
     return ufd;
 }
 
@@ -302,408 +430,1138 @@ int exchange_versions(int fd)
     return 0;
 }
 
-//////////////////////////////////////////////////////////////////////
-// READDIR
-//////////////////////////////////////////////////////////////////////
-
-int server_senddir(int fd)
+/* Session ids travel as decimal strings like the UDT port, 0 asks for a new one */
+int send_session(int fd, uint64_t session)
 {
-    char str[M_MAX_PATH + M_MAX_FILE];
-    DIR* dir;
-    char* path;
-    struct dirent* entry;
-    ssize_t n;
-
-    n = recv_str(fd, str, sizeof(str)-1, 0);
-    if (n <= 0) { return -1; }
-    path = path_to_local(str);
-
-    dir = opendir(path);
-    if (dir == NULL) {
-        perror("opendir");
-        n = send(fd, RESERVED_STR_TERM, strlen(RESERVED_STR_TERM)+1, 0);
-        free(path);
+    char str[M_MAX_VAL];
+    snprintf(str, sizeof(str), "%llu", (ull_t)session);
+    if (send(fd, str, strlen(str)+1, 0) < 0) {
+        perror("send session");
         return -1;
     }
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp("..", entry->d_name) == 0) { continue; }
-        if (strcmp(".", entry->d_name) == 0) { continue; }
-        n = send(fd, entry->d_name, strlen(entry->d_name)+1, 0);
-    }
-    closedir(dir);
-    n = send(fd, RESERVED_STR_TERM, strlen(RESERVED_STR_TERM)+1, 0);
-    if (n < 0) {
-        perror("server_senddir: end marker send()");
-    }
-    free(path);
     return 0;
 }
 
-int client_reqdir(int fd, const char* dirname)
+int recv_session(int fd, uint64_t* session)
 {
-    ssize_t n;
-    n = send(fd, dirname, strlen(dirname)+1, 0);
-    if (n <= 0) {
-        perror("client_recvdir: send");
+    char str[M_MAX_VAL];
+    if (recv_str(fd, str, sizeof(str)-1, 0) <= 0) {
         return -1;
     }
+    str[sizeof(str)-1] = '\0';
+    *session = strtoull(str, NULL, 10);
     return 0;
 }
 
-char* client_recvdirentry(int fd)
+/* Connect one control/data pair and join 'session' (0 starts a new one,
+ * whose id is stored back). The caller has called UDT::startup(). */
+int client_open_connection(char* hostname, uint64_t* session, int* fd, UDTSOCKET* ufd)
 {
-    char filename[M_MAX_PATH + M_MAX_FILE];
-    ssize_t n;
-    n = recv_str(fd, filename, sizeof(filename)-1, 0);
-    if (n < 1) {
-        return NULL;
+    if ((*fd = client_open_socket(hostname)) < 0) {
+        return -1;
     }
-    if (strncasecmp(filename, RESERVED_STR_TERM, strlen(RESERVED_STR_TERM)) == 0) {
-        return NULL;
+    if ((exchange_versions(*fd) != 0) || (send_session(*fd, *session) != 0)
+        || (recv_session(*fd, session) != 0) || (*session == 0)) {
+        fprintf(stderr, "client_open_connection: handshake failed\n");
+        close(*fd);
+        return -1;
+    }
+    *ufd = client_connect_udt(*fd);
+    if (*ufd == UDT::INVALID_SOCK) {
+        close(*fd);
+        return -1;
     }
-    return strdup(filename);
+    return 0;
 }
 
 //////////////////////////////////////////////////////////////////////
-// GETATTR
+// SESSIONS
 //////////////////////////////////////////////////////////////////////
 
-int server_sendattr(int fd)
-{
-    char pathstr[M_MAX_PATH + M_MAX_FILE];
-    char str[M_MAX_VAL];
-    struct stat statbuf;
-    char* path;
-    ssize_t n;
+static pthread_mutex_t _sessionlock = PTHREAD_MUTEX_INITIALIZER;
+static server_session_t* _sessions = NULL;
+static uint64_t _nextsession = 1;
 
-    n = recv_str(fd, pathstr, sizeof(pathstr)-1, 0);
-    if (n <= 0) { return -1; }
-    path = path_to_local(pathstr);
-    if (stat(path, &statbuf) < 0) {
-        perror("stat");
-        free(path);
-        send(fd, RESERVED_STR_TERM, strlen(RESERVED_STR_TERM)+1, 0);
-        return -1;
+server_session_t* session_join(uint64_t id)
+{
+    server_session_t* ss;
+    pthread_mutex_lock(&_sessionlock);
+    for (ss = _sessions; (ss != NULL) && (id != 0) && (ss->id != id); ss = ss->next) { }
+    if (id == 0) {
+        ss = (server_session_t*)calloc(1, sizeof(server_session_t));
+        if ((ss != NULL) && ((ss->refs = node_refs_new()) == NULL)) {
+            free(ss);
+            ss = NULL;
+        }
+        if (ss != NULL) {
+            ss->id = _nextsession++;
+            ss->nextfile = 1;
+            pthread_mutex_init(&ss->lock, NULL);
+            pthread_cond_init(&ss->pushcond, NULL);
+            pthread_mutex_init(&ss->filelock, NULL);
+            ss->next = _sessions;
+            _sessions = ss;
+        }
     }
-    free(path);
-    snprintf(str, sizeof(str), "%Lu", (unsigned long long)(statbuf.st_size));
-    n = send(fd, str, strlen(str)+1, 0);
-    snprintf(str, sizeof(str), "%Lu", (unsigned long long)(statbuf.st_mode));
-    n = send(fd, str, strlen(str)+1, 0);
-    snprintf(str, sizeof(str), "%Lu", (unsigned long long)(statbuf.st_ctime));
-    n = send(fd, str, strlen(str)+1, 0);
-    snprintf(str, sizeof(str), "%Lu", (unsigned long long)(statbuf.st_atime));
-    n = send(fd, str, strlen(str)+1, 0);
-    snprintf(str, sizeof(str), "%Lu", (unsigned long long)(statbuf.st_mtime));
-    n = send(fd, str, strlen(str)+1, 0);
-    snprintf(str, sizeof(str), "%Lu", (unsigned long long)(statbuf.st_nlink));
-    n = send(fd, str, strlen(str)+1, 0);
-    snprintf(str, sizeof(str), "%Lu", (unsigned long long)(statbuf.st_dev));
-    n = send(fd, str, strlen(str)+1, 0);
-    snprintf(str, sizeof(str), "%Lu", (unsigned long long)(statbuf.st_rdev));
-    n = send(fd, str, strlen(str)+1, 0);
-    return 0;
+    if (ss != NULL) {
+        ss->nconns++;
+    }
+    pthread_mutex_unlock(&_sessionlock);
+    return ss;
 }
 
-int client_reqattr(int fd, const char *path, struct stat *s)
+static void file_close(server_file_t* f)
 {
-    char info[M_MAX_VAL];
-    ssize_t n;
-    n = send(fd, path, strlen(path)+1, 0);
-    if (n <= 0) {
-        perror("client_reqattr: send");
-        return -1;
-    }
-    n = recv_str(fd, info, sizeof(info)-1, 0);
-	if (strncasecmp(info, RESERVED_STR_TERM, strlen(RESERVED_STR_TERM)) == 0) {
-        return -1;
-    }
-    if ((s != NULL) && (n > 0)) {
-        s->st_size = atoll(info);
+    pthread_mutex_destroy(&f->ralock);
+    close(f->fd);
+    node_put(f->node);
+    free(f);
+}
+
+/* Caller holds _sessionlock, which is released */
+static void session_release(server_session_t* ss)
+{
+    server_session_t** pp;
+    int i;
+    if ((ss->nconns > 0) || (ss->pins > 0)) {
+        pthread_mutex_unlock(&_sessionlock);
+        return;
     }
-    n = recv_str(fd, info, sizeof(info)-1, 0);
-    if ((s != NULL) && (n > 0)) {
-        s->st_mode = atoll(info);
+    for (pp = &_sessions; *pp != ss; pp = &((*pp)->next)) { }
+    *pp = ss->next;
+    pthread_mutex_unlock(&_sessionlock);
+    /* No requests are left, whatever the client did not release is closed */
+    for (i = 0; i < M_FILE_BUCKETS; i++) {
+        while (ss->files[i] != NULL) {
+            server_file_t* f = ss->files[i];
+            ss->files[i] = f->next;
+            file_close(f);
+        }
     }
-    n = recv_str(fd, info, sizeof(info)-1, 0);
-    if ((s != NULL) && (n > 0)) {
-        s->st_ctime = atoll(info);
+    node_refs_free(ss->refs);
+    pthread_mutex_destroy(&ss->lock);
+    pthread_cond_destroy(&ss->pushcond);
+    pthread_mutex_destroy(&ss->filelock);
+    free(ss);
+}
+
+void session_leave(server_session_t* ss)
+{
+    pthread_mutex_lock(&_sessionlock);
+    ss->nconns--;
+    session_release(ss);
+}
+
+void session_attach(server_session_t* ss, rpc_server_t* s)
+{
+    int i;
+    pthread_mutex_lock(&ss->lock);
+    for (i = 0; (i < M_MAX_SESSION_CONNS) && (ss->conns[i] != NULL); i++) { }
+    if (i < M_MAX_SESSION_CONNS) { ss->conns[i] = s; }
+    pthread_mutex_unlock(&ss->lock);
+}
+
+void session_detach(server_session_t* ss, rpc_server_t* s)
+{
+    int i;
+    pthread_mutex_lock(&ss->lock);
+    for (i = 0; i < M_MAX_SESSION_CONNS; i++) {
+        if (ss->conns[i] == s) { ss->conns[i] = NULL; }
     }
-    n = recv_str(fd, info, sizeof(info)-1, 0);
-    if ((s != NULL) && (n > 0)) {
-        s->st_atime = atoll(info);
+    /* A callback may still be sending on 's' */
+    while (ss->pushing > 0) {
+        pthread_cond_wait(&ss->pushcond, &ss->lock);
     }
-    n = recv_str(fd, info, sizeof(info)-1, 0);
-    if ((s != NULL) && (n > 0)) {
-        s->st_mtime = atoll(info);
+    pthread_mutex_unlock(&ss->lock);
+}
+
+/* Send 'm' over the first connection of session 'id' that takes it. The
+ * send may block, so it is done outside 'ss->lock' on a copy of the
+ * connections; session_detach() waits for it before a connection goes. */
+static void session_push(uint64_t id, rpc_msg_t* m)
+{
+    server_session_t* ss;
+    rpc_server_t* conns[M_MAX_SESSION_CONNS];
+    int i;
+
+    pthread_mutex_lock(&_sessionlock);
+    for (ss = _sessions; (ss != NULL) && (ss->id != id); ss = ss->next) { }
+    if (ss != NULL) { ss->pins++; }
+    pthread_mutex_unlock(&_sessionlock);
+    if (ss == NULL) { return; }
+
+    pthread_mutex_lock(&ss->lock);
+    memcpy(conns, ss->conns, sizeof(conns));
+    ss->pushing++;
+    pthread_mutex_unlock(&ss->lock);
+    for (i = 0; i < M_MAX_SESSION_CONNS; i++) {
+        if ((conns[i] != NULL) && (rpc_push(conns[i], m) == 0)) { break; }
     }
-    n = recv_str(fd, info, sizeof(info)-1, 0);
-    if ((s != NULL) && (n > 0)) {
-        s->st_nlink = atoll(info);
+    pthread_mutex_lock(&ss->lock);
+    if (--ss->pushing == 0) { pthread_cond_broadcast(&ss->pushcond); }
+    pthread_mutex_unlock(&ss->lock);
+
+    pthread_mutex_lock(&_sessionlock);
+    ss->pins--;
+    session_release(ss);
+}
+
+//////////////////////////////////////////////////////////////////////
+// OPEN FILES -- per session, closed on RELEASE or when the session ends
+//////////////////////////////////////////////////////////////////////
+
+/* Enter 'fd' of the pinned node 'n', returns the handle */
+static uint64_t file_add(server_session_t* ss, node_t* n, int fd)
+{
+    server_file_t* f = (server_file_t*)calloc(1, sizeof(server_file_t));
+    uint64_t id;
+    if (f == NULL) { return 0; }
+    f->fd = fd;
+    f->node = n;
+    f->refs = 1;
+    f->rawin = M_RA_MIN;
+    pthread_mutex_init(&f->ralock, NULL);
+    pthread_mutex_lock(&ss->filelock);
+    id = f->id = ss->nextfile++;
+    f->next = ss->files[id % M_FILE_BUCKETS];
+    ss->files[id % M_FILE_BUCKETS] = f;
+    pthread_mutex_unlock(&ss->filelock);
+    return id;
+}
+
+/* Returns the file with a reference for the caller, NULL if it is not open */
+static server_file_t* file_get(server_session_t* ss, uint64_t id)
+{
+    server_file_t* f;
+    pthread_mutex_lock(&ss->filelock);
+    for (f = ss->files[id % M_FILE_BUCKETS]; (f != NULL) && (f->id != id); f = f->next) { }
+    if (f != NULL) { f->refs++; }
+    pthread_mutex_unlock(&ss->filelock);
+    return f;
+}
+
+static void file_put(server_session_t* ss, server_file_t* f)
+{
+    int refs;
+    if (f == NULL) { return; }
+    pthread_mutex_lock(&ss->filelock);
+    refs = --f->refs;
+    pthread_mutex_unlock(&ss->filelock);
+    if (refs == 0) { file_close(f); }
+}
+
+/* Take 'id' out of the table, it closes when the last request is done */
+static void file_remove(server_session_t* ss, uint64_t id)
+{
+    server_file_t** pp;
+    server_file_t* f;
+    pthread_mutex_lock(&ss->filelock);
+    for (pp = &ss->files[id % M_FILE_BUCKETS]; (*pp != NULL) && ((*pp)->id != id); pp = &((*pp)->next)) { }
+    f = *pp;
+    if (f != NULL) { *pp = f->next; }
+    pthread_mutex_unlock(&ss->filelock);
+    file_put(ss, f);
+}
+
+//////////////////////////////////////////////////////////////////////
+// LEASES AND CALLBACKS
+//////////////////////////////////////////////////////////////////////
+
+static inline server_session_t* server_ss(rpc_server_t* s)
+{
+    return (server_session_t*)s->session;
+}
+
+/* Node references are counted per client session, shared by its connections */
+static inline node_refs_t* server_refs(rpc_server_t* s)
+{
+    return server_ss(s)->refs;
+}
+
+static inline uint64_t server_session(rpc_server_t* s)
+{
+    return server_ss(s)->id;
+}
+
+/* Tell the other sessions holding a lease that 'n' changed, or with a
+ * 'name' that the entry in directory 'n' did. Not acknowledged: a client
+ * that misses it still drops the attributes when the lease runs out. */
+static void server_recall(rpc_server_t* s, node_t* n, const char* name)
+{
+    uint64_t* sessions;
+    rpc_msg_t* m;
+    int i, count;
+
+    sessions = node_recall(n, server_session(s), &count);
+    if (sessions == NULL) { return; }
+    m = rpc_msg_new(RPC_OP_NOTIFY);
+    rpc_put_u32(m, RPC_NOTIFY_NODE);
+    rpc_put_u64(m, n->id);
+    if (name != NULL) {
+        rpc_put_u32(m, RPC_NOTIFY_ENTRY);
+        rpc_put_u64(m, n->id);
+        rpc_put_str(m, name);
     }
-    n = recv_str(fd, info, sizeof(info)-1, 0);
-    if ((s != NULL) && (n > 0)) {
-        s->st_dev = atoll(info);
+    for (i = 0; i < count; i++) {
+        session_push(sessions[i], m);
     }
-    n = recv_str(fd, info, sizeof(info)-1, 0);
-    if ((s != NULL) && (n > 0)) {
-        s->st_rdev = atoll(info);
+    rpc_msg_free(m);
+    free(sessions);
+}
+
+/* Lease 'n' to the client and stat it; a recall of 'n' between a stat and
+ * the lease would not reach the client, so the stat comes second */
+static int server_stat_leased(rpc_server_t* s, node_t* n, struct stat* st)
+{
+    node_lease(n, server_session(s), RPC_LEASE_TIME);
+    return node_stat(n, st);
+}
+
+/* A node found by a lookup was stat'ed before it could be leased: stat it
+ * again if anything was recalled since 'changes' */
+static void server_lease_found(rpc_server_t* s, node_t* n, struct stat* st, uint64_t changes)
+{
+    node_lease(n, server_session(s), RPC_LEASE_TIME);
+    if (node_changes() != changes) {
+        node_stat(n, st);
     }
-    return 0;
 }
 
 //////////////////////////////////////////////////////////////////////
-// READ, WRITE, MOVE, REMOVE AND COPY
+// LOOKUP AND FORGET
 //////////////////////////////////////////////////////////////////////
-int server_utime(int fd, UDTSOCKET ufd)
+
+int server_lookup(rpc_server_t* s, rpc_msg_t* req)
 {
-    char path[M_MAX_VAL];
-    int ret = 0, n = 0;
+    struct stat statbuf;
+    uint64_t parentid = rpc_get_u64(req);
+    char* name = rpc_get_str(req);
+    node_t* parent;
+    node_t* n = NULL;
+    rpc_msg_t* reply;
+
+    if ((name == NULL) || req->err) {
+        free(name);
+        return rpc_reply(s, req, -1, NULL);
+    }
+    parent = node_get(parentid);
+    if (parent != NULL) {
+        uint64_t changes = node_changes();
+        /* The name is cached under the lease on its directory */
+        node_lease(parent, server_session(s), RPC_LEASE_TIME);
+        n = node_lookup(server_refs(s), parent, name, &statbuf);
+        if (n != NULL) { server_lease_found(s, n, &statbuf, changes); }
+        node_put(parent);
+    }
+    free(name);
+    if (n == NULL) {
+        return rpc_reply(s, req, -1, NULL);
+    }
+    reply = rpc_msg_new(RPC_OP_LOOKUP);
+    rpc_put_u64(reply, n->id);
+    rpc_put_stat(reply, &statbuf);
+    rpc_reply(s, req, 0, reply);
+    rpc_msg_free(reply);
+    return 0;
+}
 
-    n = recv_str(fd, path, sizeof(path)-1, 0);
-    if (n <= 0) {
-        fprintf(stderr, "server_sendsegment: recv error\n");
+/* Returns 0 and fills 'nodeid' and 's', -1 if the name does not exist */
+int client_reqlookup(rpc_client_t* c, uint64_t parent, const char* name, uint64_t* nodeid, struct stat* s)
+{
+    rpc_msg_t* req = rpc_msg_new(RPC_OP_LOOKUP);
+    rpc_msg_t* reply;
+    rpc_put_u64(req, parent);
+    rpc_put_str(req, name);
+    reply = rpc_call(c, req, NULL, 0);
+    rpc_msg_free(req);
+    if ((reply == NULL) || (reply->status != 0)) {
+        rpc_msg_free(reply);
+        return -1;
+    }
+    *nodeid = rpc_get_u64(reply);
+    rpc_get_stat(reply, s);
+    if (reply->err) {
+        rpc_msg_free(reply);
         return -1;
     }
-    char* path_local  = path_to_local(path);
+    rpc_msg_free(reply);
+    return 0;
+}
 
-    char command[256];
-    snprintf(command, sizeof command, "touch %s", path_local);
-    system(command);
-    return ret;
+/* (node id, count) pairs; nothing is sent back */
+int server_forget(rpc_server_t* s, rpc_msg_t* req)
+{
+    while (!rpc_at_end(req)) {
+        uint64_t id = rpc_get_u64(req);
+        uint64_t nlookup = rpc_get_u64(req);
+        if (req->err) { break; }
+        node_forget(server_refs(s), id, nlookup);
+    }
+    return 0;
 }
 
-int server_unlink(int fd, UDTSOCKET ufd)
+int client_reqforget(rpc_client_t* c, const uint64_t* nodeids, const uint64_t* nlookups, int n)
 {
-    char path[M_MAX_VAL];
-    int ret = 0, n = 0;
+    rpc_msg_t* req = rpc_msg_new(RPC_OP_FORGET);
+    int i, rc;
+    for (i = 0; i < n; i++) {
+        rpc_put_u64(req, nodeids[i]);
+        rpc_put_u64(req, nlookups[i]);
+    }
+    rc = rpc_post(c, req);
+    rpc_msg_free(req);
+    return rc;
+}
 
-    n = recv_str(fd, path, sizeof(path)-1, 0);
-    if (n <= 0) {
-        fprintf(stderr, "server_sendsegment: recv error\n");
-        return -1;
+//////////////////////////////////////////////////////////////////////
+// READDIR
+//////////////////////////////////////////////////////////////////////
+
+/* Names, node ids and attributes of all entries, in chunks of about RPC_CHUNK_SIZE */
+int server_senddirplus(rpc_server_t* s, rpc_msg_t* req)
+{
+    struct stat statbuf;
+    rpc_msg_t* reply;
+    node_t* n;
+    char* names = NULL;
+    size_t len = 0, pos;
+
+    n = node_get(rpc_get_u64(req));
+    if (n != NULL) { node_lease(n, server_session(s), RPC_LEASE_TIME); }
+    if ((n == NULL) || (node_readdir(n, &names, &len) != 0)) {
+        node_put(n);
+        return rpc_reply(s, req, -1, NULL);
     }
+    reply = rpc_msg_new(RPC_OP_READDIRPLUS);
+    for (pos = 0; pos < len; pos += strlen(names + pos) + 1) {
+        const char* name = names + pos;
+        uint64_t changes = node_changes();
+        node_t* child;
+        if ((child = node_lookup(server_refs(s), n, name, &statbuf)) == NULL) { continue; }
+        server_lease_found(s, child, &statbuf, changes);
+        rpc_put_str(reply, name);
+        rpc_put_u64(reply, child->id);
+        rpc_put_stat(reply, &statbuf);
+        if (reply->len >= RPC_CHUNK_SIZE) {
+            if (rpc_reply_part(s, req, reply) != 0) { break; }
+        }
+    }
+    free(names);
+    node_put(n);
+    rpc_reply(s, req, 0, reply);
+    rpc_msg_free(reply);
+    return 0;
+}
 
-    char* path_local  = path_to_local(path);
-    ret = unlink(path_local);
-    return ret;
+/* Returns a chain of reply frames, each holding (name, node id, stat) entries.
+ * Every entry carries one node reference the caller has to forget. */
+rpc_msg_t* client_reqdirplus(rpc_client_t* c, uint64_t nodeid)
+{
+    rpc_msg_t* req = rpc_msg_new(RPC_OP_READDIRPLUS);
+    rpc_msg_t* reply;
+    rpc_put_u64(req, nodeid);
+    reply = rpc_call(c, req, NULL, 0);
+    rpc_msg_free(req);
+    if ((reply != NULL) && (reply->status != 0)) {
+        rpc_msg_free(reply);
+        return NULL;
+    }
+    return reply;
 }
 
-int server_rename(int fd, UDTSOCKET ufd)
+//////////////////////////////////////////////////////////////////////
+// GETATTR
+//////////////////////////////////////////////////////////////////////
+
+int server_sendattr(rpc_server_t* s, rpc_msg_t* req)
 {
-    char path[M_MAX_VAL];
-    char newpath[M_MAX_VAL];
-    int ret = 0, n = 0;
+    struct stat statbuf;
+    rpc_msg_t* reply;
+    node_t* n;
+    int rc = -1;
+
+    n = node_get(rpc_get_u64(req));
+    if (n != NULL) {
+        rc = server_stat_leased(s, n, &statbuf);
+        node_put(n);
+    }
+    if (rc != 0) {
+        return rpc_reply(s, req, -1, NULL);
+    }
+    reply = rpc_msg_new(RPC_OP_GETATTR);
+    rpc_put_stat(reply, &statbuf);
+    rpc_reply(s, req, 0, reply);
+    rpc_msg_free(reply);
+    return 0;
+}
 
-    n = recv_str(fd, path, sizeof(path)-1, 0);
-    if (n <= 0) {
-        fprintf(stderr, "server_sendsegment: recv error\n");
+int client_reqattr(rpc_client_t* c, uint64_t nodeid, struct stat *s)
+{
+    rpc_msg_t* req = rpc_msg_new(RPC_OP_GETATTR);
+    rpc_msg_t* reply;
+    struct stat st;
+    rpc_put_u64(req, nodeid);
+    reply = rpc_call(c, req, NULL, 0);
+    rpc_msg_free(req);
+    if ((reply == NULL) || (reply->status != 0)) {
+        rpc_msg_free(reply);
         return -1;
     }
-
-    n = recv_str(fd, newpath, sizeof(newpath)-1, 0);
-    if (n <= 0) {
-        fprintf(stderr, "server_sendsegment: recv error\n");
+    rpc_get_stat(reply, &st);
+    if (reply->err) {
+        rpc_msg_free(reply);
         return -1;
     }
+    if (s != NULL) {
+        *s = st;
+    }
+    rpc_msg_free(reply);
+    return 0;
+}
 
-    char* path_local  = path_to_local(path);
-    char* newpath_local  = path_to_local(newpath);
+//////////////////////////////////////////////////////////////////////
+// OPEN AND RELEASE
+//////////////////////////////////////////////////////////////////////
 
-    rename(path_local,newpath_local);
+/* (node id, access mode); the reply carries the handle and the attributes
+ * of the file opened */
+int server_open(rpc_server_t* s, rpc_msg_t* req)
+{
+    node_t* n = node_get(rpc_get_u64(req));
+    uint32_t flags = rpc_get_u32(req);
+    struct stat statbuf;
+    rpc_msg_t* reply;
+    uint64_t fh = 0;
+    int fd = -1;
+
+    if ((n != NULL) && !req->err && !n->isdir) {
+        node_lease(n, server_session(s), RPC_LEASE_TIME);
+        fd = node_open(n, flags & O_ACCMODE);
+    }
+    if ((fd >= 0) && (fstat(fd, &statbuf) == 0)) {
+        fh = file_add(server_ss(s), n, fd);
+    }
+    if (fh == 0) {
+        if (fd >= 0) { close(fd); }
+        node_put(n);
+        return rpc_reply(s, req, -1, NULL);
+    }
+    reply = rpc_msg_new(RPC_OP_OPEN);
+    rpc_put_u64(reply, fh);
+    rpc_put_stat(reply, &statbuf);
+    rpc_reply(s, req, 0, reply);
+    rpc_msg_free(reply);
     return 0;
 }
 
-int server_truncate(int fd, UDTSOCKET ufd)
+/* Nothing is sent back */
+int server_release(rpc_server_t* s, rpc_msg_t* req)
 {
-    char path[M_MAX_VAL];
-    char info[M_MAX_VAL];
-    off64_t newsize;
-    int ret = 0, n = 0;
+    uint64_t fh = rpc_get_u64(req);
+    if (!req->err) {
+        file_remove(server_ss(s), fh);
+    }
+    return 0;
+}
 
-    n = recv_str(fd, path, sizeof(path)-1, 0);
-    if (n <= 0) {
-        fprintf(stderr, "server_sendsegment: recv error\n");
+/* Returns 0 and fills 'fh' and 's', -1 if the file cannot be opened */
+int client_reqopen(rpc_client_t* c, uint64_t nodeid, int flags, uint64_t* fh, struct stat* s)
+{
+    rpc_msg_t* req = rpc_msg_new(RPC_OP_OPEN);
+    rpc_msg_t* reply;
+    rpc_put_u64(req, nodeid);
+    rpc_put_u32(req, flags);
+    reply = rpc_call(c, req, NULL, 0);
+    rpc_msg_free(req);
+    if ((reply == NULL) || (reply->status != 0)) {
+        rpc_msg_free(reply);
         return -1;
     }
-
-    n = recv_str(fd, info, sizeof(info)-1, 0);
-    if (n <= 0) {
-        fprintf(stderr, "server_sendsegment: recv error\n");
+    *fh = rpc_get_u64(reply);
+    rpc_get_stat(reply, s);
+    if (reply->err) {
+        rpc_msg_free(reply);
         return -1;
     }
-    newsize = atoll(info);
-
-    ret = truncate(path, newsize);
+    rpc_msg_free(reply);
+    return 0;
+}
 
-    return ret;
+int client_reqrelease(rpc_client_t* c, uint64_t fh)
+{
+    rpc_msg_t* req = rpc_msg_new(RPC_OP_RELEASE);
+    int rc;
+    rpc_put_u64(req, fh);
+    rc = rpc_post(c, req);
+    rpc_msg_free(req);
+    return rc;
 }
 
-int server_write(int fd, UDTSOCKET ufd)
+//////////////////////////////////////////////////////////////////////
+// READ, WRITE, MOVE, REMOVE AND COPY
+//////////////////////////////////////////////////////////////////////
+/* The mutating requests reply 0 or -errno; a node the server no longer
+ * knows is -ESTALE, a malformed request -EINVAL */
+
+int server_utime(rpc_server_t* s, rpc_msg_t* req)
 {
-    char path[M_MAX_VAL];
-    char data[M_MAX_VAL];
-    char info[M_MAX_VAL];
-    size_t size;
-    off_t offset;
-    int ret = 0, n = 0;
+    node_t* n = node_get(rpc_get_u64(req));
+    node_t* parent;
+    char* name = NULL;
+    struct timespec ts[2];
+    int i, rc = -ESTALE;
+
+    for (i = 0; i < 2; i++) {
+        ts[i].tv_sec = (time_t)(int64_t)rpc_get_u64(req);
+        ts[i].tv_nsec = rpc_get_u32(req);
+    }
+    if ((n == NULL) || req->err) {
+        node_put(n);
+        return rpc_reply(s, req, (n == NULL) ? -ESTALE : -EINVAL, NULL);
+    }
+    if (n->isdir) {
+        rc = (futimens(node_dirfd(n), ts) == 0) ? 0 : -errno;
+    } else if ((parent = node_locate(n, &name)) != NULL) {
+        rc = (utimensat(node_dirfd(parent), name, ts, AT_SYMLINK_NOFOLLOW) == 0) ? 0 : -errno;
+        free(name);
+        node_put(parent);
+    }
+    if (rc == 0) {
+        node_changed(n);
+        server_recall(s, n, NULL);
+    }
+    node_put(n);
+    return rpc_reply(s, req, rc, NULL);
+}
 
-    n = recv_str(fd, path, sizeof(path)-1, 0);
-    if (n <= 0) {
-        fprintf(stderr, "server_sendsegment: recv error\n");
-        return -1;
+/* 'flags' 0 or AT_REMOVEDIR as for unlinkat() */
+static int unlink_one(rpc_server_t* s, uint64_t parentid, const char* name, int flags)
+{
+    node_t* parent = node_get(parentid);
+    int rc = -ESTALE;
+
+    if ((parent != NULL) && (!node_name_ok(name) || (flags & ~AT_REMOVEDIR))) {
+        rc = -EINVAL;
+    } else if (parent != NULL) {
+        rc = (unlinkat(node_dirfd(parent), name, flags) == 0) ? 0 : -errno;
+        if (rc == 0) {
+            node_entry_changed(parent, name);
+            server_recall(s, parent, name);
+        }
     }
+    node_put(parent);
+    return rc;
+}
 
-    n = recv_str(fd, data, sizeof(path)-1, 0);
-    if (n <= 0) {
-        fprintf(stderr, "server_sendsegment: recv error\n");
-        return -1;
+int server_unlink(rpc_server_t* s, rpc_msg_t* req)
+{
+    uint64_t parentid = rpc_get_u64(req);
+    char* name = rpc_get_str(req);
+    int rc = unlink_one(s, parentid, name, 0);
+    free(name);
+    return rpc_reply(s, req, rc, NULL);
+}
+
+/* 'flags' are those of renameat2(), RENAME_NOREPLACE or RENAME_EXCHANGE */
+int server_rename(rpc_server_t* s, rpc_msg_t* req)
+{
+    node_t* parent = node_get(rpc_get_u64(req));
+    char* name = rpc_get_str(req);
+    node_t* newparent = node_get(rpc_get_u64(req));
+    char* newname = rpc_get_str(req);
+    unsigned int flags = rpc_get_u32(req);
+    int rc = -ESTALE;
+
+    if ((parent != NULL) && (newparent != NULL)
+        && (req->err || !node_name_ok(name) || !node_name_ok(newname))) {
+        rc = -EINVAL;
+    } else if ((parent != NULL) && (newparent != NULL)) {
+        if (flags == 0) {
+            rc = renameat(node_dirfd(parent), name, node_dirfd(newparent), newname);
+        } else {
+            rc = renameat2(node_dirfd(parent), name, node_dirfd(newparent), newname, flags);
+        }
+        rc = (rc == 0) ? 0 : -errno;
+        if (rc == 0) {
+            node_entry_changed(parent, name);
+            node_entry_changed(newparent, newname);
+            if (flags & RENAME_EXCHANGE) {
+                node_moved(parent, name);
+            }
+            node_moved(newparent, newname);
+            server_recall(s, parent, name);
+            server_recall(s, newparent, newname);
+        }
     }
+    node_put(parent);
+    node_put(newparent);
+    free(name);
+    free(newname);
+    return rpc_reply(s, req, rc, NULL);
+}
 
-    n = recv_str(fd, info, sizeof(info)-1, 0);
-    if (n <= 0) {
-        fprintf(stderr, "server_sendsegment: recv error\n");
-        return -1;
+/* Through the open file if the client names one, else by node */
+int server_truncate(rpc_server_t* s, rpc_msg_t* req)
+{
+    node_t* n = node_get(rpc_get_u64(req));
+    uint64_t fh = rpc_get_u64(req);
+    off64_t newsize = rpc_get_u64(req);
+    server_file_t* f = NULL;
+    int fd = -1;
+    int rc;
+
+    if ((n == NULL) || req->err) {
+        node_put(n);
+        return rpc_reply(s, req, (n == NULL) ? -ESTALE : -EINVAL, NULL);
+    }
+    if ((fh != 0) && ((f = file_get(server_ss(s), fh)) != NULL)) {
+        rc = (ftruncate(f->fd, newsize) == 0) ? 0 : -errno;
+        file_put(server_ss(s), f);
+    } else if ((fd = node_open(n, O_WRONLY)) >= 0) {
+        rc = (ftruncate(fd, newsize) == 0) ? 0 : -errno;
+        close(fd);
+    } else {
+        rc = -errno;
     }
-    size = atoll(info);
+    if (rc == 0) {
+        node_changed(n);
+        server_recall(s, n, NULL);
+    }
+    node_put(n);
 
-    n = recv_str(fd, info, sizeof(info)-1, 0);
-    if (n <= 0) {
-        fprintf(stderr, "server_sendsegment: recv error\n");
-        return -1;
+    return rpc_reply(s, req, rc, NULL);
+}
+
+/* The data follows on the UDT socket, written at the offset the client gives;
+ * the reply carries the byte count */
+int server_write(rpc_server_t* s, rpc_msg_t* req)
+{
+    server_file_t* f = file_get(server_ss(s), rpc_get_u64(req));
+    off64_t offset = rpc_get_u64(req);
+    rpc_msg_t* data = rpc_recv_data(s, req);
+    ssize_t done;
+
+    if ((f == NULL) || (data == NULL) || req->err) {
+        file_put(server_ss(s), f);
+        rpc_msg_free(data);
+        return rpc_reply(s, req, -1, NULL);
+    }
+    errno = 0;
+    done = fio_pwrite(f->fd, data->buf + RPC_HDR_LEN, data->len, offset);
+    int rc = (done == (ssize_t)data->len) ? (int)done : ((errno != 0) ? -errno : -EIO);
+    if (done > 0) {
+        node_changed(f->node);
+        server_recall(s, f->node, NULL);
     }
-    offset = atoll(info);
+    file_put(server_ss(s), f);
+    rpc_msg_free(data);
 
-    FILE* fp = fopen(path, "a");
-    fputs(data, fp);
-    fclose(fp);
+    return rpc_reply(s, req, rc, NULL);
+}
 
-    return 0;
+
+/* A segment starting within the window of where the last one ended continues
+ * the stream (the client's own readahead keeps several in flight, slightly out
+ * of order): the window doubles and the kernel is asked to read the next one
+ * into the page cache while this segment goes out. Anything else starts over. */
+static void file_readahead(server_file_t* f, off64_t offset, size_t len, off64_t size)
+{
+    off64_t end = offset + len;
+    off64_t start = 0, count = 0;
+    int seq;
+
+    pthread_mutex_lock(&f->ralock);
+    seq = (offset + f->rawin >= f->lastend) && (offset <= f->lastend + f->rawin);
+    if (seq) {
+        if (f->rawin < M_RA_MAX) { f->rawin *= 2; }
+        if (end > f->lastend) { f->lastend = end; }
+    } else {
+        f->rawin = M_RA_MIN;
+        f->lastend = end;
+        f->raend = end;
+    }
+    if (f->raend < end) { f->raend = end; }
+    if (seq && (f->raend - end < f->rawin / 2) && (f->raend < size)) {
+        start = f->raend;
+        count = ((size - start) > f->rawin) ? f->rawin : (size - start);
+        f->raend += count;
+    }
+    pthread_mutex_unlock(&f->ralock);
+
+    if (count > 0) {
+        posix_fadvise(f->fd, start, count, POSIX_FADV_WILLNEED);
+    }
 }
 
+/* Send [offset, offset+len) of 'fd' as the segment data. UDT reads the
+ * file straight into its send buffer, one M_SENDFILE_BLOCK per call so
+ * that a failed call sent nothing. What the file lost meanwhile, or failed
+ * to read, goes out as zeros so the stream stays framed; a read error
+ * makes the result -1, a file that shrank does not. */
+static int send_file_data(rpc_server_t* s, int fd, off64_t offset, size_t len)
+{
+    static const char zeros[64*1024] = { 0 };
+    size_t sent = 0;
+    int rc = 0;
+
+    while (sent < len) {
+        size_t n = ((len - sent) > M_SENDFILE_BLOCK) ? M_SENDFILE_BLOCK : (len - sent);
+        int64_t got = UDT::sendfile(s->ufd, fd, offset + sent, n, n);
+        if (got < 0) {
+            if (UDT::getlasterror().getErrorCode() != CUDTException::ERDPERM) { return -1; }
+            rc = -1;
+            break;
+        }
+        sent += got;
+        if ((size_t)got < n) { break; }
+    }
+    while (sent < len) {
+        size_t n = ((len - sent) > sizeof(zeros)) ? sizeof(zeros) : (len - sent);
+        if (rpc_send_data(s, zeros, n) != 0) { return -1; }
+        sent += n;
+    }
+    return rc;
+}
 
-int server_sendsegment(int fd, UDTSOCKET ufd)
+int server_sendsegment(rpc_server_t* s, rpc_msg_t* req)
 {
-    char info[M_MAX_VAL];
-    char filename[M_MAX_VAL];
+    struct stat st;
     off64_t offset;
-    size_t len, n;
+    size_t len;
+    server_file_t* f = file_get(server_ss(s), rpc_get_u64(req));
+    int rc;
+    offset = rpc_get_u64(req);
+    len = rpc_get_u64(req);
+    if ((f == NULL) || req->err || (fstat(f->fd, &st) != 0)) {
+        file_put(server_ss(s), f);
+        return rpc_reply(s, req, -1, NULL);
+    }
 
-    /* Receive the request */
-    n = recv_str(fd, filename, sizeof(filename)-1, 0);
-    if (n <= 0) {
-        fprintf(stderr, "server_sendsegment: recv error\n");
-        return -1;
+    /* Only what exists is sent, the reply carries the byte count */
+    if (offset >= st.st_size) {
+        len = 0;
+    } else if ((off64_t)len > (st.st_size - offset)) {
+        len = st.st_size - offset;
     }
-    n = recv_str(fd, info, sizeof(info)-1, 0);
-    if (n <= 0) {
-        fprintf(stderr, "server_sendsegment: recv error\n");
-        return -1;
+    if (len == 0) {
+        file_put(server_ss(s), f);
+        return rpc_reply(s, req, 0, NULL);
     }
-    offset = atoll(info);
-    n = recv_str(fd, info, sizeof(info)-1, 0);
-    if (n <= 0) {
-        fprintf(stderr, "server_sendsegment: recv error\n");
-        return -1;
+    file_readahead(f, offset, len, st.st_size);
+
+    /* UDT send the data, one segment at a time on the data socket */
+    pthread_mutex_lock(&s->udtlock);
+    if (rpc_send_datahdr(s, req, len) != 0) {
+        pthread_mutex_unlock(&s->udtlock);
+        file_put(server_ss(s), f);
+        return rpc_reply(s, req, -1, NULL);
     }
-    len = atol(info);
+    rc = send_file_data(s, f->fd, offset, len);
+    pthread_mutex_unlock(&s->udtlock);
+    file_put(server_ss(s), f);
 
-    /* Open the file */ 
-    FILE* file = fopen(filename, "rb");
+    return rpc_reply(s, req, (rc == 0) ? (int)len : -1, NULL);
+}
 
-    /* UDT send the data */
-    UDT::TRACEINFO trace;
-    UDT::perfmon(ufd, &trace);
-    off64_t sent = UDT::sendfile(ufd, file, offset, len);
-    
-    fclose(file);
-    if (sent < 0) {
-        return -1;
-    }
+/* Returns the number of bytes read into 'buf', -1 on error */
+int client_reqsegment(rpc_client_t* c, uint64_t fh, off64_t offset, size_t len, char* buf)
+{
+    rpc_msg_t* req = rpc_msg_new(RPC_OP_READ);
+    rpc_msg_t* reply;
+    int rc;
+    rpc_put_u64(req, fh);
+    rpc_put_u64(req, offset);
+    rpc_put_u64(req, len);
+    reply = rpc_call(c, req, buf, len);
+    rpc_msg_free(req);
+    rc = ((reply != NULL) && (reply->status >= 0)) ? reply->status : -1;
+    rpc_msg_free(reply);
+    return rc;
+}
 
-    /* UDT send garbage in plae of data that was requested beyond the EOF */
-    if (sent < len) {
-        fprintf(stderr, "server_sendsegment: UDT short send, %Lu vs %Lu!\n", (ull_t)sent, (ull_t)len);
-        std::fstream fzeros("/dev/zero", std::fstream::in |std::fstream::binary);
-        UDT::sendfile(ufd, fzeros, 0, len-sent);
-        fzeros.close();
+/* Send a request whose reply is a bare status */
+/* 0 or -errno, -EIO if the connection is lost */
+static int client_reqstatus(rpc_client_t* c, rpc_msg_t* req)
+{
+    rpc_msg_t* reply = rpc_call(c, req, NULL, 0);
+    int rc = (reply != NULL) ? reply->status : -EIO;
+    rpc_msg_free(req);
+    rpc_msg_free(reply);
+    return rc;
+}
+
+int client_reqtruncate(rpc_client_t* c, uint64_t nodeid, uint64_t fh, off64_t newsize)
+{
+    rpc_msg_t* req = rpc_msg_new(RPC_OP_TRUNCATE);
+    rpc_put_u64(req, nodeid);
+    rpc_put_u64(req, fh);
+    rpc_put_u64(req, newsize);
+    return client_reqstatus(c, req);
+}
+
+/* Returns the number of bytes written, -errno on error */
+int client_reqwrite (rpc_client_t* c, uint64_t fh, const char *data, size_t size,
+                                                                             off_t offset)
+{
+    rpc_msg_t* req = rpc_msg_new(RPC_OP_WRITE);
+    rpc_msg_t* reply;
+    int rc;
+    rpc_put_u64(req, fh);
+    rpc_put_u64(req, offset);
+    reply = rpc_call_send(c, req, data, size);
+    rpc_msg_free(req);
+    rc = (reply != NULL) ? reply->status : -EIO;
+    rpc_msg_free(reply);
+    return rc;
+}
+
+
+int client_reqrename (rpc_client_t* c, uint64_t parent, const char* name,
+                      uint64_t newparent, const char* newname, unsigned int flags)
+{
+    rpc_msg_t* req = rpc_msg_new(RPC_OP_RENAME);
+    rpc_put_u64(req, parent);
+    rpc_put_str(req, name);
+    rpc_put_u64(req, newparent);
+    rpc_put_str(req, newname);
+    rpc_put_u32(req, flags);
+    return client_reqstatus(c, req);
+}
+
+int client_requnlink (rpc_client_t* c, uint64_t parent, const char* name)
+{
+    rpc_msg_t* req = rpc_msg_new(RPC_OP_UNLINK);
+    rpc_put_u64(req, parent);
+    rpc_put_str(req, name);
+    return client_reqstatus(c, req);
+}
+
+int client_requtime (rpc_client_t* c, uint64_t nodeid, const struct timespec times[2])
+{
+    rpc_msg_t* req = rpc_msg_new(RPC_OP_UTIME);
+    int i;
+    rpc_put_u64(req, nodeid);
+    for (i = 0; i < 2; i++) {
+        rpc_put_u64(req, (uint64_t)(int64_t)times[i].tv_sec);
+        rpc_put_u32(req, (uint32_t)times[i].tv_nsec);
     }
-    UDT::perfmon(ufd, &trace);
+    return client_reqstatus(c, req);
+}
 
-    return 0;
+//////////////////////////////////////////////////////////////////////
+// BATCHED METADATA -- many independent stats, unlinks or creates in one
+// request; the reply has a status (0 or -errno) per entry, in order
+//////////////////////////////////////////////////////////////////////
+
+/* Make a directory, regular file or FIFO and look it up like LOOKUP does;
+ * returns 0 with the new node's id and attributes, or -errno */
+static int create_one(rpc_server_t* s, uint64_t parentid, const char* name, mode_t mode,
+                      uint64_t* id, struct stat* st)
+{
+    node_t* parent = node_get(parentid);
+    node_t* n = NULL;
+    uint64_t changes;
+    int rc;
+
+    if (parent == NULL) {
+        rc = -ESTALE;
+    } else if (!node_name_ok(name)) {
+        rc = -EINVAL;
+    } else if (S_ISDIR(mode)) {
+        rc = (mkdirat(node_dirfd(parent), name, mode & 07777) == 0) ? 0 : -errno;
+    } else if (S_ISREG(mode) || S_ISFIFO(mode)) {
+        rc = (mknodat(node_dirfd(parent), name, mode, 0) == 0) ? 0 : -errno;
+    } else {
+        rc = -EPERM;
+    }
+    if (rc == 0) {
+        node_entry_changed(parent, name);
+        node_changed(parent);
+        server_recall(s, parent, name);
+        changes = node_changes();
+        node_lease(parent, server_session(s), RPC_LEASE_TIME);
+        n = node_lookup(server_refs(s), parent, name, st);
+        if (n != NULL) {
+            server_lease_found(s, n, st, changes);
+            *id = n->id;
+        } else {
+            rc = -ENOENT;
+        }
+    }
+    node_put(parent);
+    return rc;
 }
 
-int client_reqsegment(int fd, UDTSOCKET ufd, const char* filename, off64_t offset, size_t len)
+/* The entries of one *_MANY request, handed out to the worker pool
+ * M_BATCH_SPLIT at a time so that a large batch does not run serially */
+typedef struct batch_work_tt {
+    rpc_server_t*  s;
+    uint16_t       op;
+    client_meta_t* e;
+    int            count;
+} batch_work_t;
+
+static void batch_piece(void* arg, int piece)
 {
-    char info[M_MAX_VAL];
-    ssize_t n;
-    n = send(fd, filename, strlen(filename)+1, 0);
-    snprintf(info, M_MAX_VAL, "%Lu", (unsigned long long)offset);
-    n = send(fd, info, strlen(info)+1, 0);
-    snprintf(info, M_MAX_VAL, "%Lu", (unsigned long long)len);
-    n = send(fd, info, strlen(info)+1, 0);
-    return 0;
+    batch_work_t* w = (batch_work_t*)arg;
+    int i = piece * M_BATCH_SPLIT;
+    int end = ((i + M_BATCH_SPLIT) < w->count) ? (i + M_BATCH_SPLIT) : w->count;
+    node_t* n;
+
+    for (; i < end; i++) {
+        client_meta_t* m = &w->e[i];
+        if (w->op == RPC_OP_GETATTR_MANY) {
+            m->rc = -ESTALE;
+            if ((n = node_get(m->node)) != NULL) {
+                m->rc = (server_stat_leased(w->s, n, &m->st) == 0) ? 0 : -ENOENT;
+                node_put(n);
+            }
+        } else if (w->op == RPC_OP_UNLINK_MANY) {
+            m->rc = unlink_one(w->s, m->node, m->name, m->arg);
+        } else {
+            m->rc = create_one(w->s, m->node, m->name, m->arg, &m->nodeid, &m->st);
+        }
+    }
 }
 
-int client_recvsegment(int fd, UDTSOCKET ufd, size_t len, char* buf)
+/* Parse all entries, run them, reply with the results in order */
+static int server_many(rpc_server_t* s, rpc_msg_t* req)
 {
-    ssize_t n;
-    size_t remain = len;
-    while (remain > 0) {
-        n = UDT::recv(ufd, buf, remain, 0);
-        if (UDT::ERROR == n) {
-            fprintf(stderr, "client_recvsegment: UDT::recv error\n");
-            return -1;
+    uint32_t i, count = rpc_get_u32(req);
+    batch_work_t w;
+    rpc_msg_t* reply;
+
+    if (req->err || (count > RPC_MAX_BATCH)) {
+        return rpc_reply(s, req, -EINVAL, NULL);
+    }
+    if ((w.e = (client_meta_t*)calloc(count + 1, sizeof(client_meta_t))) == NULL) {
+        return rpc_reply(s, req, -ENOMEM, NULL);
+    }
+    w.s = s;
+    w.op = req->op;
+    w.count = count;
+    for (i = 0; (i < count) && !req->err; i++) {
+        w.e[i].node = rpc_get_u64(req);
+        if (req->op != RPC_OP_GETATTR_MANY) {
+            w.e[i].name = rpc_get_str(req);
+            w.e[i].arg = rpc_get_u32(req);
+        }
+    }
+    if (!req->err) {
+        rpc_server_parallel(batch_piece, &w, (count + M_BATCH_SPLIT - 1) / M_BATCH_SPLIT);
+        reply = rpc_msg_new(req->op);
+        for (i = 0; i < count; i++) {
+            rpc_put_u32(reply, (uint32_t)w.e[i].rc);
+            if ((w.e[i].rc == 0) && (req->op == RPC_OP_CREATE_MANY)) { rpc_put_u64(reply, w.e[i].nodeid); }
+            if ((w.e[i].rc == 0) && (req->op != RPC_OP_UNLINK_MANY)) { rpc_put_stat(reply, &w.e[i].st); }
         }
-        remain -= n;
-        buf += n;
+        rpc_reply(s, req, 0, reply);
+        rpc_msg_free(reply);
+    } else {
+        rpc_reply(s, req, -EINVAL, NULL);
+    }
+    for (i = 0; i < count; i++) {
+        free((char*)w.e[i].name);
     }
+    free(w.e);
     return 0;
 }
 
-int client_reqtruncate(int fd, UDTSOCKET ufd, const char* filename, off64_t newsize)
+/* Node ids; each entry of the reply is the status and, if 0, the attributes */
+int server_attr_many(rpc_server_t* s, rpc_msg_t* req)
 {
-    char info[M_MAX_VAL];
-    ssize_t n;
-    n = send(fd, filename, strlen(filename)+1, 0);
-    snprintf(info, M_MAX_VAL, "%Lu", (unsigned long long)newsize);
-    n = send(fd, info, strlen(info)+1, 0);
-    return 0;
+    return server_many(s, req);
 }
 
-int client_reqwrite (int fd, UDTSOCKET ufd, const char* filename, const char *data, size_t size,
-                                                                             off_t offset)
+/* (parent, name, unlinkat() flags); each entry of the reply is the status */
+int server_unlink_many(rpc_server_t* s, rpc_msg_t* req)
 {
-    char info[M_MAX_VAL];
-    ssize_t n;
-    n = send(fd, filename, strlen(filename)+1, 0);
-    n = send(fd, data, strlen(data)+1, 0);
-    snprintf(info, M_MAX_VAL, "%Lu", (unsigned long long)size);
-    n = send(fd, info, strlen(info)+1, 0);
-    snprintf(info, M_MAX_VAL, "%Lu", (unsigned long long)offset);
-    n = send(fd, info, strlen(info)+1, 0);
-    return 0;
+    return server_many(s, req);
 }
 
+/* (parent, name, mode); each entry of the reply is the status and, if 0,
+ * the new node id and attributes */
+int server_create_many(rpc_server_t* s, rpc_msg_t* req)
+{
+    return server_many(s, req);
+}
 
-int client_reqrename (int fd, UDTSOCKET ufd,const char* path, const char* newpath)
+/* Sends 'ops' as one request of 'op' and returns the reply to parse;
+ * a lost connection or a rejected request fails every entry */
+static rpc_msg_t* client_reqmany(rpc_client_t* c, uint16_t op, client_meta_t** ops, int n)
 {
-    ssize_t n;
-    n = send(fd, path, strlen(path)+1, 0);
-    n = send(fd, newpath, strlen(newpath)+1, 0);
+    rpc_msg_t* req = rpc_msg_new(op);
+    rpc_msg_t* reply;
+    int i;
+
+    rpc_put_u32(req, n);
+    for (i = 0; i < n; i++) {
+        rpc_put_u64(req, ops[i]->node);
+        if (op != RPC_OP_GETATTR_MANY) {
+            rpc_put_str(req, ops[i]->name);
+            rpc_put_u32(req, ops[i]->arg);
+        }
+    }
+    reply = rpc_call(c, req, NULL, 0);
+    rpc_msg_free(req);
+    if ((reply == NULL) || (reply->status != 0)) {
+        for (i = 0; i < n; i++) {
+            ops[i]->rc = (reply != NULL) ? reply->status : -EIO;
+        }
+        rpc_msg_free(reply);
+        return NULL;
+    }
+    return reply;
+}
+
+/* The status of the next entry, -EIO past the end of the reply */
+static int client_getmany(rpc_msg_t* reply)
+{
+    int rc = (int32_t)rpc_get_u32(reply);
+    return reply->err ? -EIO : rc;
+}
+
+int client_reqattr_many(rpc_client_t* c, client_meta_t** ops, int n)
+{
+    rpc_msg_t* reply = client_reqmany(c, RPC_OP_GETATTR_MANY, ops, n);
+    int i;
+    if (reply == NULL) { return -1; }
+    for (i = 0; i < n; i++) {
+        ops[i]->rc = client_getmany(reply);
+        if (ops[i]->rc == 0) {
+            rpc_get_stat(reply, &ops[i]->st);
+            if (reply->err) { ops[i]->rc = -EIO; }
+        }
+    }
+    rpc_msg_free(reply);
     return 0;
 }
 
-int client_requnlink (int fd, UDTSOCKET ufd,const char* path)
+int client_requnlink_many(rpc_client_t* c, client_meta_t** ops, int n)
 {
-    ssize_t n;
-    n = send(fd, path, strlen(path)+1, 0);
+    rpc_msg_t* reply = client_reqmany(c, RPC_OP_UNLINK_MANY, ops, n);
+    int i;
+    if (reply == NULL) { return -1; }
+    for (i = 0; i < n; i++) {
+        ops[i]->rc = client_getmany(reply);
+    }
+    rpc_msg_free(reply);
     return 0;
 }
 
-int client_requtime (int fd, UDTSOCKET ufd,const char* path)
+int client_reqcreate_many(rpc_client_t* c, client_meta_t** ops, int n)
 {
-    ssize_t n;
-    n = send(fd, path, strlen(path)+1, 0);
+    rpc_msg_t* reply = client_reqmany(c, RPC_OP_CREATE_MANY, ops, n);
+    int i;
+    if (reply == NULL) { return -1; }
+    for (i = 0; i < n; i++) {
+        ops[i]->rc = client_getmany(reply);
+        if (ops[i]->rc == 0) {
+            ops[i]->nodeid = rpc_get_u64(reply);
+            rpc_get_stat(reply, &ops[i]->st);
+            if (reply->err) { ops[i]->rc = -EIO; }
+        }
+    }
+    rpc_msg_free(reply);
     return 0;
-}
\ No newline at end of file
+}
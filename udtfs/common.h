@@ -36,61 +36,153 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include <udt.h> // C++
 
-#define M_VERSION "UDTFS V1.0 - A file system based on FUSE and UDTv4"
+#define M_VERSION "UDTFS V1.11 - A file system based on FUSE and UDTv4"
 #define M_COPYRIGHT "(C) 2009 Jan Wagner, Metsahovi Radio Observatory, Aalto"
 #define M_LICENSE "Licensed under GNU GPL v3"
 
 #define M_PORT "1432"
-#define M_PORT_UDTBASE 9000
+#define M_PORT_UDT 9000
 #define M_MTU_UDT 1500 // 9000
 #define M_UDT_RATE 1000 // Mbps
 
 #define M_BACKLOG 10
-#define M_MAX_CLIENTS 16
+#define M_BACKLOG_UDT 64
+#define M_UDT_RCVWORKERS 4  // threads receiving on the shared UDT port, clients spread over them
+#define M_UDT_TOKEN_MS 10000 // how long a new control connection waits for its data connection
+#define M_MAX_SESSION_CONNS 8
+#define M_FILE_BUCKETS 256
+#define M_RA_MIN (1024*1024)       // server readahead window of a new stream
+#define M_RA_MAX (32*1024*1024)
+#define M_BATCH_SPLIT 8           // entries of a *_MANY request per worker
+#define M_SENDFILE_BLOCK (1024*1024) // segment data per UDT::sendfile() call
 #define M_MAX_PATH 512
 #define M_MAX_FILE 128
 #define M_MAX_VAL  128
 
-#define RESERVED_STR_TERM "--TERM--"
+struct rpc_msg_tt;
+struct rpc_client_tt;
+struct rpc_server_tt;
+struct node_refs_tt;
+struct node_tt;
+
+/* A file a client opened: READ, WRITE and TRUNCATE name the handle, so the
+ * file is not looked up and opened again and stays readable if renamed */
+typedef struct server_file_tt {
+    uint64_t id;
+    int      fd;
+    struct node_tt* node;       // pinned while open
+    int      refs;              // the table and the requests using it
+    pthread_mutex_t ralock;     // guards the readahead stream below
+    off64_t  lastend;           // end of the latest segment read
+    off64_t  raend;             // readahead asked for up to here
+    off64_t  rawin;             // readahead window, grows while reads are sequential
+    struct server_file_tt* next;
+} server_file_t;
+
+/* All connections of one client mount share a session on the server */
+typedef struct server_session_tt {
+    uint64_t id;
+    int      nconns;
+    int      pins;              // callbacks on their way out
+    struct node_refs_tt* refs;
+    pthread_mutex_t lock;       // guards 'conns' and 'pushing'
+    pthread_cond_t  pushcond;   // the callbacks in flight are sent
+    int      pushing;           // callbacks being sent outside 'lock'
+    struct rpc_server_tt* conns[M_MAX_SESSION_CONNS];
+    pthread_mutex_t filelock;   // guards 'files'
+    server_file_t* files[M_FILE_BUCKETS];
+    uint64_t nextfile;
+    struct server_session_tt* next;
+} server_session_t;
 
 int recv_str(int fd, char* buf, int maxlen, int flags);
-int send_cmd(int fd, const char* str);
 
 int server_open_socket();
 int client_open_socket(char* hostname);
 void close_socket(int fd);
 
-UDTSOCKET server_accept_udt(int tcp_fd, const int udtport);
+/* One UDT listener takes the data connections of all clients */
+int server_listen_udt(const int port);
+/* Wait for the data connection belonging to control connection 'tcp_fd' */
+UDTSOCKET server_accept_udt(int tcp_fd);
 UDTSOCKET client_connect_udt(int tcp_fd);
 
 int exchange_versions(int fd);
-
-int client_reqdir(int fd, const char* pathname);
-int server_senddir(int fd);
-char* client_recvdirentry(int fd);
-
-int client_reqattr(int fd, const char *path, struct stat *stbuf);
-int server_sendattr(int fd);
-
-int server_sendsegment(int fd, UDTSOCKET ufd);
-int client_reqsegment(int fd, UDTSOCKET ufd, const char* filename, off64_t offset, size_t len);
-int client_recvsegment(int fd, UDTSOCKET ufd, size_t len, char* buf);
-
-int server_truncate(int fd, UDTSOCKET ufd);
-int server_write(int fd, UDTSOCKET ufd);
-int client_reqtruncate(int fd, UDTSOCKET ufd, const char* filename, off64_t newsize);
-int client_reqwrite (int fd, UDTSOCKET ufd, const char* filename, const char *data, size_t size,
+int send_session(int fd, uint64_t session);
+int recv_session(int fd, uint64_t* session);
+int client_open_connection(char* hostname, uint64_t* session, int* fd, UDTSOCKET* ufd);
+
+/* Join session 'id', 0 creates a new one; NULL if the session is gone.
+ * The last session_leave() drops everything the client still held. */
+server_session_t* session_join(uint64_t id);
+void session_leave(server_session_t* ss);
+/* Callbacks for the session go out over its attached connections */
+void session_attach(server_session_t* ss, struct rpc_server_tt* s);
+void session_detach(server_session_t* ss, struct rpc_server_tt* s);
+
+int client_reqlookup(struct rpc_client_tt* c, uint64_t parent, const char* name, uint64_t* nodeid, struct stat* stbuf);
+int server_lookup(struct rpc_server_tt* s, struct rpc_msg_tt* req);
+int client_reqforget(struct rpc_client_tt* c, const uint64_t* nodeids, const uint64_t* nlookups, int n);
+int server_forget(struct rpc_server_tt* s, struct rpc_msg_tt* req);
+
+struct rpc_msg_tt* client_reqdirplus(struct rpc_client_tt* c, uint64_t nodeid);
+int server_senddirplus(struct rpc_server_tt* s, struct rpc_msg_tt* req);
+
+int client_reqattr(struct rpc_client_tt* c, uint64_t nodeid, struct stat *stbuf);
+int server_sendattr(struct rpc_server_tt* s, struct rpc_msg_tt* req);
+
+/* One entry of a batched metadata request: the node for GETATTR_MANY, the
+ * parent, name and unlinkat() flags or mode for UNLINK_MANY and CREATE_MANY.
+ * 'rc' gets 0 or -errno, a create also 'nodeid'; 'st' the attributes. The
+ * server keeps the entries it runs the same way. */
+typedef struct client_meta_tt {
+    uint64_t    node;
+    const char* name;
+    uint32_t    arg;
+    int         rc;
+    uint64_t    nodeid;
+    struct stat st;
+} client_meta_t;
+
+int server_attr_many(struct rpc_server_tt* s, struct rpc_msg_tt* req);
+int server_unlink_many(struct rpc_server_tt* s, struct rpc_msg_tt* req);
+int server_create_many(struct rpc_server_tt* s, struct rpc_msg_tt* req);
+/* Returns 0 with the entries' results filled in, -1 if the request failed
+ * as a whole (each 'rc' then says why) */
+int client_reqattr_many(struct rpc_client_tt* c, client_meta_t** ops, int n);
+int client_requnlink_many(struct rpc_client_tt* c, client_meta_t** ops, int n);
+int client_reqcreate_many(struct rpc_client_tt* c, client_meta_t** ops, int n);
+
+int server_open(struct rpc_server_tt* s, struct rpc_msg_tt* req);
+int server_release(struct rpc_server_tt* s, struct rpc_msg_tt* req);
+int client_reqopen(struct rpc_client_tt* c, uint64_t nodeid, int flags, uint64_t* fh, struct stat* stbuf);
+int client_reqrelease(struct rpc_client_tt* c, uint64_t fh);
+
+int server_sendsegment(struct rpc_server_tt* s, struct rpc_msg_tt* req);
+int client_reqsegment(struct rpc_client_tt* c, uint64_t fh, off64_t offset, size_t len, char* buf);
+
+int server_truncate(struct rpc_server_tt* s, struct rpc_msg_tt* req);
+int server_write(struct rpc_server_tt* s, struct rpc_msg_tt* req);
+/* 'fh' 0 truncates the node without an open handle */
+/* These return 0 or -errno */
+int client_reqtruncate(struct rpc_client_tt* c, uint64_t nodeid, uint64_t fh, off64_t newsize);
+int client_reqwrite (struct rpc_client_tt* c, uint64_t fh, const char *data, size_t size,
                                                                              off_t offset);
-int server_rename(int fd, UDTSOCKET ufd);
-int client_reqrename (int fd, UDTSOCKET ufd, const char* path, const char* newpath);     
+int server_rename(struct rpc_server_tt* s, struct rpc_msg_tt* req);
+/* 'flags' as for renameat2() */
+int client_reqrename (struct rpc_client_tt* c, uint64_t parent, const char* name,
+                      uint64_t newparent, const char* newname, unsigned int flags);
 
-int server_unlink(int fd, UDTSOCKET ufd);
-int client_requnlink(int fd, UDTSOCKET ufd, const char* path);
+int server_unlink(struct rpc_server_tt* s, struct rpc_msg_tt* req);
+int client_requnlink(struct rpc_client_tt* c, uint64_t parent, const char* name);
 
-int server_utime(int fd, UDTSOCKET ufd);
-int client_requtime (int fd, UDTSOCKET ufd,const char* path);
+int server_utime(struct rpc_server_tt* s, struct rpc_msg_tt* req);
+/* Access and modification time as for utimensat(), UTIME_NOW and UTIME_OMIT included */
+int client_requtime (struct rpc_client_tt* c, uint64_t nodeid, const struct timespec times[2]);
 
 #endif // COMMON_H
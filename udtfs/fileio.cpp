@@ -0,0 +1,246 @@
+/*
+* Server file I/O through io_uring
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "fileio.h"
+
+typedef struct fio_op_tt {
+    int      fd;
+    char*    data;
+    size_t   len;
+    off64_t  offset;
+    ssize_t  res;                   // byte count or -errno, once done
+    volatile int done;
+} fio_op_t;
+
+static int _ringfd = -1;
+static unsigned* _sqtail;
+static unsigned* _sqmask;
+static unsigned* _sqarray;
+static unsigned _sqentries;
+static struct io_uring_sqe* _sqes;
+static unsigned* _cqhead;
+static unsigned* _cqtail;
+static unsigned* _cqmask;
+static struct io_uring_cqe* _cqes;
+static pthread_t _reaper;
+
+static pthread_mutex_t _fiolock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _fiocond = PTHREAD_COND_INITIALIZER;    // completions, free slots
+static unsigned _inflight = 0;
+
+static int ring_enter(unsigned submit, unsigned wait, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, _ringfd, submit, wait, flags, NULL, 0);
+}
+
+/* Takes the completions and wakes their waiters. If waiting fails the
+ * completions still arrive in the ring; it is then looked at every
+ * millisecond rather than left to the writes in flight to hang. */
+static void* reaper_thread(void* arg)
+{
+    int failing = 0;
+
+    while (1) {
+        if ((ring_enter(0, 1, IORING_ENTER_GETEVENTS) < 0) && (errno != EINTR)) {
+            if (!failing) { perror("fio: io_uring_enter"); }
+            failing = 1;
+            usleep(1000);
+        } else {
+            failing = 0;
+        }
+        pthread_mutex_lock(&_fiolock);
+        unsigned head = *_cqhead;
+        while (head != __atomic_load_n(_cqtail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &_cqes[head & *_cqmask];
+            fio_op_t* op = (fio_op_t*)(uintptr_t)cqe->user_data;
+            op->res = cqe->res;
+            op->done = 1;
+            _inflight--;
+            head++;
+        }
+        __atomic_store_n(_cqhead, head, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&_fiocond);
+        pthread_mutex_unlock(&_fiolock);
+    }
+    return NULL;
+}
+
+/* The operation without a ring, in the calling thread */
+static void sync_op(fio_op_t* op)
+{
+    ssize_t n = pwrite(op->fd, op->data, op->len, op->offset);
+    op->res = (n < 0) ? -errno : n;
+    op->done = 1;
+}
+
+static void submit(fio_op_t* op)
+{
+    struct io_uring_sqe* sqe;
+    unsigned tail;
+    int rc;
+
+    op->done = 0;
+    if (_ringfd < 0) {
+        sync_op(op);
+        return;
+    }
+    pthread_mutex_lock(&_fiolock);
+    /* The completion ring is twice the size, it cannot overflow */
+    while (_inflight >= _sqentries) {
+        pthread_cond_wait(&_fiocond, &_fiolock);
+    }
+    tail = *_sqtail;
+    sqe = &_sqes[tail & *_sqmask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = op->fd;
+    sqe->addr = (uint64_t)(uintptr_t)op->data;
+    sqe->len = op->len;
+    sqe->off = op->offset;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+    _sqarray[tail & *_sqmask] = tail & *_sqmask;
+    __atomic_store_n(_sqtail, tail + 1, __ATOMIC_RELEASE);
+    _inflight++;
+    while (((rc = ring_enter(1, 0, 0)) < 0) && ((errno == EINTR) || (errno == EAGAIN) || (errno == EBUSY))) { }
+    if (rc <= 0) {
+        /* The kernel did not take it: withdraw the entry, write in this thread */
+        perror("fio: io_uring_enter, writing with pwrite");
+        __atomic_store_n(_sqtail, tail, __ATOMIC_RELEASE);
+        _inflight--;
+        pthread_cond_broadcast(&_fiocond);
+        pthread_mutex_unlock(&_fiolock);
+        sync_op(op);
+        return;
+    }
+    pthread_mutex_unlock(&_fiolock);
+}
+
+//////////////////////////////////////////////////////////////////////
+// SETUP
+//////////////////////////////////////////////////////////////////////
+
+static int ring_setup()
+{
+    struct io_uring_params p;
+    size_t sqsize, cqsize;
+    char* sq;
+    char* cq;
+
+    memset(&p, 0, sizeof(p));
+    _ringfd = (int)syscall(__NR_io_uring_setup, FIO_ENTRIES, &p);
+    if (_ringfd < 0) { return -1; }
+
+    sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cqsize > sqsize) { sqsize = cqsize; }
+        cqsize = sqsize;
+    }
+    sq = (char*)mmap(NULL, sqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringfd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) { goto fail; }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+    } else {
+        cq = (char*)mmap(NULL, cqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringfd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) { goto fail; }
+    }
+    _sqes = (struct io_uring_sqe*)mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_POPULATE, _ringfd, IORING_OFF_SQES);
+    if (_sqes == MAP_FAILED) { goto fail; }
+
+    _sqtail = (unsigned*)(sq + p.sq_off.tail);
+    _sqmask = (unsigned*)(sq + p.sq_off.ring_mask);
+    _sqarray = (unsigned*)(sq + p.sq_off.array);
+    _sqentries = p.sq_entries;
+    _cqhead = (unsigned*)(cq + p.cq_off.head);
+    _cqtail = (unsigned*)(cq + p.cq_off.tail);
+    _cqmask = (unsigned*)(cq + p.cq_off.ring_mask);
+    _cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+
+fail:
+    /* The mappings go with the process, nothing else uses them */
+    close(_ringfd);
+    _ringfd = -1;
+    return -1;
+}
+
+int fio_init()
+{
+    if (ring_setup() != 0) {
+        perror("fio_init: io_uring_setup, using pwrite");
+        return 0;
+    }
+    if (pthread_create(&_reaper, NULL, reaper_thread, NULL) != 0) {
+        perror("fio_init: reaper thread, using pwrite");
+        close(_ringfd);
+        _ringfd = -1;
+        return 0;
+    }
+    fprintf(stderr, "File writes through io_uring, %u entries\n", _sqentries);
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// ACCESS
+//////////////////////////////////////////////////////////////////////
+
+static ssize_t fio_wait(fio_op_t* op)
+{
+    if (!op->done) {
+        pthread_mutex_lock(&_fiolock);
+        while (!op->done) {
+            pthread_cond_wait(&_fiocond, &_fiolock);
+        }
+        pthread_mutex_unlock(&_fiolock);
+    }
+    return op->res;
+}
+
+ssize_t fio_pwrite(int fd, const char* data, size_t len, off64_t offset)
+{
+    fio_op_t* ops;
+    size_t nops = (len + FIO_PIECE_SIZE - 1) / FIO_PIECE_SIZE;
+    size_t i, done = 0;
+    int err = 0;
+
+    if (len == 0) { return 0; }
+    if ((ops = (fio_op_t*)calloc(nops, sizeof(fio_op_t))) == NULL) { return -1; }
+    for (i = 0; i < nops; i++) {
+        ops[i].fd = fd;
+        ops[i].data = (char*)data + i * FIO_PIECE_SIZE;
+        ops[i].len = ((len - i * FIO_PIECE_SIZE) > FIO_PIECE_SIZE) ? FIO_PIECE_SIZE : (len - i * FIO_PIECE_SIZE);
+        ops[i].offset = offset + i * FIO_PIECE_SIZE;
+        submit(&ops[i]);
+    }
+    for (i = 0; i < nops; i++) {
+        ssize_t n = fio_wait(&ops[i]);
+        /* Finish a short piece in place */
+        while ((n >= 0) && ((size_t)n < ops[i].len)) {
+            ssize_t wr = pwrite(fd, ops[i].data + n, ops[i].len - n, ops[i].offset + n);
+            if ((wr < 0) && (errno == EINTR)) { continue; }
+            if (wr <= 0) {
+                n = (wr < 0) ? -errno : -EIO;
+                break;
+            }
+            n += wr;
+        }
+        /* Only the data up to the first failed piece counts */
+        if ((n < 0) && (err == 0)) { err = (int)-n; }
+        else if (err == 0) { done += n; }
+    }
+    free(ops);
+    if (err != 0) { errno = err; }
+    return ((err != 0) && (done == 0)) ? -1 : (ssize_t)done;
+}
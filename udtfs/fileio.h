@@ -0,0 +1,27 @@
+/*
+* Server file I/O through io_uring
+*
+* Writes of file data go to one ring shared by all workers, so a large write
+* is split into pieces that all reach the device at once and many clients'
+* writes are in flight together. Reads do not come through here: UDT reads
+* the file straight into its send buffer. Without io_uring (old kernel,
+* seccomp) the writes fall back to pwrite() in the calling thread.
+*/
+#ifndef FILEIO_H
+#define FILEIO_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define FIO_ENTRIES 256             // ring size, also the most operations in flight
+#define FIO_PIECE_SIZE (1024*1024)
+
+/* Set up the ring; returns 1 with io_uring, 0 without */
+int  fio_init();
+
+/* Write all of 'data' at 'offset', in pieces all in flight together.
+ * Returns the byte count up to the first piece that failed, with errno
+ * set when that is short; -1 and errno if nothing was written. */
+ssize_t fio_pwrite(int fd, const char* data, size_t len, off64_t offset);
+
+#endif // FILEIO_H
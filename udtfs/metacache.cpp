@@ -0,0 +1,485 @@
+/*
+* Server-side cache of stat results and directory listings
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/inotify.h>
+
+#include "metacache.h"
+
+#define MC_WATCH_MASK (IN_ATTRIB | IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+                       | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+#define MC_ENTRY_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+/* Attributes are keyed (directory, name), the listing of a directory (directory, "") */
+typedef struct mc_entry_tt {
+    uint64_t dir;
+    char*    name;
+    int      listing;
+    double   expires;
+    struct stat st;
+    char*    names;
+    size_t   len;
+    struct mc_entry_tt* next;
+} mc_entry_t;
+
+typedef struct mc_shard_tt {
+    pthread_mutex_t lock;
+    mc_entry_t* buckets[MC_BUCKETS];
+    uint64_t stamps[MC_BUCKETS];    // generation of the last invalidation in each bucket
+    uint64_t cleared;               // generation of the last clear
+    int nentries;
+    unsigned long long hits;
+    unsigned long long misses;
+} mc_shard_t;
+
+typedef struct mc_watch_tt {
+    int      wd;
+    uint64_t dir;
+    uint64_t parent;
+    char*    name;
+    struct mc_watch_tt* wdnext;
+    struct mc_watch_tt* dirnext;
+} mc_watch_t;
+
+static mc_shard_t* _shards = NULL;
+static mc_watch_t* _bywd[MC_WATCH_BUCKETS];
+static mc_watch_t* _bydir[MC_WATCH_BUCKETS];
+static pthread_rwlock_t _watchlock = PTHREAD_RWLOCK_INITIALIZER;
+static int _ifd = -1;
+static pthread_t _ithread;
+static volatile uint64_t _gen = 1;     // bumped by every invalidation
+static unsigned long long _invalidations = 0;
+
+static double mc_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+static uint64_t mc_hash(uint64_t dir, const char* name, int listing)
+{
+    uint64_t h = 0xCBF29CE484222325ULL ^ (dir * 0x9E3779B97F4A7C15ULL) ^ (uint64_t)listing;
+    while (*name != '\0') {
+        h ^= (unsigned char)(*name++);
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+
+static void mc_free_entry(mc_entry_t* e)
+{
+    free(e->name);
+    free(e->names);
+    free(e);
+}
+
+/* Caller holds the shard lock */
+static void mc_purge(mc_shard_t* s, int all)
+{
+    double now = mc_now();
+    int i;
+    for (i = 0; i < MC_BUCKETS; i++) {
+        mc_entry_t** pp = &s->buckets[i];
+        while (*pp != NULL) {
+            mc_entry_t* e = *pp;
+            if (all || (e->expires < now)) {
+                *pp = e->next;
+                mc_free_entry(e);
+                s->nentries--;
+            } else {
+                pp = &e->next;
+            }
+        }
+    }
+}
+
+static unsigned mc_bucket(uint64_t h)
+{
+    return (unsigned)((h / MC_NUM_SHARDS) % MC_BUCKETS);
+}
+
+/* Caller holds the shard lock */
+static mc_entry_t** mc_find(mc_shard_t* s, uint64_t h, uint64_t dir, const char* name, int listing)
+{
+    mc_entry_t** pp = &s->buckets[mc_bucket(h)];
+    while ((*pp != NULL) && (((*pp)->dir != dir) || ((*pp)->listing != listing) || (strcmp((*pp)->name, name) != 0))) {
+        pp = &((*pp)->next);
+    }
+    return pp;
+}
+
+/* Store a copy of 'st' or of the listing, unless an invalidation of its bucket
+ * came after 'gen'; invalidations elsewhere, such as the writes to other
+ * files, do not keep it out */
+static void mc_store(uint64_t dir, const char* name, int listing, const struct stat* st,
+                     const char* names, size_t len, uint64_t gen)
+{
+    uint64_t h = mc_hash(dir, name, listing);
+    mc_shard_t* s = &_shards[h % MC_NUM_SHARDS];
+    mc_entry_t** pp;
+    mc_entry_t* e;
+    char* copy = NULL;
+
+    if ((gen == 0) || (_shards == NULL)) { return; }
+    if (listing && ((copy = (char*)malloc(len + 1)) == NULL)) { return; }
+    if (copy != NULL) { memcpy(copy, names, len); }
+
+    pthread_mutex_lock(&s->lock);
+    if ((gen < s->stamps[mc_bucket(h)]) || (gen < s->cleared)) {
+        pthread_mutex_unlock(&s->lock);
+        free(copy);
+        return;
+    }
+    pp = mc_find(s, h, dir, name, listing);
+    if ((e = *pp) == NULL) {
+        if (s->nentries >= MC_MAX_ENTRIES) {
+            mc_purge(s, 0);
+            if (s->nentries >= MC_MAX_ENTRIES) { mc_purge(s, 1); }
+            pp = mc_find(s, h, dir, name, listing);
+        }
+        e = (mc_entry_t*)calloc(1, sizeof(mc_entry_t));
+        if ((e == NULL) || ((e->name = strdup(name)) == NULL)) {
+            free(e);
+            pthread_mutex_unlock(&s->lock);
+            free(copy);
+            return;
+        }
+        e->dir = dir;
+        e->listing = listing;
+        e->next = *pp;
+        *pp = e;
+        s->nentries++;
+    }
+    if (st != NULL) { e->st = *st; }
+    free(e->names);
+    e->names = copy;
+    e->len = len;
+    e->expires = mc_now() + MC_TTL;
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void mc_remove(uint64_t dir, const char* name, int listing)
+{
+    uint64_t h = mc_hash(dir, name, listing);
+    mc_shard_t* s = &_shards[h % MC_NUM_SHARDS];
+    mc_entry_t** pp;
+
+    if (_shards == NULL) { return; }
+    pthread_mutex_lock(&s->lock);
+    /* Results for this bucket taken before this point must not be stored any more */
+    s->stamps[mc_bucket(h)] = __sync_add_and_fetch(&_gen, 1);
+    __sync_add_and_fetch(&_invalidations, 1);
+    pp = mc_find(s, h, dir, name, listing);
+    if (*pp != NULL) {
+        mc_entry_t* e = *pp;
+        *pp = e->next;
+        mc_free_entry(e);
+        s->nentries--;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void mc_clear()
+{
+    int i;
+    for (i = 0; i < MC_NUM_SHARDS; i++) {
+        pthread_mutex_lock(&_shards[i].lock);
+        _shards[i].cleared = __sync_add_and_fetch(&_gen, 1);
+        mc_purge(&_shards[i], 1);
+        pthread_mutex_unlock(&_shards[i].lock);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// WATCHES
+//////////////////////////////////////////////////////////////////////
+
+/* Caller holds _watchlock */
+static mc_watch_t* watch_bydir(uint64_t dir)
+{
+    mc_watch_t* w;
+    for (w = _bydir[dir % MC_WATCH_BUCKETS]; (w != NULL) && (w->dir != dir); w = w->dirnext) { }
+    return w;
+}
+
+static mc_watch_t* watch_bywd(int wd)
+{
+    mc_watch_t* w;
+    for (w = _bywd[(unsigned)wd % MC_WATCH_BUCKETS]; (w != NULL) && (w->wd != wd); w = w->wdnext) { }
+    return w;
+}
+
+/* Caller holds _watchlock for writing */
+static void watch_free(mc_watch_t* w)
+{
+    mc_watch_t** pp;
+    for (pp = &_bywd[(unsigned)w->wd % MC_WATCH_BUCKETS]; *pp != w; pp = &((*pp)->wdnext)) { }
+    *pp = w->wdnext;
+    for (pp = &_bydir[w->dir % MC_WATCH_BUCKETS]; *pp != w; pp = &((*pp)->dirnext)) { }
+    *pp = w->dirnext;
+    free(w->name);
+    free(w);
+}
+
+/* The directory is gone, the kernel dropped the watch */
+static void watch_remove(int wd)
+{
+    mc_watch_t* w;
+    pthread_rwlock_wrlock(&_watchlock);
+    if ((w = watch_bywd(wd)) != NULL) {
+        watch_free(w);
+    }
+    pthread_rwlock_unlock(&_watchlock);
+}
+
+void mcache_unwatch(uint64_t dir)
+{
+    mc_watch_t* w;
+    int wd = -1;
+    pthread_rwlock_wrlock(&_watchlock);
+    if ((w = watch_bydir(dir)) != NULL) {
+        wd = w->wd;
+        watch_free(w);
+    }
+    pthread_rwlock_unlock(&_watchlock);
+    /* Its IN_IGNORED finds no watch any more */
+    if (wd >= 0) {
+        inotify_rm_watch(_ifd, wd);
+    }
+}
+
+uint64_t mcache_begin(uint64_t dir)
+{
+    uint64_t gen;
+    pthread_rwlock_rdlock(&_watchlock);
+    gen = (watch_bydir(dir) != NULL) ? _gen : 0;
+    pthread_rwlock_unlock(&_watchlock);
+    return gen;
+}
+
+uint64_t mcache_watch(uint64_t dir, int dirfd, uint64_t parent, const char* name)
+{
+    char path[64];
+    mc_watch_t* w;
+    int wd;
+
+    if (_ifd < 0) { return 0; }
+    pthread_rwlock_wrlock(&_watchlock);
+    if ((w = watch_bydir(dir)) == NULL) {
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", dirfd);
+        wd = inotify_add_watch(_ifd, path, MC_WATCH_MASK);
+        if (wd < 0) {
+            pthread_rwlock_unlock(&_watchlock);
+            return 0;
+        }
+        /* The same directory under a new node id after all old ones were released */
+        if ((w = watch_bywd(wd)) != NULL) {
+            mc_watch_t** pp;
+            for (pp = &_bydir[w->dir % MC_WATCH_BUCKETS]; *pp != w; pp = &((*pp)->dirnext)) { }
+            *pp = w->dirnext;
+        } else if ((w = (mc_watch_t*)calloc(1, sizeof(mc_watch_t))) != NULL) {
+            w->wd = wd;
+            w->wdnext = _bywd[(unsigned)wd % MC_WATCH_BUCKETS];
+            _bywd[(unsigned)wd % MC_WATCH_BUCKETS] = w;
+        } else {
+            pthread_rwlock_unlock(&_watchlock);
+            return 0;
+        }
+        w->dir = dir;
+        w->dirnext = _bydir[dir % MC_WATCH_BUCKETS];
+        _bydir[dir % MC_WATCH_BUCKETS] = w;
+        w->parent = parent;
+        free(w->name);
+        w->name = strdup(name);
+    }
+    pthread_rwlock_unlock(&_watchlock);
+    return _gen;
+}
+
+void mcache_moved(uint64_t dir, uint64_t parent, const char* name)
+{
+    mc_watch_t* w;
+    pthread_rwlock_wrlock(&_watchlock);
+    if ((w = watch_bydir(dir)) != NULL) {
+        free(w->name);
+        w->name = strdup(name);
+        w->parent = parent;
+    }
+    pthread_rwlock_unlock(&_watchlock);
+}
+
+static void* inotify_thread(void* arg)
+{
+    char buf[64*1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    char* p;
+
+    while (1) {
+        n = read(_ifd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR) { continue; }
+            perror("mcache: inotify read");
+            break;
+        }
+        for (p = buf; p < (buf + n); p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            mc_watch_t* w;
+            uint64_t dir;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                mc_clear();
+                continue;
+            }
+            pthread_rwlock_rdlock(&_watchlock);
+            w = watch_bywd(ev->wd);
+            dir = (w != NULL) ? w->dir : 0;
+            pthread_rwlock_unlock(&_watchlock);
+            if (dir == 0) { continue; }
+
+            if ((ev->len > 0) && (ev->name[0] != '\0')) {
+                mcache_invalidate(dir, ev->name);
+                if (ev->mask & MC_ENTRY_EVENTS) {
+                    mcache_invalidate_dir(dir);
+                }
+            } else {
+                mcache_invalidate_dir(dir);
+            }
+            if (ev->mask & IN_IGNORED) {
+                watch_remove(ev->wd);
+            }
+        }
+    }
+    return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////
+// SETUP
+//////////////////////////////////////////////////////////////////////
+
+int mcache_init()
+{
+    int i;
+    _shards = (mc_shard_t*)calloc(MC_NUM_SHARDS, sizeof(mc_shard_t));
+    if (_shards == NULL) {
+        fprintf(stderr, "mcache_init: out of memory\n");
+        return -1;
+    }
+    for (i = 0; i < MC_NUM_SHARDS; i++) {
+        pthread_mutex_init(&_shards[i].lock, NULL);
+    }
+    _ifd = inotify_init();
+    if (_ifd < 0) {
+        perror("mcache_init: inotify_init, metadata is not cached");
+        return 0;
+    }
+    if (pthread_create(&_ithread, NULL, inotify_thread, NULL) != 0) {
+        perror("mcache_init: inotify thread, metadata is not cached");
+        close(_ifd);
+        _ifd = -1;
+    }
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// ACCESS
+//////////////////////////////////////////////////////////////////////
+
+int mcache_getattr(uint64_t dir, const char* name, struct stat* st)
+{
+    uint64_t h = mc_hash(dir, name, 0);
+    mc_shard_t* s = &_shards[h % MC_NUM_SHARDS];
+    mc_entry_t* e;
+    int rc = -1;
+
+    if (_ifd < 0) { return -1; }
+    pthread_mutex_lock(&s->lock);
+    e = *mc_find(s, h, dir, name, 0);
+    if ((e != NULL) && (e->expires >= mc_now())) {
+        *st = e->st;
+        s->hits++;
+        rc = 1;
+    } else {
+        s->misses++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return rc;
+}
+
+void mcache_putattr(uint64_t dir, const char* name, const struct stat* st, uint64_t gen)
+{
+    mc_store(dir, name, 0, st, NULL, 0, gen);
+}
+
+char* mcache_getdir(uint64_t dir, size_t* len)
+{
+    uint64_t h = mc_hash(dir, "", 1);
+    mc_shard_t* s = &_shards[h % MC_NUM_SHARDS];
+    mc_entry_t* e;
+    char* names = NULL;
+
+    if (_ifd < 0) { return NULL; }
+    pthread_mutex_lock(&s->lock);
+    e = *mc_find(s, h, dir, "", 1);
+    if ((e != NULL) && (e->expires >= mc_now()) && ((names = (char*)malloc(e->len + 1)) != NULL)) {
+        memcpy(names, e->names, e->len);
+        *len = e->len;
+        s->hits++;
+    } else {
+        s->misses++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return names;
+}
+
+void mcache_putdir(uint64_t dir, const char* names, size_t len, uint64_t gen)
+{
+    mc_store(dir, "", 1, NULL, names, len, gen);
+}
+
+void mcache_invalidate(uint64_t dir, const char* name)
+{
+    mc_remove(dir, name, 0);
+}
+
+void mcache_invalidate_dir(uint64_t dir)
+{
+    mc_watch_t* w;
+    uint64_t parent = 0;
+    char* name = NULL;
+
+    mc_remove(dir, "", 1);
+    mc_remove(dir, "", 0);
+    pthread_rwlock_rdlock(&_watchlock);
+    if (((w = watch_bydir(dir)) != NULL) && (w->name != NULL)) {
+        parent = w->parent;
+        name = strdup(w->name);
+    }
+    pthread_rwlock_unlock(&_watchlock);
+    if ((parent != 0) && (name != NULL)) {
+        mc_remove(parent, name, 0);
+    }
+    free(name);
+}
+
+void mcache_getstats(mcache_stats_t* stats)
+{
+    int i;
+    memset(stats, 0, sizeof(mcache_stats_t));
+    if (_shards == NULL) { return; }
+    for (i = 0; i < MC_NUM_SHARDS; i++) {
+        pthread_mutex_lock(&_shards[i].lock);
+        stats->hits += _shards[i].hits;
+        stats->misses += _shards[i].misses;
+        pthread_mutex_unlock(&_shards[i].lock);
+    }
+    stats->invalidations = _invalidations;
+}
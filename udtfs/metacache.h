@@ -0,0 +1,60 @@
+/*
+* Server-side cache of stat results and directory listings
+*
+* Shared by all client sessions. Attributes are keyed by (directory node,
+* name), "" standing for the directory itself; a listing holds the names
+* in a directory. Nothing is cached under a directory without an inotify
+* watch on it, so changes made behind the server's back drop the entries
+* they affect, and the server's own operations drop what they change
+* right away. A result that raced with an invalidation is not stored:
+* callers take a generation before their syscall and hand it to the put,
+* which compares it with the last invalidation of the entry's bucket.
+* The table is split into shards with a lock each.
+*/
+#ifndef METACACHE_H
+#define METACACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define MC_NUM_SHARDS 64
+#define MC_BUCKETS 4096            // per shard
+#define MC_MAX_ENTRIES (32*1024)   // per shard
+#define MC_WATCH_BUCKETS 4096
+#define MC_TTL 60.0                // seconds, for what inotify cannot see (hard links)
+
+typedef struct mcache_stats_tt {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long invalidations;
+} mcache_stats_t;
+
+/* Starts the inotify reader; without inotify nothing is cached */
+int  mcache_init();
+
+/* Generation to pass to the puts for directory 'dir', 0 if it is not
+ * watched. mcache_watch() adds the watch, 'parent' and 'name' tell where
+ * the directory is so its entry there can be dropped along with it. */
+uint64_t mcache_begin(uint64_t dir);
+uint64_t mcache_watch(uint64_t dir, int dirfd, uint64_t parent, const char* name);
+void     mcache_moved(uint64_t dir, uint64_t parent, const char* name);
+/* The node of directory 'dir' was freed, its watch goes with it */
+void     mcache_unwatch(uint64_t dir);
+
+/* Returns 1 and fills 'st' on a hit, -1 on a miss */
+int   mcache_getattr(uint64_t dir, const char* name, struct stat* st);
+void  mcache_putattr(uint64_t dir, const char* name, const struct stat* st, uint64_t gen);
+
+/* Returns a malloc'd copy of the names, each NUL terminated, NULL on a miss */
+char* mcache_getdir(uint64_t dir, size_t* len);
+void  mcache_putdir(uint64_t dir, const char* names, size_t len, uint64_t gen);
+
+/* The entry 'name' of 'dir' changed */
+void  mcache_invalidate(uint64_t dir, const char* name);
+/* The directory itself changed: its listing, attributes and entry in its parent */
+void  mcache_invalidate_dir(uint64_t dir);
+
+void  mcache_getstats(mcache_stats_t* stats);
+
+#endif // METACACHE_H
@@ -0,0 +1,588 @@
+/*
+* Server-side table of the nodes a client has looked up
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <time.h>
+
+#include "nodes.h"
+#include "metacache.h"
+
+static node_t* _byid[NODE_BUCKETS];
+static node_t* _byino[NODE_BUCKETS];
+static pthread_mutex_t _nodeslock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t _nextid = NODE_ROOT_ID + 1;
+static volatile uint64_t _changes = 0;
+
+static inline unsigned ino_bucket(dev_t dev, ino_t ino)
+{
+    return (unsigned)(((uint64_t)ino * 0x9E3779B97F4A7C15ULL ^ (uint64_t)dev) % NODE_BUCKETS);
+}
+
+/* Caller holds _nodeslock */
+static node_t* find_id(uint64_t id)
+{
+    node_t* n;
+    for (n = _byid[id % NODE_BUCKETS]; n != NULL; n = n->idnext) {
+        if (n->id == id) { return n; }
+    }
+    return NULL;
+}
+
+static node_t* find_ino(dev_t dev, ino_t ino)
+{
+    node_t* n;
+    for (n = _byino[ino_bucket(dev, ino)]; n != NULL; n = n->inonext) {
+        if ((n->ino == ino) && (n->dev == dev)) { return n; }
+    }
+    return NULL;
+}
+
+static void insert_node(node_t* n)
+{
+    node_t** bid = &_byid[n->id % NODE_BUCKETS];
+    node_t** bino = &_byino[ino_bucket(n->dev, n->ino)];
+    n->idnext = *bid;
+    *bid = n;
+    n->inonext = *bino;
+    *bino = n;
+}
+
+static void remove_node(node_t* n)
+{
+    node_t** pp;
+    for (pp = &_byid[n->id % NODE_BUCKETS]; *pp != NULL; pp = &((*pp)->idnext)) {
+        if (*pp == n) {
+            *pp = n->idnext;
+            break;
+        }
+    }
+    for (pp = &_byino[ino_bucket(n->dev, n->ino)]; *pp != NULL; pp = &((*pp)->inonext)) {
+        if (*pp == n) {
+            *pp = n->inonext;
+            break;
+        }
+    }
+}
+
+static double lease_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+static void free_leases(node_t* n)
+{
+    while (n->leases != NULL) {
+        node_lease_t* l = n->leases;
+        n->leases = l->next;
+        free(l);
+    }
+}
+
+/* Free 'n' and then its ancestors for as long as nothing refers to them */
+static void release_locked(node_t* n)
+{
+    while ((n != NULL) && (n->pins == 0) && (n->lookups == 0) && (n->id != NODE_ROOT_ID)) {
+        node_t* parent = n->parent;
+        remove_node(n);
+        if (n->isdir) { mcache_unwatch(n->id); }
+        if (n->fd >= 0) { close(n->fd); }
+        free_leases(n);
+        free(n->name);
+        free(n);
+        n = parent;
+        if (n != NULL) { n->pins--; }
+    }
+}
+
+static void set_parent_locked(node_t* n, node_t* parent, const char* name)
+{
+    node_t* old = n->parent;
+    char* newname = strdup(name);
+    if (newname == NULL) { return; }
+    parent->pins++;
+    n->parent = parent;
+    free(n->name);
+    n->name = newname;
+    if (n->isdir) {
+        mcache_moved(n->id, parent->id, name);
+    }
+    if (old != NULL) {
+        old->pins--;
+        release_locked(old);
+    }
+}
+
+/* Caller holds _nodeslock */
+static node_ref_t** find_ref(node_refs_t* refs, uint64_t id)
+{
+    node_ref_t** pp = &refs->buckets[id % NODE_REF_BUCKETS];
+    while ((*pp != NULL) && ((*pp)->id != id)) { pp = &((*pp)->next); }
+    return pp;
+}
+
+/* Generation for caching results from directory 'dir', watching it first if need be */
+static uint64_t watch_dir(node_t* dir, int dirfd)
+{
+    uint64_t gen = mcache_begin(dir->id);
+    if (gen == 0) {
+        char* name = NULL;
+        node_t* parent = node_locate(dir, &name);
+        gen = mcache_watch(dir->id, dirfd, (parent != NULL) ? parent->id : 0, (name != NULL) ? name : "");
+        free(name);
+        node_put(parent);
+    }
+    return gen;
+}
+
+/* fstatat() of 'name' in 'parent', through the metadata cache */
+static int stat_at(node_t* parent, const char* name, struct stat* st)
+{
+    uint64_t gen;
+    int pfd;
+    if (mcache_getattr(parent->id, name, st) == 1) { return 0; }
+    if ((pfd = node_dirfd(parent)) < 0) { return -1; }
+    gen = watch_dir(parent, pfd);
+    if (fstatat(pfd, name, st, 0) != 0) { return -1; }
+    mcache_putattr(parent->id, name, st, gen);
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// SETUP
+//////////////////////////////////////////////////////////////////////
+
+int nodes_init(const char* rootpath)
+{
+    struct stat st;
+    node_t* root;
+    int fd;
+
+    fd = open(rootpath, O_RDONLY | O_DIRECTORY);
+    if ((fd < 0) || (fstat(fd, &st) != 0)) {
+        perror("nodes_init");
+        if (fd >= 0) { close(fd); }
+        return -1;
+    }
+    root = (node_t*)calloc(1, sizeof(node_t));
+    if (root == NULL) {
+        close(fd);
+        return -1;
+    }
+    root->id = NODE_ROOT_ID;
+    root->dev = st.st_dev;
+    root->ino = st.st_ino;
+    root->isdir = 1;
+    root->fd = fd;
+    root->name = strdup("");
+    root->lookups = 1;
+    pthread_mutex_lock(&_nodeslock);
+    insert_node(root);
+    pthread_mutex_unlock(&_nodeslock);
+    return 0;
+}
+
+void nodes_destroy()
+{
+    int i;
+    pthread_mutex_lock(&_nodeslock);
+    for (i = 0; i < NODE_BUCKETS; i++) {
+        while (_byid[i] != NULL) {
+            node_t* n = _byid[i];
+            _byid[i] = n->idnext;
+            if (n->fd >= 0) { close(n->fd); }
+            free_leases(n);
+            free(n->name);
+            free(n);
+        }
+        _byino[i] = NULL;
+    }
+    pthread_mutex_unlock(&_nodeslock);
+}
+
+//////////////////////////////////////////////////////////////////////
+// REFERENCES
+//////////////////////////////////////////////////////////////////////
+
+node_refs_t* node_refs_new()
+{
+    return (node_refs_t*)calloc(1, sizeof(node_refs_t));
+}
+
+void node_refs_free(node_refs_t* refs)
+{
+    int i;
+    if (refs == NULL) { return; }
+    pthread_mutex_lock(&_nodeslock);
+    for (i = 0; i < NODE_REF_BUCKETS; i++) {
+        while (refs->buckets[i] != NULL) {
+            node_ref_t* r = refs->buckets[i];
+            node_t* n = find_id(r->id);
+            refs->buckets[i] = r->next;
+            if (n != NULL) {
+                n->lookups = (r->count >= n->lookups) ? 0 : (n->lookups - r->count);
+                release_locked(n);
+            }
+            free(r);
+        }
+    }
+    pthread_mutex_unlock(&_nodeslock);
+    free(refs);
+}
+
+node_t* node_get(uint64_t id)
+{
+    node_t* n;
+    pthread_mutex_lock(&_nodeslock);
+    n = find_id(id);
+    if (n != NULL) { n->pins++; }
+    pthread_mutex_unlock(&_nodeslock);
+    return n;
+}
+
+void node_put(node_t* n)
+{
+    if (n == NULL) { return; }
+    pthread_mutex_lock(&_nodeslock);
+    n->pins--;
+    release_locked(n);
+    pthread_mutex_unlock(&_nodeslock);
+}
+
+int node_name_ok(const char* name)
+{
+    if ((name == NULL) || (name[0] == '\0') || (strchr(name, '/') != NULL)) { return 0; }
+    if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0)) { return 0; }
+    return 1;
+}
+
+node_t* node_lookup(node_refs_t* refs, node_t* parent, const char* name, struct stat* st)
+{
+    node_ref_t** ref;
+    node_t* n;
+
+    if (!node_name_ok(name)) { return NULL; }
+    if (stat_at(parent, name, st) != 0) { return NULL; }
+
+    pthread_mutex_lock(&_nodeslock);
+    n = find_ino(st->st_dev, st->st_ino);
+    if (n != NULL) {
+        n->lookups++;
+        /* A file seen under another name (hard link, renamed by someone else):
+         * the latest name is the one most likely to still exist */
+        if (!n->isdir && ((n->parent != parent) || (strcmp(n->name, name) != 0))) {
+            set_parent_locked(n, parent, name);
+        }
+    } else {
+        n = (node_t*)calloc(1, sizeof(node_t));
+        if ((n == NULL) || ((n->name = strdup(name)) == NULL)) {
+            free(n);
+            pthread_mutex_unlock(&_nodeslock);
+            return NULL;
+        }
+        n->id = _nextid++;
+        n->dev = st->st_dev;
+        n->ino = st->st_ino;
+        n->isdir = S_ISDIR(st->st_mode);
+        n->fd = -1;
+        n->parent = parent;
+        n->lookups = 1;
+        parent->pins++;
+        insert_node(n);
+    }
+    ref = find_ref(refs, n->id);
+    if (*ref == NULL) {
+        *ref = (node_ref_t*)calloc(1, sizeof(node_ref_t));
+        if (*ref != NULL) { (*ref)->id = n->id; }
+    }
+    if (*ref != NULL) { (*ref)->count++; }
+    pthread_mutex_unlock(&_nodeslock);
+    return n;
+}
+
+void node_forget(node_refs_t* refs, uint64_t id, uint64_t nlookup)
+{
+    node_ref_t** ref;
+    node_t* n;
+    pthread_mutex_lock(&_nodeslock);
+    ref = find_ref(refs, id);
+    n = find_id(id);
+    if ((*ref != NULL) && (n != NULL)) {
+        /* A session can only drop what it holds */
+        node_ref_t* r = *ref;
+        if (nlookup >= r->count) {
+            nlookup = r->count;
+            *ref = r->next;
+            free(r);
+        } else {
+            r->count -= nlookup;
+        }
+        n->lookups = (nlookup >= n->lookups) ? 0 : (n->lookups - nlookup);
+        release_locked(n);
+    }
+    pthread_mutex_unlock(&_nodeslock);
+}
+
+void node_moved(node_t* newparent, const char* newname)
+{
+    struct stat st;
+    node_t* n;
+    int pfd = node_dirfd(newparent);
+    if ((pfd < 0) || (fstatat(pfd, newname, &st, 0) != 0)) { return; }
+    pthread_mutex_lock(&_nodeslock);
+    n = find_ino(st.st_dev, st.st_ino);
+    if ((n != NULL) && (n->id != NODE_ROOT_ID)) {
+        set_parent_locked(n, newparent, newname);
+    }
+    pthread_mutex_unlock(&_nodeslock);
+}
+
+//////////////////////////////////////////////////////////////////////
+// LEASES
+//////////////////////////////////////////////////////////////////////
+
+void node_lease(node_t* n, uint64_t session, int seconds)
+{
+    double now = lease_now();
+    node_lease_t** pp;
+    node_lease_t* l = NULL;
+
+    pthread_mutex_lock(&_nodeslock);
+    pp = &n->leases;
+    while (*pp != NULL) {
+        if ((*pp)->session == session) {
+            l = *pp;
+            pp = &l->next;
+        } else if ((*pp)->expires < now) {
+            node_lease_t* old = *pp;
+            *pp = old->next;
+            free(old);
+        } else {
+            pp = &((*pp)->next);
+        }
+    }
+    if ((l == NULL) && ((l = (node_lease_t*)calloc(1, sizeof(node_lease_t))) != NULL)) {
+        l->session = session;
+        l->next = n->leases;
+        n->leases = l;
+    }
+    if (l != NULL) { l->expires = now + seconds; }
+    pthread_mutex_unlock(&_nodeslock);
+}
+
+uint64_t* node_recall(node_t* n, uint64_t except, int* count)
+{
+    double now = lease_now();
+    uint64_t* sessions = NULL;
+    node_lease_t** pp;
+    node_lease_t* l;
+    int max = 0;
+
+    *count = 0;
+    pthread_mutex_lock(&_nodeslock);
+    _changes++;
+    for (l = n->leases; l != NULL; l = l->next) { max++; }
+    if (max > 0) { sessions = (uint64_t*)malloc(max * sizeof(uint64_t)); }
+    pp = &n->leases;
+    while (*pp != NULL) {
+        l = *pp;
+        if (l->session == except) {
+            pp = &l->next;
+            continue;
+        }
+        if ((l->expires >= now) && (sessions != NULL)) {
+            sessions[(*count)++] = l->session;
+        }
+        *pp = l->next;
+        free(l);
+    }
+    pthread_mutex_unlock(&_nodeslock);
+    if (*count == 0) {
+        free(sessions);
+        sessions = NULL;
+    }
+    return sessions;
+}
+
+uint64_t node_changes()
+{
+    return _changes;
+}
+
+//////////////////////////////////////////////////////////////////////
+// ACCESS
+//////////////////////////////////////////////////////////////////////
+
+int node_dirfd(node_t* n)
+{
+    struct stat st;
+    node_t* parent;
+    char* name;
+    int pfd, fd;
+
+    pthread_mutex_lock(&_nodeslock);
+    if (!n->isdir || (n->fd >= 0)) {
+        fd = n->isdir ? n->fd : -1;
+        pthread_mutex_unlock(&_nodeslock);
+        return fd;
+    }
+    parent = n->parent;
+    parent->pins++;
+    name = strdup(n->name);
+    pthread_mutex_unlock(&_nodeslock);
+
+    pfd = node_dirfd(parent);
+    fd = ((pfd >= 0) && (name != NULL)) ? openat(pfd, name, O_RDONLY | O_DIRECTORY) : -1;
+    free(name);
+    node_put(parent);
+
+    /* The name may refer to another directory by now */
+    if ((fd >= 0) && ((fstat(fd, &st) != 0) || (st.st_dev != n->dev) || (st.st_ino != n->ino))) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0) { return -1; }
+
+    pthread_mutex_lock(&_nodeslock);
+    if (n->fd < 0) {
+        n->fd = fd;
+    } else {
+        close(fd);
+        fd = n->fd;
+    }
+    pthread_mutex_unlock(&_nodeslock);
+    return fd;
+}
+
+node_t* node_locate(node_t* n, char** name)
+{
+    node_t* parent;
+    pthread_mutex_lock(&_nodeslock);
+    parent = n->parent;
+    if (parent != NULL) {
+        parent->pins++;
+        *name = strdup(n->name);
+    }
+    pthread_mutex_unlock(&_nodeslock);
+    if ((parent != NULL) && (*name == NULL)) {
+        node_put(parent);
+        parent = NULL;
+    }
+    return parent;
+}
+
+int node_stat(node_t* n, struct stat* st)
+{
+    int rc = -1;
+    if (n->isdir) {
+        if (mcache_getattr(n->id, "", st) == 1) {
+            rc = 0;
+        } else {
+            int fd = node_dirfd(n);
+            uint64_t gen = (fd >= 0) ? watch_dir(n, fd) : 0;
+            rc = (fd >= 0) ? fstat(fd, st) : -1;
+            if (rc == 0) { mcache_putattr(n->id, "", st, gen); }
+        }
+    } else {
+        char* name = NULL;
+        node_t* parent = node_locate(n, &name);
+        if (parent != NULL) {
+            rc = stat_at(parent, name, st);
+            free(name);
+            node_put(parent);
+        }
+    }
+    if ((rc == 0) && ((st->st_dev != n->dev) || (st->st_ino != n->ino))) {
+        /* The name now belongs to another file */
+        rc = -1;
+    }
+    return rc;
+}
+
+int node_readdir(node_t* n, char** names, size_t* len)
+{
+    DIR* dir;
+    struct dirent* entry;
+    uint64_t gen;
+    size_t cap = 4096;
+    int fd;
+
+    if ((*names = mcache_getdir(n->id, len)) != NULL) { return 0; }
+    if (!n->isdir || ((fd = node_dirfd(n)) < 0)) { return -1; }
+    gen = watch_dir(n, fd);
+    fd = openat(fd, ".", O_RDONLY | O_DIRECTORY);
+    if ((fd < 0) || ((dir = fdopendir(fd)) == NULL)) {
+        if (fd >= 0) { close(fd); }
+        return -1;
+    }
+    *len = 0;
+    *names = (char*)malloc(cap);
+    while ((*names != NULL) && ((entry = readdir(dir)) != NULL)) {
+        size_t namelen = strlen(entry->d_name) + 1;
+        if ((strcmp(".", entry->d_name) == 0) || (strcmp("..", entry->d_name) == 0)) { continue; }
+        if ((*len + namelen) > cap) {
+            char* grown;
+            while ((*len + namelen) > cap) { cap *= 2; }
+            if ((grown = (char*)realloc(*names, cap)) == NULL) {
+                free(*names);
+                *names = NULL;
+                break;
+            }
+            *names = grown;
+        }
+        memcpy(*names + *len, entry->d_name, namelen);
+        *len += namelen;
+    }
+    closedir(dir);
+    if (*names == NULL) { return -1; }
+    mcache_putdir(n->id, *names, *len, gen);
+    return 0;
+}
+
+void node_changed(node_t* n)
+{
+    if (n->isdir) {
+        mcache_invalidate_dir(n->id);
+    } else {
+        char* name = NULL;
+        node_t* parent = node_locate(n, &name);
+        if (parent != NULL) {
+            mcache_invalidate(parent->id, name);
+            free(name);
+            node_put(parent);
+        }
+    }
+}
+
+void node_entry_changed(node_t* dir, const char* name)
+{
+    mcache_invalidate(dir->id, name);
+    mcache_invalidate_dir(dir->id);
+}
+
+int node_open(node_t* n, int flags)
+{
+    int fd = -1;
+    if (n->isdir) {
+        int dfd = node_dirfd(n);
+        fd = (dfd >= 0) ? openat(dfd, ".", flags) : -1;
+    } else {
+        char* name = NULL;
+        node_t* parent = node_locate(n, &name);
+        if (parent != NULL) {
+            int pfd = node_dirfd(parent);
+            fd = (pfd >= 0) ? openat(pfd, name, flags) : -1;
+            free(name);
+            node_put(parent);
+        }
+    }
+    return fd;
+}
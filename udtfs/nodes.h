@@ -0,0 +1,114 @@
+/*
+* Server-side table of the nodes a client has looked up
+*
+* The client addresses files by node id instead of by path. A node knows
+* its parent node and its name in there, and a directory node keeps an
+* open descriptor, so every operation is a single openat()/fstatat()
+* relative to the parent rather than a walk of the full path. Node ids
+* stay valid when the node or one of its ancestors is renamed.
+*
+* Clients hold 'lookups' references on a node (one per LOOKUP reply or
+* READDIRPLUS entry) and drop them with FORGET. Each client session counts
+* its own share in a node_refs_t, so whatever a client did not forget is
+* dropped when it goes away. Children and running operations pin a node,
+* it is freed when neither kind of reference is left.
+*
+* A session that was sent a node's attributes, or the names in a directory,
+* holds a lease on the node until it expires or is recalled; the server
+* recalls the leases of a node it changes and tells their holders.
+*/
+#ifndef NODES_H
+#define NODES_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define NODE_ROOT_ID 1
+#define NODE_BUCKETS 65536
+#define NODE_REF_BUCKETS 4096
+
+typedef struct node_lease_tt {
+    uint64_t session;
+    double   expires;
+    struct node_lease_tt* next;
+} node_lease_t;
+
+typedef struct node_tt {
+    uint64_t id;
+    dev_t    dev;
+    ino_t    ino;
+    int      isdir;
+    int      fd;                // directories only, opened on first use
+    struct node_tt* parent;     // NULL for the root
+    char*    name;
+    uint64_t lookups;
+    int      pins;
+    node_lease_t* leases;
+    struct node_tt* idnext;
+    struct node_tt* inonext;
+} node_t;
+
+/* References held by one client session */
+typedef struct node_ref_tt {
+    uint64_t id;
+    uint64_t count;
+    struct node_ref_tt* next;
+} node_ref_t;
+
+typedef struct node_refs_tt {
+    node_ref_t* buckets[NODE_REF_BUCKETS];
+} node_refs_t;
+
+int  nodes_init(const char* rootpath);
+void nodes_destroy();
+
+node_refs_t* node_refs_new();
+/* Drop all references of the session and free 'refs' */
+void node_refs_free(node_refs_t* refs);
+
+/* Returns the node pinned, or NULL if the id is unknown */
+node_t* node_get(uint64_t id);
+void    node_put(node_t* n);
+
+/* Look up 'name' in the directory 'parent'. Returns the (unpinned) node
+ * with one more reference for 'refs' and fills 'st', NULL if it does not exist */
+node_t* node_lookup(node_refs_t* refs, node_t* parent, const char* name, struct stat* st);
+
+/* Drop up to 'nlookup' references of 'refs' */
+void node_forget(node_refs_t* refs, uint64_t id, uint64_t nlookup);
+
+/* Record that the entry now at 'newname' in 'newparent' was renamed there */
+void node_moved(node_t* newparent, const char* newname);
+
+/* Descriptor of a directory node, owned by the node, -1 on error */
+int node_dirfd(node_t* n);
+
+/* Returns the pinned parent of 'n' and a malloc'd copy of its name there,
+ * NULL for the root */
+node_t* node_locate(node_t* n, char** name);
+
+/* Stat and listing go through the metadata cache shared by all sessions */
+int node_stat(node_t* n, struct stat* st);
+/* Names in directory 'n', each NUL terminated, in a malloc'd buffer */
+int node_readdir(node_t* n, char** names, size_t* len);
+int node_open(node_t* n, int flags);
+
+/* Tell the cache about changes made through the server: the node itself,
+ * or the entry 'name' of directory 'dir' was created, removed or renamed */
+void node_changed(node_t* n);
+void node_entry_changed(node_t* dir, const char* name);
+
+/* Grant or renew the lease of 'session' on 'n' for 'seconds' */
+void node_lease(node_t* n, uint64_t session, int seconds);
+/* Take back the live leases on 'n' except the one of 'except'. Returns the
+ * malloc'd list of their sessions, NULL if there were none */
+uint64_t* node_recall(node_t* n, uint64_t except, int* count);
+/* Counts recalls: a lease granted after a stat is only good if the count
+ * did not move in between */
+uint64_t node_changes();
+
+/* Single path component, no "." or ".." that would leave the share */
+int node_name_ok(const char* name);
+
+#endif // NODES_H
@@ -0,0 +1,1155 @@
+/*
+* Tagged request/response messaging between udtfs and udtfs_server
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+
+#include <udt.h>
+
+#include "common.h"
+#include "rpc.h"
+
+//////////////////////////////////////////////////////////////////////
+// MESSAGES
+//////////////////////////////////////////////////////////////////////
+
+rpc_msg_t* rpc_msg_new(uint16_t op)
+{
+    rpc_msg_t* m = (rpc_msg_t*)calloc(1, sizeof(rpc_msg_t));
+    if (m == NULL) { return NULL; }
+    m->op = op;
+    m->cap = 256;
+    m->buf = (char*)malloc(RPC_HDR_LEN + m->cap);
+    if (m->buf == NULL) {
+        free(m);
+        return NULL;
+    }
+    return m;
+}
+
+void rpc_msg_free(rpc_msg_t* m)
+{
+    while (m != NULL) {
+        rpc_msg_t* next = m->next;
+        free(m->buf);
+        free(m);
+        m = next;
+    }
+}
+
+static char* msg_grow(rpc_msg_t* m, size_t n)
+{
+    if ((m->len + n) > m->cap) {
+        size_t cap = m->cap;
+        while ((m->len + n) > cap) { cap *= 2; }
+        char* buf = (char*)realloc(m->buf, RPC_HDR_LEN + cap);
+        if (buf == NULL) {
+            m->err = 1;
+            return NULL;
+        }
+        m->buf = buf;
+        m->cap = cap;
+    }
+    char* p = m->buf + RPC_HDR_LEN + m->len;
+    m->len += n;
+    return p;
+}
+
+static inline void enc_u16(char* p, uint16_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+}
+
+static inline void enc_u32(char* p, uint32_t v)
+{
+    int i;
+    for (i = 0; i < 4; i++) { p[i] = (v >> (8*i)) & 0xFF; }
+}
+
+static inline void enc_u64(char* p, uint64_t v)
+{
+    int i;
+    for (i = 0; i < 8; i++) { p[i] = (v >> (8*i)) & 0xFF; }
+}
+
+static inline uint16_t dec_u16(const char* p)
+{
+    const unsigned char* u = (const unsigned char*)p;
+    return (uint16_t)u[0] | ((uint16_t)u[1] << 8);
+}
+
+static inline uint32_t dec_u32(const char* p)
+{
+    const unsigned char* u = (const unsigned char*)p;
+    return (uint32_t)u[0] | ((uint32_t)u[1] << 8) | ((uint32_t)u[2] << 16) | ((uint32_t)u[3] << 24);
+}
+
+static inline uint64_t dec_u64(const char* p)
+{
+    return (uint64_t)dec_u32(p) | ((uint64_t)dec_u32(p + 4) << 32);
+}
+
+void rpc_put_u32(rpc_msg_t* m, uint32_t v)
+{
+    char* p = msg_grow(m, 4);
+    if (p != NULL) { enc_u32(p, v); }
+}
+
+void rpc_put_u64(rpc_msg_t* m, uint64_t v)
+{
+    char* p = msg_grow(m, 8);
+    if (p != NULL) { enc_u64(p, v); }
+}
+
+void rpc_put_bytes(rpc_msg_t* m, const char* data, size_t len)
+{
+    rpc_put_u32(m, len);
+    char* p = msg_grow(m, len);
+    if (p != NULL) { memcpy(p, data, len); }
+}
+
+void rpc_put_str(rpc_msg_t* m, const char* str)
+{
+    rpc_put_bytes(m, str, strlen(str));
+}
+
+void rpc_put_stat(rpc_msg_t* m, const struct stat* st)
+{
+    rpc_put_u64(m, st->st_dev);
+    rpc_put_u64(m, st->st_ino);
+    rpc_put_u32(m, st->st_mode);
+    rpc_put_u32(m, st->st_nlink);
+    rpc_put_u32(m, st->st_uid);
+    rpc_put_u32(m, st->st_gid);
+    rpc_put_u64(m, st->st_rdev);
+    rpc_put_u64(m, st->st_size);
+    rpc_put_u32(m, st->st_blksize);
+    rpc_put_u64(m, st->st_blocks);
+    rpc_put_u64(m, st->st_atim.tv_sec);
+    rpc_put_u32(m, st->st_atim.tv_nsec);
+    rpc_put_u64(m, st->st_mtim.tv_sec);
+    rpc_put_u32(m, st->st_mtim.tv_nsec);
+    rpc_put_u64(m, st->st_ctim.tv_sec);
+    rpc_put_u32(m, st->st_ctim.tv_nsec);
+}
+
+static const char* msg_take(rpc_msg_t* m, size_t n)
+{
+    if (m->err || ((m->pos + n) > m->len)) {
+        m->err = 1;
+        return NULL;
+    }
+    const char* p = m->buf + RPC_HDR_LEN + m->pos;
+    m->pos += n;
+    return p;
+}
+
+uint32_t rpc_get_u32(rpc_msg_t* m)
+{
+    const char* p = msg_take(m, 4);
+    return (p != NULL) ? dec_u32(p) : 0;
+}
+
+uint64_t rpc_get_u64(rpc_msg_t* m)
+{
+    const char* p = msg_take(m, 8);
+    return (p != NULL) ? dec_u64(p) : 0;
+}
+
+const char* rpc_get_bytes(rpc_msg_t* m, size_t* len)
+{
+    *len = rpc_get_u32(m);
+    const char* p = msg_take(m, *len);
+    if (p == NULL) { *len = 0; }
+    return p;
+}
+
+char* rpc_get_str(rpc_msg_t* m)
+{
+    size_t len;
+    const char* p = rpc_get_bytes(m, &len);
+    if (p == NULL) { return NULL; }
+    char* str = (char*)malloc(len + 1);
+    if (str != NULL) {
+        memcpy(str, p, len);
+        str[len] = '\0';
+    }
+    return str;
+}
+
+void rpc_get_stat(rpc_msg_t* m, struct stat* st)
+{
+    memset(st, 0, sizeof(struct stat));
+    st->st_dev = rpc_get_u64(m);
+    st->st_ino = rpc_get_u64(m);
+    st->st_mode = rpc_get_u32(m);
+    st->st_nlink = rpc_get_u32(m);
+    st->st_uid = rpc_get_u32(m);
+    st->st_gid = rpc_get_u32(m);
+    st->st_rdev = rpc_get_u64(m);
+    st->st_size = rpc_get_u64(m);
+    st->st_blksize = rpc_get_u32(m);
+    st->st_blocks = rpc_get_u64(m);
+    st->st_atim.tv_sec = rpc_get_u64(m);
+    st->st_atim.tv_nsec = rpc_get_u32(m);
+    st->st_mtim.tv_sec = rpc_get_u64(m);
+    st->st_mtim.tv_nsec = rpc_get_u32(m);
+    st->st_ctim.tv_sec = rpc_get_u64(m);
+    st->st_ctim.tv_nsec = rpc_get_u32(m);
+}
+
+int rpc_at_end(rpc_msg_t* m)
+{
+    return (m->pos >= m->len);
+}
+
+//////////////////////////////////////////////////////////////////////
+// FRAMING
+//////////////////////////////////////////////////////////////////////
+
+static void encode_hdr(char* p, uint32_t len, uint16_t op, uint16_t flags, uint32_t tag, int32_t status)
+{
+    enc_u32(p, len);
+    enc_u16(p + 4, op);
+    enc_u16(p + 6, flags);
+    enc_u32(p + 8, tag);
+    enc_u32(p + 12, (uint32_t)status);
+}
+
+static int send_all(int fd, const char* buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) { continue; }
+            perror("rpc: send");
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Write header and payload of 'm' with a single send() */
+static int send_frame(int fd, rpc_msg_t* m)
+{
+    if (m->err) { return -1; }
+    encode_hdr(m->buf, m->len, m->op, m->flags, m->tag, m->status);
+    return send_all(fd, m->buf, RPC_HDR_LEN + m->len);
+}
+
+static void reader_init(rpc_reader_t* r, int fd)
+{
+    r->fd = fd;
+    r->head = 0;
+    r->tail = 0;
+}
+
+/* Copy 'len' bytes to 'dst', refilling the buffer with whatever the socket has */
+static int reader_read(rpc_reader_t* r, char* dst, size_t len)
+{
+    while (len > 0) {
+        if (r->head == r->tail) {
+            ssize_t n;
+            if (len >= sizeof(r->buf)) {
+                /* Large payloads bypass the buffer */
+                n = recv(r->fd, dst, len, MSG_WAITALL);
+                if (n <= 0) {
+                    if ((n < 0) && (errno == EINTR)) { continue; }
+                    return -1;
+                }
+                dst += n;
+                len -= n;
+                continue;
+            }
+            r->head = r->tail = 0;
+            n = recv(r->fd, r->buf, sizeof(r->buf), 0);
+            if (n <= 0) {
+                if ((n < 0) && (errno == EINTR)) { continue; }
+                return -1;
+            }
+            r->tail = n;
+        }
+        size_t chunk = r->tail - r->head;
+        if (chunk > len) { chunk = len; }
+        memcpy(dst, r->buf + r->head, chunk);
+        r->head += chunk;
+        dst += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+/* Message for the frame with header 'hdr', with room for its payload */
+static rpc_msg_t* frame_new(const char* hdr)
+{
+    uint32_t len = dec_u32(hdr);
+    rpc_msg_t* m;
+    if (len > RPC_MAX_PAYLOAD) {
+        fprintf(stderr, "rpc: oversized frame of %u bytes\n", len);
+        return NULL;
+    }
+    m = rpc_msg_new(dec_u16(hdr + 4));
+    if (m == NULL) { return NULL; }
+    m->flags = dec_u16(hdr + 6);
+    m->tag = dec_u32(hdr + 8);
+    m->status = (int32_t)dec_u32(hdr + 12);
+    if ((len > 0) && (msg_grow(m, len) == NULL)) {
+        rpc_msg_free(m);
+        return NULL;
+    }
+    return m;
+}
+
+static rpc_msg_t* recv_frame(rpc_reader_t* r)
+{
+    char hdr[RPC_HDR_LEN];
+    rpc_msg_t* m;
+
+    if (reader_read(r, hdr, sizeof(hdr)) != 0) { return NULL; }
+    if ((m = frame_new(hdr)) == NULL) { return NULL; }
+    if ((m->len > 0) && (reader_read(r, m->buf + RPC_HDR_LEN, m->len) != 0)) {
+        rpc_msg_free(m);
+        return NULL;
+    }
+    return m;
+}
+
+static int udt_recv_all(UDTSOCKET ufd, char* buf, size_t len)
+{
+    while (len > 0) {
+        int n = UDT::recv(ufd, buf, len, 0);
+        if (UDT::ERROR == n) { return -1; }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int udt_send_all(UDTSOCKET ufd, const char* buf, size_t len)
+{
+    while (len > 0) {
+        int n = UDT::send(ufd, buf, len, 0);
+        if (UDT::ERROR == n) { return -1; }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// CLIENT
+//////////////////////////////////////////////////////////////////////
+
+/* Caller holds c->lock */
+static rpc_call_t* find_call(rpc_client_t* c, uint32_t tag)
+{
+    rpc_call_t* call;
+    for (call = c->pending; call != NULL; call = call->next) {
+        if (call->tag == tag) { return call; }
+    }
+    return NULL;
+}
+
+static void client_fail(rpc_client_t* c)
+{
+    rpc_call_t* call;
+    pthread_mutex_lock(&c->lock);
+    c->dead = 1;
+    for (call = c->pending; call != NULL; call = call->next) {
+        pthread_cond_signal(&call->cond);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+static void* client_tcp_dispatcher(void* arg)
+{
+    rpc_client_t* c = (rpc_client_t*)arg;
+    rpc_msg_t* m;
+    rpc_call_t* call;
+
+    while ((m = recv_frame(&c->reader)) != NULL) {
+        if ((m->tag == 0) && (m->op == RPC_OP_NOTIFY)) {
+            if (c->notify != NULL) { c->notify(c, m); }
+            rpc_msg_free(m);
+            continue;
+        }
+        pthread_mutex_lock(&c->lock);
+        call = find_call(c, m->tag);
+        if ((call != NULL) && (m->flags & RPC_FLAG_MORE)) {
+            rpc_msg_t** pp = &call->parts;
+            while (*pp != NULL) { pp = &((*pp)->next); }
+            *pp = m;
+        } else if (call != NULL) {
+            if (call->parts != NULL) {
+                /* Chain: first chunk ... last chunk, status from the final frame */
+                rpc_msg_t** pp = &call->parts;
+                while (*pp != NULL) { pp = &((*pp)->next); }
+                *pp = m;
+                call->parts->status = m->status;
+                m = call->parts;
+                call->parts = NULL;
+            }
+            call->reply = m;
+            call->done = 1;
+            pthread_cond_signal(&call->cond);
+        } else {
+            fprintf(stderr, "rpc: reply for unknown tag %u\n", m->tag);
+            rpc_msg_free(m);
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+    client_fail(c);
+    return NULL;
+}
+
+static void* client_udt_dispatcher(void* arg)
+{
+    rpc_client_t* c = (rpc_client_t*)arg;
+    char hdr[RPC_HDR_LEN];
+    rpc_call_t* call;
+    char* scratch = (char*)malloc(65536);
+
+    while (udt_recv_all(c->ufd, hdr, sizeof(hdr)) == 0) {
+        uint32_t len = dec_u32(hdr);
+        uint32_t tag = dec_u32(hdr + 8);
+        char* dst = NULL;
+        int toolong = 0;
+
+        pthread_mutex_lock(&c->lock);
+        call = find_call(c, tag);
+        if ((call != NULL) && (call->data != NULL)) {
+            if (len <= call->datalen) {
+                dst = call->data;
+            } else {
+                toolong = 1;
+            }
+        }
+        pthread_mutex_unlock(&c->lock);
+
+        if (dst != NULL) {
+            if (udt_recv_all(c->ufd, dst, len) != 0) { break; }
+        } else {
+            /* Nobody waits for this segment or it does not fit, drain it */
+            fprintf(stderr, "rpc: discarding %u bytes for tag %u\n", len, tag);
+            uint32_t remain = len;
+            while (remain > 0) {
+                size_t chunk = (remain > 65536) ? 65536 : remain;
+                if (udt_recv_all(c->ufd, scratch, chunk) != 0) { break; }
+                remain -= chunk;
+            }
+            if (remain > 0) { break; }
+            if (!toolong) { continue; }
+        }
+
+        /* A segment that did not fit fails the call instead of leaving it waiting */
+        pthread_mutex_lock(&c->lock);
+        call = find_call(c, tag);
+        if (call != NULL) {
+            call->data_done = 1;
+            call->data_err = toolong;
+            pthread_cond_signal(&call->cond);
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+    free(scratch);
+    client_fail(c);
+    return NULL;
+}
+
+int rpc_client_start(rpc_client_t* c, int fd, UDTSOCKET ufd, rpc_notify_t notify)
+{
+    c->fd = fd;
+    c->notify = notify;
+    c->ufd = ufd;
+    c->nexttag = 1;
+    c->dead = 0;
+    c->pending = NULL;
+    c->npending = 0;
+    c->pendingdata = 0;
+    reader_init(&c->reader, fd);
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_mutex_init(&c->sendlock, NULL);
+    pthread_mutex_init(&c->udtsendlock, NULL);
+    if (pthread_create(&c->tcpthread, NULL, client_tcp_dispatcher, c) != 0) { return -1; }
+    if (pthread_create(&c->udtthread, NULL, client_udt_dispatcher, c) != 0) { return -1; }
+    return 0;
+}
+
+void rpc_client_stop(rpc_client_t* c)
+{
+    shutdown(c->fd, SHUT_RDWR);
+    UDT::close(c->ufd);
+    pthread_join(c->tcpthread, NULL);
+    pthread_join(c->udtthread, NULL);
+    close(c->fd);
+    pthread_mutex_destroy(&c->lock);
+    pthread_mutex_destroy(&c->sendlock);
+    pthread_mutex_destroy(&c->udtsendlock);
+}
+
+/* Send 'req', optionally followed by 'out' on the UDT socket, and wait for
+ * the reply and the 'datalen' bytes of segment data into 'data' */
+static rpc_msg_t* do_call(rpc_client_t* c, rpc_msg_t* req, char* data, size_t datalen,
+                          const char* out, size_t outlen)
+{
+    rpc_call_t call;
+    rpc_call_t** pp;
+    int rc;
+
+    memset(&call, 0, sizeof(call));
+    call.data = data;
+    call.datalen = datalen;
+    pthread_cond_init(&call.cond, NULL);
+
+    pthread_mutex_lock(&c->lock);
+    if (c->dead) {
+        pthread_mutex_unlock(&c->lock);
+        pthread_cond_destroy(&call.cond);
+        return NULL;
+    }
+    call.tag = c->nexttag++;
+    if (c->nexttag == 0) { c->nexttag = 1; }
+    call.next = c->pending;
+    c->pending = &call;
+    c->npending++;
+    c->pendingdata += datalen + outlen;
+    pthread_mutex_unlock(&c->lock);
+
+    /* Send the request */
+    req->tag = call.tag;
+    if (out != NULL) { req->flags |= RPC_FLAG_DATA; }
+    pthread_mutex_lock(&c->sendlock);
+    rc = send_frame(c->fd, req);
+    pthread_mutex_unlock(&c->sendlock);
+
+    /* The server matches the data to the request by its tag */
+    if ((rc == 0) && (out != NULL)) {
+        char hdr[RPC_HDR_LEN];
+        encode_hdr(hdr, outlen, RPC_OP_DATA, 0, call.tag, 0);
+        pthread_mutex_lock(&c->udtsendlock);
+        if ((udt_send_all(c->ufd, hdr, sizeof(hdr)) != 0) || (udt_send_all(c->ufd, out, outlen) != 0)) {
+            rc = -1;
+        }
+        pthread_mutex_unlock(&c->udtsendlock);
+    }
+
+    /* Wait for the reply and the data; a read replies with the byte count */
+    pthread_mutex_lock(&c->lock);
+    while ((rc == 0) && !c->dead) {
+        if (call.done && ((data == NULL) || call.data_done || (call.reply->status <= 0))) { break; }
+        pthread_cond_wait(&call.cond, &c->lock);
+    }
+    for (pp = &c->pending; *pp != NULL; pp = &((*pp)->next)) {
+        if (*pp == &call) {
+            *pp = call.next;
+            break;
+        }
+    }
+    c->npending--;
+    c->pendingdata -= datalen + outlen;
+    pthread_mutex_unlock(&c->lock);
+    pthread_cond_destroy(&call.cond);
+    rpc_msg_free(call.parts);
+
+    if ((rc != 0) || !call.done || call.data_err ||
+        ((data != NULL) && (call.reply->status > 0) && !call.data_done)) {
+        rpc_msg_free(call.reply);
+        return NULL;
+    }
+    return call.reply;
+}
+
+rpc_msg_t* rpc_call(rpc_client_t* c, rpc_msg_t* req, char* data, size_t datalen)
+{
+    return do_call(c, req, data, datalen, NULL, 0);
+}
+
+rpc_msg_t* rpc_call_send(rpc_client_t* c, rpc_msg_t* req, const char* data, size_t datalen)
+{
+    return do_call(c, req, NULL, 0, data, datalen);
+}
+
+int rpc_post(rpc_client_t* c, rpc_msg_t* req)
+{
+    int rc;
+    req->tag = 0;
+    pthread_mutex_lock(&c->sendlock);
+    rc = send_frame(c->fd, req);
+    pthread_mutex_unlock(&c->sendlock);
+    return rc;
+}
+
+rpc_client_t* rpc_pool_pick(rpc_pool_t* p)
+{
+    rpc_client_t* best = &p->conns[0];
+    int i;
+    /* Unlocked reads, a stale value only skews the balance a little */
+    for (i = 1; i < p->n; i++) {
+        rpc_client_t* c = &p->conns[i];
+        if (c->dead) { continue; }
+        if (best->dead || (c->pendingdata < best->pendingdata)
+            || ((c->pendingdata == best->pendingdata) && (c->npending < best->npending))) {
+            best = c;
+        }
+    }
+    return best;
+}
+
+//////////////////////////////////////////////////////////////////////
+// SERVER
+//////////////////////////////////////////////////////////////////////
+
+static int _epfd = -1;
+static pthread_t _loopthread;
+static pthread_t _workers[RPC_MAX_WORKERS];
+static rpc_msg_t* _qhead = NULL;
+static rpc_msg_t* _qtail = NULL;
+static pthread_mutex_t _qlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _qcond = PTHREAD_COND_INITIALIZER;
+
+/* Work of one request spread over the pool, see rpc_server_parallel() */
+typedef struct rpc_task_tt {
+    void (*fn)(void* arg, int i);
+    void*  arg;
+    int    n;
+    int    next;                  // first index nobody took yet
+    int    running;               // indexes being worked on by helpers
+    pthread_cond_t done;
+    struct rpc_task_tt* tnext;
+} rpc_task_t;
+static rpc_task_t* _tasks = NULL; // with indexes left, under _qlock
+
+/* Drop a reference of the event loop or of a finished request */
+static void server_put(rpc_server_t* s)
+{
+    pthread_mutex_lock(&s->lock);
+    if (--s->refs == 0) {
+        pthread_cond_broadcast(&s->donecond);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Caller holds _qlock. Takes the next index of 't', -1 if none is left;
+ * the task leaves the list with its last index. */
+static int task_take(rpc_task_t* t)
+{
+    rpc_task_t** pp;
+    int i;
+    if (t->next >= t->n) { return -1; }
+    i = t->next++;
+    if (t->next >= t->n) {
+        for (pp = &_tasks; (*pp != NULL) && (*pp != t); pp = &((*pp)->tnext)) { }
+        if (*pp != NULL) { *pp = t->tnext; }
+    }
+    return i;
+}
+
+void rpc_server_parallel(void (*fn)(void* arg, int i), void* arg, int n)
+{
+    rpc_task_t t;
+    int i;
+
+    t.fn = fn;
+    t.arg = arg;
+    t.n = n;
+    t.next = 0;
+    t.running = 0;
+    pthread_cond_init(&t.done, NULL);
+    pthread_mutex_lock(&_qlock);
+    if (n > 1) {
+        t.tnext = _tasks;
+        _tasks = &t;
+        pthread_cond_broadcast(&_qcond);
+    }
+    /* The caller works too, so this finishes even with every worker busy */
+    while ((i = task_take(&t)) >= 0) {
+        pthread_mutex_unlock(&_qlock);
+        fn(arg, i);
+        pthread_mutex_lock(&_qlock);
+    }
+    while (t.running > 0) {
+        pthread_cond_wait(&t.done, &_qlock);
+    }
+    pthread_mutex_unlock(&_qlock);
+    pthread_cond_destroy(&t.done);
+}
+
+static void* server_worker(void* arg)
+{
+    rpc_msg_t* m;
+    rpc_server_t* s;
+    while (1) {
+        pthread_mutex_lock(&_qlock);
+        while ((_qhead == NULL) && (_tasks == NULL)) {
+            pthread_cond_wait(&_qcond, &_qlock);
+        }
+        /* Help with the requests in progress before starting new ones */
+        if (_tasks != NULL) {
+            rpc_task_t* t = _tasks;
+            int i = task_take(t);
+            t->running++;
+            pthread_mutex_unlock(&_qlock);
+            t->fn(t->arg, i);
+            pthread_mutex_lock(&_qlock);
+            if (--t->running == 0) { pthread_cond_broadcast(&t->done); }
+            pthread_mutex_unlock(&_qlock);
+            continue;
+        }
+        m = _qhead;
+        _qhead = m->next;
+        if (_qhead == NULL) { _qtail = NULL; }
+        m->next = NULL;
+        pthread_mutex_unlock(&_qlock);
+
+        s = m->conn;
+        s->handler(s, m);
+        rpc_msg_free(m);
+        server_put(s);
+    }
+    return NULL;
+}
+
+/* Caller holds s->lock. The data frame of 'tag' if it arrived, left in place */
+static rpc_msg_t* server_find_data(rpc_server_t* s, uint32_t tag)
+{
+    rpc_msg_t* m;
+    for (m = s->data; (m != NULL) && (m->tag != tag); m = m->next) { }
+    return m;
+}
+
+/* Hand a request to the workers */
+static void server_run(rpc_msg_t* m)
+{
+    pthread_mutex_lock(&_qlock);
+    if (_qtail == NULL) {
+        _qhead = m;
+    } else {
+        _qtail->next = m;
+    }
+    _qtail = m;
+    pthread_cond_signal(&_qcond);
+    pthread_mutex_unlock(&_qlock);
+}
+
+/* A request that carries write data waits here, not in a worker, until
+ * the UDT reader has all of the data */
+static void server_queue(rpc_server_t* s, rpc_msg_t* m)
+{
+    int park;
+    m->conn = s;
+    pthread_mutex_lock(&s->lock);
+    s->refs++;
+    park = (m->flags & RPC_FLAG_DATA) && !s->udtdead && (server_find_data(s, m->tag) == NULL);
+    if (park) {
+        m->next = s->parked;
+        s->parked = m;
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (!park) { server_run(m); }
+}
+
+/* Feed 'len' bytes read from the control connection into the frame being assembled */
+static int server_parse(rpc_server_t* s, const char* p, size_t len)
+{
+    while (len > 0) {
+        size_t n;
+        if (s->rx == NULL) {
+            n = RPC_HDR_LEN - s->rxhdrlen;
+            if (n > len) { n = len; }
+            memcpy(s->rxhdr + s->rxhdrlen, p, n);
+            s->rxhdrlen += n;
+            if (s->rxhdrlen < RPC_HDR_LEN) { break; }
+            s->rxhdrlen = 0;
+            s->rxgot = 0;
+            if ((s->rx = frame_new(s->rxhdr)) == NULL) { return -1; }
+        } else {
+            n = s->rx->len - s->rxgot;
+            if (n > len) { n = len; }
+            memcpy(s->rx->buf + RPC_HDR_LEN + s->rxgot, p, n);
+            s->rxgot += n;
+        }
+        p += n;
+        len -= n;
+        if (s->rxgot == s->rx->len) {
+            server_queue(s, s->rx);
+            s->rx = NULL;
+        }
+    }
+    return 0;
+}
+
+/* The client closed the control connection: stop reading, let the
+ * requests in progress finish */
+static void server_disconnect(rpc_server_t* s)
+{
+    epoll_ctl(_epfd, EPOLL_CTL_DEL, s->fd, NULL);
+    rpc_msg_free(s->rx);
+    s->rx = NULL;
+    pthread_mutex_lock(&s->lock);
+    s->quit = 1;
+    pthread_cond_broadcast(&s->datacond);
+    pthread_mutex_unlock(&s->lock);
+    server_put(s);
+}
+
+/* Reads the control connections of all clients */
+static void* server_loop(void* arg)
+{
+    struct epoll_event ev[RPC_EPOLL_EVENTS];
+    char* buf = (char*)malloc(RPC_RDBUF_SIZE);
+    int i, n;
+
+    while (buf != NULL) {
+        n = epoll_wait(_epfd, ev, RPC_EPOLL_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) { continue; }
+            perror("rpc: epoll_wait");
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            rpc_server_t* s = (rpc_server_t*)ev[i].data.ptr;
+            /* One read per connection and round; the socket stays blocking for the replies */
+            ssize_t got = recv(s->fd, buf, RPC_RDBUF_SIZE, MSG_DONTWAIT);
+            if ((got < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))) { continue; }
+            if ((got <= 0) || (server_parse(s, buf, got) != 0)) {
+                server_disconnect(s);
+            }
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////
+// SERVER UDT READERS -- the data sockets of all clients are shared out
+// among RPC_UDT_READERS threads, which assemble the data frames of writes
+//////////////////////////////////////////////////////////////////////
+
+typedef struct udt_reader_tt {
+    pthread_t       thread;
+    pthread_mutex_t lock;       // guards the list
+    pthread_cond_t  cond;       // a connection was added
+    rpc_server_t*   conns;      // linked by 'rnext'
+    int             nconns;
+} udt_reader_t;
+
+static udt_reader_t _readers[RPC_UDT_READERS];
+
+/* A data frame is complete: keep it for its request, which runs now if it waited */
+static void server_data_arrived(rpc_server_t* s, rpc_msg_t* m)
+{
+    rpc_msg_t** pp;
+    rpc_msg_t* req = NULL;
+    pthread_mutex_lock(&s->lock);
+    m->next = s->data;
+    s->data = m;
+    for (pp = &s->parked; (*pp != NULL) && ((*pp)->tag != m->tag); pp = &((*pp)->next)) { }
+    if (*pp != NULL) {
+        req = *pp;
+        *pp = req->next;
+        req->next = NULL;
+    }
+    pthread_cond_broadcast(&s->datacond);
+    pthread_mutex_unlock(&s->lock);
+    if (req != NULL) { server_run(req); }
+}
+
+/* Take what arrived on the data socket without waiting; -1 once it is broken */
+static int server_udt_read(rpc_server_t* s)
+{
+    while (1) {
+        char* p;
+        size_t want;
+        int n;
+        if (s->urx == NULL) {
+            p = s->urxhdr + s->urxhdrlen;
+            want = RPC_HDR_LEN - s->urxhdrlen;
+        } else {
+            p = s->urx->buf + RPC_HDR_LEN + s->urxgot;
+            want = s->urx->len - s->urxgot;
+        }
+        n = UDT::recv(s->ufd, p, (int)want, 0);
+        if (UDT::ERROR == n) {
+            return (UDT::getlasterror().getErrorCode() == CUDTException::EASYNCRCV) ? 0 : -1;
+        }
+        if (n == 0) { return 0; }
+        if (s->urx == NULL) {
+            s->urxhdrlen += n;
+            if (s->urxhdrlen < RPC_HDR_LEN) { continue; }
+            s->urxhdrlen = 0;
+            s->urxgot = 0;
+            if ((s->urx = frame_new(s->urxhdr)) == NULL) { return -1; }
+        } else {
+            s->urxgot += n;
+        }
+        if (s->urxgot == s->urx->len) {
+            server_data_arrived(s, s->urx);
+            s->urx = NULL;
+        }
+    }
+}
+
+/* No more data for 's': its waiting requests run and fail to find theirs */
+static void server_udt_drop(udt_reader_t* r, rpc_server_t* s)
+{
+    rpc_server_t** pp;
+    rpc_msg_t* req;
+
+    pthread_mutex_lock(&r->lock);
+    for (pp = &r->conns; *pp != s; pp = &((*pp)->rnext)) { }
+    *pp = s->rnext;
+    r->nconns--;
+    pthread_mutex_unlock(&r->lock);
+
+    pthread_mutex_lock(&s->lock);
+    s->udtdead = 1;
+    req = s->parked;
+    s->parked = NULL;
+    pthread_cond_broadcast(&s->datacond);
+    pthread_mutex_unlock(&s->lock);
+    while (req != NULL) {
+        rpc_msg_t* next = req->next;
+        req->next = NULL;
+        server_run(req);
+        req = next;
+    }
+    server_put(s);
+}
+
+static void* udt_reader_thread(void* arg)
+{
+    udt_reader_t* r = (udt_reader_t*)arg;
+    std::vector<UDTSOCKET> fds, readfds, exceptfds;
+    std::vector<rpc_server_t*> conns;
+    size_t i, j;
+
+    while (1) {
+        pthread_mutex_lock(&r->lock);
+        while (r->conns == NULL) {
+            pthread_cond_wait(&r->cond, &r->lock);
+        }
+        fds.clear();
+        conns.clear();
+        for (rpc_server_t* s = r->conns; s != NULL; s = s->rnext) {
+            fds.push_back(s->ufd);
+            conns.push_back(s);
+        }
+        pthread_mutex_unlock(&r->lock);
+
+        /* Short rounds, so that new connections and closed ones are seen soon */
+        UDT::selectEx(fds, &readfds, NULL, &exceptfds, RPC_UDT_POLL_MS);
+        for (i = 0; i < conns.size(); i++) {
+            rpc_server_t* s = conns[i];
+            int readable = 0, broken = 0;
+            for (j = 0; j < readfds.size(); j++) { readable |= (readfds[j] == s->ufd); }
+            for (j = 0; j < exceptfds.size(); j++) { broken |= (exceptfds[j] == s->ufd); }
+            if (readable && (server_udt_read(s) != 0)) { broken = 1; }
+            /* A client that closed the control connection sends nothing more */
+            if (broken || (s->quit && !readable)) {
+                server_udt_drop(r, s);
+            }
+        }
+    }
+    return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////
+// SERVER CONNECTIONS
+//////////////////////////////////////////////////////////////////////
+
+int rpc_server_init(int nworkers)
+{
+    int i;
+    if (nworkers > RPC_MAX_WORKERS) { nworkers = RPC_MAX_WORKERS; }
+    if ((_epfd = epoll_create(1024)) < 0) {
+        perror("rpc: epoll_create");
+        return -1;
+    }
+    for (i = 0; i < nworkers; i++) {
+        if (pthread_create(&_workers[i], NULL, server_worker, NULL) != 0) {
+            perror("rpc: worker thread");
+            return -1;
+        }
+    }
+    for (i = 0; i < RPC_UDT_READERS; i++) {
+        pthread_mutex_init(&_readers[i].lock, NULL);
+        pthread_cond_init(&_readers[i].cond, NULL);
+        if (pthread_create(&_readers[i].thread, NULL, udt_reader_thread, &_readers[i]) != 0) {
+            perror("rpc: UDT reader thread");
+            return -1;
+        }
+    }
+    if (pthread_create(&_loopthread, NULL, server_loop, NULL) != 0) {
+        perror("rpc: event loop thread");
+        return -1;
+    }
+    return 0;
+}
+
+rpc_msg_t* rpc_recv_data(rpc_server_t* s, rpc_msg_t* req)
+{
+    rpc_msg_t** pp;
+    rpc_msg_t* m = NULL;
+    pthread_mutex_lock(&s->lock);
+    while (1) {
+        for (pp = &s->data; (*pp != NULL) && ((*pp)->tag != req->tag); pp = &((*pp)->next)) { }
+        if (*pp != NULL) {
+            m = *pp;
+            *pp = m->next;
+            m->next = NULL;
+            break;
+        }
+        /* A client that closed the control connection sends nothing more */
+        if (s->udtdead || s->quit) { break; }
+        pthread_cond_wait(&s->datacond, &s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return m;
+}
+
+int rpc_server_open(rpc_server_t* s, int fd, UDTSOCKET ufd, rpc_handler_t handler)
+{
+    struct epoll_event ev;
+    udt_reader_t* r = &_readers[0];
+    bool nonblocking = false;
+    int i;
+
+    s->fd = fd;
+    s->ufd = ufd;
+    s->quit = 0;
+    s->udtdead = 0;
+    s->refs = 1;
+    s->handler = handler;
+    s->data = NULL;
+    s->parked = NULL;
+    s->rx = NULL;
+    s->rxhdrlen = 0;
+    s->urx = NULL;
+    s->urxhdrlen = 0;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->datacond, NULL);
+    pthread_cond_init(&s->donecond, NULL);
+    pthread_mutex_init(&s->sendlock, NULL);
+    pthread_mutex_init(&s->udtlock, NULL);
+    UDT::setsockopt(ufd, 0, UDT_RCVSYN, &nonblocking, sizeof(bool));
+
+    /* Requests are read by the event loop from here on */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = s;
+    if (epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        perror("rpc: epoll_ctl");
+        s->quit = 1;
+        s->refs = 0;
+        return -1;
+    }
+
+    /* The write data is read by the least loaded UDT reader, which holds a reference */
+    for (i = 1; i < RPC_UDT_READERS; i++) {
+        if (_readers[i].nconns < r->nconns) { r = &_readers[i]; }
+    }
+    pthread_mutex_lock(&s->lock);
+    s->refs++;
+    pthread_mutex_unlock(&s->lock);
+    pthread_mutex_lock(&r->lock);
+    s->rnext = r->conns;
+    r->conns = s;
+    r->nconns++;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    return 0;
+}
+
+void rpc_server_wait(rpc_server_t* s)
+{
+    pthread_mutex_lock(&s->lock);
+    while (!s->quit) {
+        pthread_cond_wait(&s->datacond, &s->lock);
+    }
+    while (s->refs > 0) {
+        pthread_cond_wait(&s->donecond, &s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+void rpc_server_close(rpc_server_t* s)
+{
+    UDT::close(s->ufd);
+    rpc_msg_free(s->data);
+    rpc_msg_free(s->urx);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->datacond);
+    pthread_cond_destroy(&s->donecond);
+    pthread_mutex_destroy(&s->sendlock);
+    pthread_mutex_destroy(&s->udtlock);
+}
+
+int rpc_reply(rpc_server_t* s, rpc_msg_t* req, int status, rpc_msg_t* reply)
+{
+    rpc_msg_t empty;
+    char hdr[RPC_HDR_LEN];
+    int rc;
+
+    if (reply == NULL) {
+        memset(&empty, 0, sizeof(empty));
+        empty.buf = hdr;
+        reply = &empty;
+    }
+    reply->op = req->op;
+    reply->tag = req->tag;
+    reply->status = status;
+    pthread_mutex_lock(&s->sendlock);
+    rc = send_frame(s->fd, reply);
+    pthread_mutex_unlock(&s->sendlock);
+    return rc;
+}
+
+int rpc_push(rpc_server_t* s, rpc_msg_t* m)
+{
+    int rc;
+    if (s->quit) { return -1; }
+    m->tag = 0;
+    m->status = 0;
+    pthread_mutex_lock(&s->sendlock);
+    rc = send_frame(s->fd, m);
+    pthread_mutex_unlock(&s->sendlock);
+    return rc;
+}
+
+int rpc_reply_part(rpc_server_t* s, rpc_msg_t* req, rpc_msg_t* part)
+{
+    int rc;
+    part->op = req->op;
+    part->tag = req->tag;
+    part->status = 0;
+    part->flags = RPC_FLAG_MORE;
+    pthread_mutex_lock(&s->sendlock);
+    rc = send_frame(s->fd, part);
+    pthread_mutex_unlock(&s->sendlock);
+    part->flags = 0;
+    part->len = 0;
+    return rc;
+}
+
+int rpc_send_datahdr(rpc_server_t* s, rpc_msg_t* req, uint64_t len)
+{
+    char hdr[RPC_HDR_LEN];
+    encode_hdr(hdr, len, RPC_OP_DATA, 0, req->tag, 0);
+    return udt_send_all(s->ufd, hdr, sizeof(hdr));
+}
+
+int rpc_send_data(rpc_server_t* s, const char* buf, size_t len)
+{
+    return udt_send_all(s->ufd, buf, len);
+}
@@ -0,0 +1,254 @@
+/*
+* Tagged request/response messaging between udtfs and udtfs_server
+*
+* Every request carries a tag that the server echoes in its reply, so a
+* connection can carry many outstanding requests and the server may answer
+* them in any order. On the client a dispatcher thread per socket matches
+* replies (TCP) and segment data (UDT) to the waiting callers. On the server
+* one epoll loop reads the control connections of all clients and queues
+* their requests for a worker pool shared by all of them. A few UDT reader
+* threads take the write data of all clients; a request flagged
+* RPC_FLAG_DATA reaches a worker only once its data is complete.
+*
+* Frames are a fixed 16-byte header followed by 'len' payload bytes:
+*
+*   uint32 len | uint16 opcode | uint16 flags | uint32 tag | int32 status
+*
+* A reply may be split over several frames with the same tag, all but the
+* last one flagged RPC_FLAG_MORE. The caller receives them as a chain.
+*
+* Frames with tag 0 are not replies: FORGET from the client, NOTIFY from the
+* server. Attributes and names a client receives come with a lease of
+* RPC_LEASE_TIME seconds; until it runs out the server sends a NOTIFY when
+* another client changes them, and the client may cache them that long.
+*
+* Requests that change the file system (TRUNCATE, RENAME, UNLINK, UTIME)
+* reply with status 0 or the negated errno of the failed call. The *_MANY
+* requests carry up to RPC_MAX_BATCH independent entries and reply with
+* such a status per entry.
+*
+* All integers are little-endian. Payload fields are fixed-width integers
+* and strings (uint32 length + bytes, no terminator). Segment data on the
+* UDT socket is framed the same way, the payload being the file data. It
+* flows both ways: the server sends read data, the client sends the data
+* of a write right after the request, tagged like it.
+*/
+#ifndef RPC_H
+#define RPC_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <udt.h>
+#include "common.h"
+
+#define RPC_SERVER_WORKERS 32
+#define RPC_MAX_WORKERS 256
+#define RPC_EPOLL_EVENTS 64
+#define RPC_UDT_READERS 4        // server threads receiving the write data of all clients
+#define RPC_UDT_POLL_MS 10       // how soon a UDT reader sees a new or closed connection
+#define RPC_HDR_LEN 16
+#define RPC_MAX_PAYLOAD (64*1024*1024)
+#define RPC_RDBUF_SIZE (64*1024)
+#define RPC_CHUNK_SIZE (256*1024)
+#define RPC_FLAG_MORE 0x0001
+#define RPC_FLAG_DATA 0x0002     // request whose data follows on the UDT socket
+#define RPC_LEASE_TIME 30
+#define RPC_MAX_BATCH 256        // entries in one *_MANY request
+
+/* NOTIFY records: uint32 kind, uint64 node, and for an entry the name */
+#define RPC_NOTIFY_NODE 1    // attributes or data of the node changed
+#define RPC_NOTIFY_ENTRY 2   // the name in directory node was added, removed or renamed
+
+enum rpc_opcode {
+    RPC_OP_LOOKUP = 1,
+    RPC_OP_FORGET,    // one-way, never answered
+    RPC_OP_GETATTR,
+    RPC_OP_READDIRPLUS,
+    RPC_OP_READ,
+    RPC_OP_TRUNCATE,
+    RPC_OP_WRITE,
+    RPC_OP_RENAME,
+    RPC_OP_UNLINK,
+    RPC_OP_UTIME,
+    RPC_OP_DATA,      // segment data on the UDT socket, either direction
+    RPC_OP_NOTIFY,    // server to client, never answered
+    RPC_OP_OPEN,
+    RPC_OP_RELEASE,   // one-way, never answered
+    RPC_OP_GETATTR_MANY,
+    RPC_OP_UNLINK_MANY,
+    RPC_OP_CREATE_MANY
+};
+
+typedef struct rpc_msg_tt {
+    uint16_t op;
+    uint16_t flags;
+    uint32_t tag;
+    int32_t  status;
+    char*    buf;     // RPC_HDR_LEN bytes of header space, then the payload
+    size_t   len;     // payload length
+    size_t   cap;
+    size_t   pos;     // read cursor into the payload
+    int      err;     // set when a read ran past the end of the payload
+    struct rpc_msg_tt* next;  // further frames of a chunked reply
+    struct rpc_server_tt* conn;  // server: connection a queued request came in on
+} rpc_msg_t;
+
+rpc_msg_t* rpc_msg_new(uint16_t op);
+/* Frees 'm' and the frames chained to it */
+void rpc_msg_free(rpc_msg_t* m);
+
+void rpc_put_u32(rpc_msg_t* m, uint32_t v);
+void rpc_put_u64(rpc_msg_t* m, uint64_t v);
+void rpc_put_str(rpc_msg_t* m, const char* str);
+void rpc_put_bytes(rpc_msg_t* m, const char* data, size_t len);
+void rpc_put_stat(rpc_msg_t* m, const struct stat* st);
+
+uint32_t rpc_get_u32(rpc_msg_t* m);
+uint64_t rpc_get_u64(rpc_msg_t* m);
+/* Returns a NUL terminated copy of the next string, or NULL */
+char*    rpc_get_str(rpc_msg_t* m);
+/* Returns a pointer into the payload, valid as long as the message */
+const char* rpc_get_bytes(rpc_msg_t* m, size_t* len);
+void     rpc_get_stat(rpc_msg_t* m, struct stat* st);
+int      rpc_at_end(rpc_msg_t* m);
+
+/* Buffered reader over a TCP socket, one recv() usually yields several frames */
+typedef struct rpc_reader_tt {
+    int    fd;
+    size_t head;
+    size_t tail;
+    char   buf[RPC_RDBUF_SIZE];
+} rpc_reader_t;
+
+//////////////////////////////////////////////////////////////////////
+// CLIENT
+//////////////////////////////////////////////////////////////////////
+
+typedef struct rpc_call_tt {
+    uint32_t   tag;
+    rpc_msg_t* reply;
+    rpc_msg_t* parts;         // RPC_FLAG_MORE frames received so far
+    int        done;
+    char*      data;
+    size_t     datalen;
+    int        data_done;
+    int        data_err;      // the segment did not fit 'data' and was dropped
+    pthread_cond_t cond;
+    struct rpc_call_tt* next;
+} rpc_call_t;
+
+struct rpc_client_tt;
+typedef void (*rpc_notify_t)(struct rpc_client_tt* c, rpc_msg_t* m);
+
+typedef struct rpc_client_tt {
+    int        fd;
+    UDTSOCKET  ufd;
+    uint32_t   nexttag;
+    int        dead;
+    rpc_call_t* pending;
+    int        npending;
+    uint64_t   pendingdata;   // segment bytes still to arrive or to be sent
+    rpc_reader_t reader;
+    pthread_mutex_t lock;
+    pthread_mutex_t sendlock;
+    pthread_mutex_t udtsendlock;
+    rpc_notify_t notify;      // called on the dispatcher thread for NOTIFY frames
+    pthread_t  tcpthread;
+    pthread_t  udtthread;
+} rpc_client_t;
+
+int  rpc_client_start(rpc_client_t* c, int fd, UDTSOCKET ufd, rpc_notify_t notify);
+void rpc_client_stop(rpc_client_t* c);
+
+/* Send 'req' and block until its reply (and, if 'data' is given, up to
+ * 'datalen' bytes of segment data) arrived. Returns NULL if the connection
+ * is lost or the segment data is longer than 'datalen'. */
+rpc_msg_t* rpc_call(rpc_client_t* c, rpc_msg_t* req, char* data, size_t datalen);
+
+/* Send 'req' and then 'datalen' bytes of 'data' on the UDT socket, block
+ * until the reply arrived. Returns NULL if the connection is lost. */
+rpc_msg_t* rpc_call_send(rpc_client_t* c, rpc_msg_t* req, const char* data, size_t datalen);
+
+/* Send a request that has no reply */
+int rpc_post(rpc_client_t* c, rpc_msg_t* req);
+
+/* Control/data connection pairs of one mount, requests go to the least
+ * loaded one so that metadata never queues behind a bulk transfer */
+typedef struct rpc_pool_tt {
+    int           n;
+    rpc_client_t* conns;
+} rpc_pool_t;
+
+rpc_client_t* rpc_pool_pick(rpc_pool_t* p);
+
+//////////////////////////////////////////////////////////////////////
+// SERVER
+//////////////////////////////////////////////////////////////////////
+
+struct rpc_server_tt;
+typedef int (*rpc_handler_t)(struct rpc_server_tt* s, rpc_msg_t* req);
+
+typedef struct rpc_server_tt {
+    void*      session;       // set by the caller before rpc_server_open()
+    int        fd;
+    UDTSOCKET  ufd;
+    int        quit;          // the control connection is closed
+    int        udtdead;
+    int        refs;          // the event loop, the UDT reader and the requests in progress
+    rpc_handler_t handler;
+    rpc_msg_t* data;          // client data frames not yet claimed by a request
+    rpc_msg_t* parked;        // requests whose data is still on its way
+    rpc_msg_t* rx;            // frame being received by the event loop
+    size_t     rxgot;
+    char       rxhdr[RPC_HDR_LEN];
+    size_t     rxhdrlen;
+    rpc_msg_t* urx;           // data frame being received by the UDT reader
+    size_t     urxgot;
+    char       urxhdr[RPC_HDR_LEN];
+    size_t     urxhdrlen;
+    struct rpc_server_tt* rnext;  // among the connections of its UDT reader
+    pthread_mutex_t lock;
+    pthread_cond_t  datacond;
+    pthread_cond_t  donecond;
+    pthread_mutex_t sendlock;
+    pthread_mutex_t udtlock;
+} rpc_server_t;
+
+/* Start the event loop and the workers shared by all connections */
+int  rpc_server_init(int nworkers);
+
+/* Serve a client until it disconnects: rpc_server_open() hands the control
+ * connection to the event loop and 'ufd' to a UDT reader, rpc_server_wait()
+ * sleeps until the client is gone and its requests finished,
+ * rpc_server_close() releases the connection and closes 'ufd'. */
+int  rpc_server_open(rpc_server_t* s, int fd, UDTSOCKET ufd, rpc_handler_t handler);
+void rpc_server_wait(rpc_server_t* s);
+void rpc_server_close(rpc_server_t* s);
+
+/* For a handler with independent pieces of work: run fn(arg, i) for each
+ * i in [0, n) on idle workers and the calling thread, return when all are done */
+void rpc_server_parallel(void (*fn)(void* arg, int i), void* arg, int n);
+
+/* Send 'm' to the client unasked, with tag 0 */
+int  rpc_push(rpc_server_t* s, rpc_msg_t* m);
+
+/* The data the client sent along with 'req', the payload of the returned
+ * frame. A request flagged RPC_FLAG_DATA runs only once it is here, so
+ * this does not wait then. NULL if the connection is lost. */
+rpc_msg_t* rpc_recv_data(rpc_server_t* s, rpc_msg_t* req);
+
+/* Reply to 'req' with 'status' and the payload of 'reply' (may be NULL) */
+int  rpc_reply(rpc_server_t* s, rpc_msg_t* req, int status, rpc_msg_t* reply);
+
+/* Send the payload of 'part' as a non-final frame of the reply to 'req'
+ * and empty it for the next chunk */
+int  rpc_reply_part(rpc_server_t* s, rpc_msg_t* req, rpc_msg_t* part);
+
+/* Announce 'len' bytes of segment data for 'req' on the UDT socket;
+ * the caller holds s->udtlock and sends the bytes right after */
+int  rpc_send_datahdr(rpc_server_t* s, rpc_msg_t* req, uint64_t len);
+/* Part of those bytes */
+int  rpc_send_data(rpc_server_t* s, const char* buf, size_t len);
+
+#endif // RPC_H
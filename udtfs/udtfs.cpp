@@ -11,9 +11,14 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <time.h>
+#include <stdint.h>
 
 #include <udt.h>
 #include "common.h"
+#include "blockcache.h"
+#include "attrcache.h"
+#include "rpc.h"
 
 //////////////////////////////////////////////////////////////////////
 // FUSE
@@ -21,231 +26,1427 @@
 
 #define FUSE_USE_VERSION 26
 extern "C" {
-  #include <fuse.h>
+  #include <fuse_lowlevel.h>
 }
 
-static struct fuse_operations _udtfs_oper;
+static struct fuse_lowlevel_ops _udtfs_oper;
 typedef unsigned long long ull_t;
 
 //////////////////////////////////////////////////////////////////////
 // GLOBALS
 //////////////////////////////////////////////////////////////////////
 
-#define MAX_CACHE_SIZE (32*1024*1024)
+/* Since FUSE 2.9, setattr to the current time */
+#ifndef FUSE_SET_ATTR_ATIME_NOW
+#define FUSE_SET_ATTR_ATIME_NOW (1 << 7)
+#define FUSE_SET_ATTR_MTIME_NOW (1 << 8)
+#endif
 
-static int _file_is_open = 0;
-static char _file_name[M_MAX_VAL];
-static struct stat _file_stats;
+#define MAX_OPEN_FILES 1024
+#define MAX_FETCH_BLOCKS 128 // 32 MB per segment request
+#define RA_MIN_BLOCKS 4
+#define RA_MAX_BLOCKS MAX_FETCH_BLOCKS
+#define NODE_TABLE_BUCKETS 16384
+#define FORGET_BATCH 256
+#define M_MAX_CONNECTIONS 8
+#define DEFAULT_CONNECTIONS 4
+#define WB_EXTENT_MAX (8*1024*1024)       // extents this large are written out right away
+#define WB_DEFAULT_BUDGET (64*1024*1024)
+#define WB_FLUSHERS_PER_CONN 2
+#define RA_FETCHERS 4                     // prefetch threads, each with a MAX_FETCH_BLOCKS buffer
+#define BATCH_MAX 64                      // entries per batched metadata request
 
-static char* _cache;
-static size_t _cache_len;
-static off_t  _cache_offset;
+/* Server node references held by this client. 'nlookup' counts the
+ * kernel's references, 'srvrefs' the ones the server handed out. */
+typedef struct udtfs_node_tt {
+    uint64_t id;
+    uint64_t nlookup;
+    uint64_t srvrefs;
+    double   idle_since;
+    int      queued;
+    struct udtfs_node_tt* next;
+    struct udtfs_node_tt* qnext;
+} udtfs_node_t;
 
-static int _fd = 0;
-static UDTSOCKET _ufd;
+/* A run of written data not yet on the server */
+typedef struct wb_extent_tt {
+    off64_t offset;
+    size_t  len;
+    size_t  cap;
+    char*   data;
+    struct udtfs_handle_tt* h;
+    struct wb_extent_tt* next;
+} wb_extent_t;
 
-static pthread_mutex_t _tcpmutex;
-static pthread_mutex_t _udtmutex;
+typedef struct udtfs_handle_tt {
+    int    in_use;
+    uint64_t nodeid;
+    uint64_t fh;        // server handle of the open file
+    struct stat stats;
+    uint64_t version;
+    off64_t ra_next;    // offset a sequential reader will ask for next
+    off64_t ra_issued;  // end of the data requested by readahead so far
+    int     ra_blocks;  // current readahead window, 0 when access is random
+    pthread_mutex_t lock;
+    /* Write-back state, under _wbmutex */
+    wb_extent_t* dirty; // extents still taking writes, sorted by offset
+    int     wb_busy;    // extents queued or on their way to the server
+    off64_t wb_lo;      // range covered by the busy extents
+    off64_t wb_hi;
+    int     wb_error;   // errno of a failed write-back, reported by flush/fsync
+    int     wb_listed;  // on _wb_writers
+    struct udtfs_handle_tt* wb_next;
+    volatile int stale; // the file changed on the server, stat it again before reading
+} udtfs_handle_t;
+
+/* A segment to prefetch, self-contained so the handle may be released meanwhile */
+typedef struct ra_job_tt {
+    uint64_t nodeid;
+    uint64_t fh;        // fails harmlessly once the file is released, names the stream
+    uint64_t version;
+    off64_t  size;
+    off64_t  blockno;
+    int      nblocks;
+    struct ra_job_tt* next;
+} ra_job_t;
+
+/* A kernel cache entry to drop: the node 'ino', or with a 'name' the entry there */
+typedef struct inval_tt {
+    uint64_t ino;
+    char*    name;
+    struct inval_tt* next;
+} inval_t;
+
+/* Directory listing built at opendir, handed out by readdir */
+typedef struct udtfs_dirbuf_tt {
+    char*  buf;
+    size_t len;
+    size_t cap;
+} udtfs_dirbuf_t;
+
+static udtfs_handle_t _handles[MAX_OPEN_FILES];
+static pthread_mutex_t _handlesmutex;
+
+static udtfs_node_t* _nodes[NODE_TABLE_BUCKETS];
+static udtfs_node_t* _idlehead = NULL;
+static udtfs_node_t* _idletail = NULL;
+static pthread_mutex_t _nodesmutex;
+static double _ttl = RPC_LEASE_TIME - 1;
+static volatile uint64_t _notify_seq = 0;   // counts callbacks and write-backs, see udtfs_notify()
+
+static int _fds[M_MAX_CONNECTIONS];
+static UDTSOCKET _ufds[M_MAX_CONNECTIONS];
+static rpc_client_t _conns[M_MAX_CONNECTIONS];
+static rpc_pool_t _pool;
+
+static pthread_t _rathreads[RA_FETCHERS];
+static int _ranthreads = 0;
+static pthread_mutex_t _ramutex;
+static pthread_cond_t _racond;
+static ra_job_t* _ra_queue = NULL;
+static ra_job_t* _ra_active = NULL;  // jobs on the wire, at most one per stream
+static int _ra_quit = 0;
+
+static pthread_t _wbthreads[M_MAX_CONNECTIONS * WB_FLUSHERS_PER_CONN];
+static int _wbnthreads = 0;
+static pthread_mutex_t _wbmutex;
+static pthread_cond_t _wbcond;    // extents were queued
+static pthread_cond_t _wbdone;    // extents were written
+static wb_extent_t* _wb_queue = NULL;
+static wb_extent_t* _wb_queuetail = NULL;
+static udtfs_handle_t* _wb_writers = NULL;  // handles that buffered data, idle ones go lazily
+static size_t _wb_dirty = 0;      // buffered bytes, queued or not
+static size_t _wb_budget = WB_DEFAULT_BUDGET;
+static int _wb_quit = 0;
+
+static struct fuse_chan* _ch = NULL;
+static pthread_t _invthread;
+static pthread_mutex_t _invmutex;
+static pthread_cond_t _invcond;
+static inval_t* _inv_queue = NULL;
+static int _inv_quit = 0;
+
+static inline rpc_client_t* pick_conn()
+{
+    return rpc_pool_pick(&_pool);
+}
 
 //////////////////////////////////////////////////////////////////////
-// FILE SYSTEM - GENERAL STUFF
+// OPEN FILE TABLE
 //////////////////////////////////////////////////////////////////////
 
-static int udtfs_getattr(const char *path, struct stat *stbuf)
+static int handle_alloc(uint64_t nodeid, uint64_t fh, const struct stat* stats)
 {
-    memset(stbuf, 0, sizeof(struct stat));
-    pthread_mutex_lock(&_tcpmutex);
-    if (send_cmd(_fd, "getattr") < 0) {
-        pthread_mutex_unlock(&_tcpmutex);
-        return -ENOENT;
+    int i;
+    pthread_mutex_lock(&_handlesmutex);
+    for (i = 0; i < MAX_OPEN_FILES; i++) {
+        if (!_handles[i].in_use) { break; }
     }
-    if (client_reqattr(_fd, path, stbuf) != 0) { 
-        pthread_mutex_unlock(&_tcpmutex);
-        return -ENOENT;
+    if (i >= MAX_OPEN_FILES) {
+        pthread_mutex_unlock(&_handlesmutex);
+        return -1;
     }
-    pthread_mutex_unlock(&_tcpmutex);
-//    stbuf->st_mode &= ~(S_IWUSR|S_IWGRP|S_IWOTH);
-    return 0;
+    _handles[i].in_use = 1;
+    pthread_mutex_unlock(&_handlesmutex);
+
+    _handles[i].nodeid = nodeid;
+    _handles[i].fh = fh;
+    _handles[i].stats = *stats;
+    _handles[i].version = bcache_version(stats);
+    _handles[i].ra_next = 0;
+    _handles[i].ra_issued = 0;
+    _handles[i].ra_blocks = 0;
+    _handles[i].dirty = NULL;
+    _handles[i].wb_busy = 0;
+    _handles[i].wb_error = 0;
+    _handles[i].stale = 0;
+    return i;
 }
 
-static int udtfs_opendir(const char *path, struct fuse_file_info *fi)
+static udtfs_handle_t* handle_get(struct fuse_file_info *fi)
 {
-    // what should this return...?
-    return 0;
+    if ((fi == NULL) || (fi->fh >= MAX_OPEN_FILES)) { return NULL; }
+    if (!_handles[fi->fh].in_use) { return NULL; }
+    return &_handles[fi->fh];
+}
+
+static void handle_free(udtfs_handle_t* h)
+{
+    pthread_mutex_lock(&_handlesmutex);
+    h->in_use = 0;
+    pthread_mutex_unlock(&_handlesmutex);
+}
+
+//////////////////////////////////////////////////////////////////////
+// NODE TABLE -- references to server nodes, released after the TTL
+//////////////////////////////////////////////////////////////////////
+
+static double node_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
 }
 
-static int udtfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                         off_t offset, struct fuse_file_info *fi)
+/* Caller holds _nodesmutex */
+static udtfs_node_t* node_find(uint64_t id)
 {
-    (void) offset;
-    (void) fi;
-    char* entry;
-    pthread_mutex_lock(&_tcpmutex);
-    if (send_cmd(_fd, "dir") < 0) { 
-        pthread_mutex_unlock(&_tcpmutex);
-        return -ENOENT; 
+    udtfs_node_t* n;
+    for (n = _nodes[id % NODE_TABLE_BUCKETS]; n != NULL; n = n->next) {
+        if (n->id == id) { return n; }
     }
-    if (client_reqdir(_fd, path) != 0) { 
-        pthread_mutex_unlock(&_tcpmutex);
-        return -ENOENT; 
+    return NULL;
+}
+
+/* Caller holds _nodesmutex */
+static void node_idle(udtfs_node_t* n)
+{
+    n->idle_since = node_now();
+    if (n->queued) { return; }
+    n->queued = 1;
+    n->qnext = NULL;
+    if (_idletail == NULL) {
+        _idlehead = n;
+    } else {
+        _idletail->qnext = n;
     }
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
-    while ((entry = client_recvdirentry(_fd)) != NULL) {
-        filler(buf, entry, NULL, 0);
-        free(entry);
+    _idletail = n;
+}
+
+/* Account for a node the server returned; 'kernel' is 1 if it goes to the kernel too */
+static void node_ref(uint64_t id, int kernel)
+{
+    udtfs_node_t* n;
+    pthread_mutex_lock(&_nodesmutex);
+    n = node_find(id);
+    if (n == NULL) {
+        n = (udtfs_node_t*)calloc(1, sizeof(udtfs_node_t));
+        if (n == NULL) {
+            pthread_mutex_unlock(&_nodesmutex);
+            return;
+        }
+        n->id = id;
+        n->next = _nodes[id % NODE_TABLE_BUCKETS];
+        _nodes[id % NODE_TABLE_BUCKETS] = n;
     }
-    pthread_mutex_unlock(&_tcpmutex);
-    return 0;
+    n->srvrefs++;
+    n->nlookup += kernel;
+    if (n->nlookup == 0) {
+        node_idle(n);
+    }
+    pthread_mutex_unlock(&_nodesmutex);
+}
+
+/* Hand a node we still hold to the kernel without asking the server, 
+ * returns -1 if it was released meanwhile */
+static int node_hold(uint64_t id)
+{
+    udtfs_node_t* n;
+    pthread_mutex_lock(&_nodesmutex);
+    n = node_find(id);
+    if (n != NULL) {
+        n->nlookup++;
+    }
+    pthread_mutex_unlock(&_nodesmutex);
+    return (n != NULL) ? 0 : -1;
 }
 
-static int udtfs_open(const char *path, struct fuse_file_info *fi)
+static void node_forget(uint64_t id, uint64_t nlookup)
 {
-    if (_file_is_open) {
-        fprintf(stderr, "udtfs_open: another file (%20s) is currently open\n", _file_name);
-        return -EIO;
+    udtfs_node_t* n;
+    pthread_mutex_lock(&_nodesmutex);
+    n = node_find(id);
+    if (n != NULL) {
+        n->nlookup = (nlookup >= n->nlookup) ? 0 : (n->nlookup - nlookup);
+        if (n->nlookup == 0) {
+            node_idle(n);
+        }
     }
-    if (path[0]=='/') { path++; }
-    if (udtfs_getattr(path, &_file_stats) != 0) { return -ENOENT; }
-    strncpy(_file_name, path, sizeof(_file_name));
-    _file_is_open = 1;
+    pthread_mutex_unlock(&_nodesmutex);
+}
+
+/* Return the references of nodes that were unused for longer than the TTL */
+static void node_sweep()
+{
+    uint64_t ids[FORGET_BATCH];
+    uint64_t counts[FORGET_BATCH];
+    int n = 0;
+    double expired = node_now() - _ttl;
+
+    pthread_mutex_lock(&_nodesmutex);
+    while ((_idlehead != NULL) && (n < FORGET_BATCH)) {
+        udtfs_node_t* node = _idlehead;
+        if ((node->nlookup == 0) && (node->idle_since > expired)) { break; }
+        _idlehead = node->qnext;
+        if (_idlehead == NULL) { _idletail = NULL; }
+        node->queued = 0;
+        if (node->nlookup > 0) { continue; }
+
+        udtfs_node_t** pp = &_nodes[node->id % NODE_TABLE_BUCKETS];
+        while (*pp != node) { pp = &((*pp)->next); }
+        *pp = node->next;
+        ids[n] = node->id;
+        counts[n] = node->srvrefs;
+        n++;
+        free(node);
+    }
+    pthread_mutex_unlock(&_nodesmutex);
+
+    if (n > 0) {
+        int i;
+        for (i = 0; i < n; i++) { acache_invalidate(ids[i]); }
+        client_reqforget(pick_conn(), ids, counts, n);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// WRITE-BACK
+//////////////////////////////////////////////////////////////////////
+
+/* Caller holds _wbmutex */
+static void wb_queue(udtfs_handle_t* h, wb_extent_t* e)
+{
+    off64_t end = e->offset + e->len;
+    if (h->wb_busy == 0) {
+        h->wb_lo = e->offset;
+        h->wb_hi = end;
+    } else {
+        if (e->offset < h->wb_lo) { h->wb_lo = e->offset; }
+        if (end > h->wb_hi) { h->wb_hi = end; }
+    }
+    h->wb_busy++;
+    e->next = NULL;
+    if (_wb_queuetail == NULL) {
+        _wb_queue = e;
+    } else {
+        _wb_queuetail->next = e;
+    }
+    _wb_queuetail = e;
+    pthread_cond_signal(&_wbcond);
+}
+
+/* Caller holds _wbmutex */
+static void wb_queue_all(udtfs_handle_t* h)
+{
+    while (h->dirty != NULL) {
+        wb_extent_t* e = h->dirty;
+        h->dirty = e->next;
+        wb_queue(h, e);
+    }
+}
+
+/* Caller holds _wbmutex. A released handle stays listed until it is found
+ * idle here, so handle_alloc() never touches the list. */
+static void wb_prune_writers()
+{
+    udtfs_handle_t** pp = &_wb_writers;
+    while (*pp != NULL) {
+        udtfs_handle_t* h = *pp;
+        if ((h->dirty == NULL) && (h->wb_busy == 0)) {
+            *pp = h->wb_next;
+            h->wb_listed = 0;
+        } else {
+            pp = &h->wb_next;
+        }
+    }
+}
+
+/* Buffer a write, merged with the dirty extents it overlaps or touches.
+ * Returns 0 or -errno. */
+static int wb_write(udtfs_handle_t* h, const char* data, size_t size, off64_t offset)
+{
+    off64_t end = offset + size;
+    wb_extent_t** pp;
+    wb_extent_t* e;
+    udtfs_handle_t* w;
+
+    pthread_mutex_lock(&_wbmutex);
+    if (h->wb_error != 0) {
+        pthread_mutex_unlock(&_wbmutex);
+        return -h->wb_error;
+    }
+
+    /* Older data for the same range must not overtake this on the wire */
+    while ((h->wb_busy > 0) && (offset < h->wb_hi) && (end > h->wb_lo)) {
+        pthread_cond_wait(&_wbdone, &_wbmutex);
+    }
+
+    for (pp = &h->dirty; (*pp != NULL) && (((*pp)->offset + (off64_t)(*pp)->len) < offset); pp = &((*pp)->next)) { }
+    e = *pp;
+    if ((e == NULL) || (e->offset > end)) {
+        /* Disjoint from everything buffered */
+        wb_extent_t* n = (wb_extent_t*)calloc(1, sizeof(wb_extent_t));
+        size_t cap = (size < BC_BLOCK_SIZE) ? BC_BLOCK_SIZE : size;
+        if ((n == NULL) || ((n->data = (char*)malloc(cap)) == NULL)) {
+            free(n);
+            pthread_mutex_unlock(&_wbmutex);
+            return -ENOMEM;
+        }
+        memcpy(n->data, data, size);
+        n->offset = offset;
+        n->len = size;
+        n->cap = cap;
+        n->h = h;
+        n->next = e;
+        *pp = n;
+        e = n;
+        _wb_dirty += size;
+    } else {
+        /* Grow 'e' over the new data and any later extents that now touch it */
+        off64_t start = (offset < e->offset) ? offset : e->offset;
+        off64_t stop = ((e->offset + (off64_t)e->len) > end) ? (e->offset + e->len) : end;
+        wb_extent_t* x = e->next;
+        while ((x != NULL) && (x->offset <= stop)) {
+            if ((x->offset + (off64_t)x->len) > stop) { stop = x->offset + x->len; }
+            x = x->next;
+        }
+        size_t need = stop - start;
+        char* buf = e->data;
+        size_t cap = e->cap;
+        if ((start != e->offset) || (need > cap)) {
+            while (cap < need) { cap *= 2; }
+            if (start == e->offset) {
+                buf = (char*)realloc(e->data, cap);
+            } else if ((buf = (char*)malloc(cap)) != NULL) {
+                memcpy(buf + (e->offset - start), e->data, e->len);
+                free(e->data);
+            }
+            if (buf == NULL) {
+                pthread_mutex_unlock(&_wbmutex);
+                return -ENOMEM;
+            }
+        }
+        while (e->next != x) {
+            wb_extent_t* next = e->next;
+            memcpy(buf + (next->offset - start), next->data, next->len);
+            _wb_dirty -= next->len;
+            e->next = next->next;
+            free(next->data);
+            free(next);
+        }
+        memcpy(buf + (offset - start), data, size);
+        _wb_dirty += need - e->len;
+        e->data = buf;
+        e->cap = cap;
+        e->offset = start;
+        e->len = need;
+    }
+
+    if (!h->wb_listed) {
+        h->wb_listed = 1;
+        h->wb_next = _wb_writers;
+        _wb_writers = h;
+    }
+
+    /* Large extents go out now, keeping the connections busy while the writer continues */
+    if (e->len >= WB_EXTENT_MAX) {
+        *pp = e->next;
+        wb_queue(h, e);
+    }
+
+    /* Memory pressure: push out everything buffered and wait for room */
+    while (_wb_dirty > _wb_budget) {
+        wb_prune_writers();
+        for (w = _wb_writers; w != NULL; w = w->wb_next) {
+            wb_queue_all(w);
+        }
+        pthread_cond_wait(&_wbdone, &_wbmutex);
+    }
+    pthread_mutex_unlock(&_wbmutex);
     return 0;
 }
 
-static int udtfs_release(const char *path, struct fuse_file_info *fi)
+/* Write out the dirty data of a handle and wait for it. Returns 0 or
+ * -errno; 'report' clears the error once it was passed on. */
+static int wb_flush(udtfs_handle_t* h, int report)
+{
+    int err;
+    pthread_mutex_lock(&_wbmutex);
+    wb_queue_all(h);
+    while (h->wb_busy > 0) {
+        pthread_cond_wait(&_wbdone, &_wbmutex);
+    }
+    err = h->wb_error;
+    if (report) { h->wb_error = 0; }
+    pthread_mutex_unlock(&_wbmutex);
+    return -err;
+}
+
+/* Bring the server up to date with the writes to a node through any handle,
+ * returns 1 if there was something to write */
+static int wb_flush_node(uint64_t nodeid)
+{
+    udtfs_handle_t* h;
+    int flushed = 0;
+    if (_wb_dirty == 0) { return 0; }
+    pthread_mutex_lock(&_wbmutex);
+    wb_prune_writers();
+    for (h = _wb_writers; h != NULL; ) {
+        if ((h->nodeid == nodeid) && ((h->dirty != NULL) || (h->wb_busy > 0))) {
+            /* The list may change while we wait, look again from the start */
+            wb_queue_all(h);
+            pthread_cond_wait(&_wbdone, &_wbmutex);
+            flushed = 1;
+            h = _wb_writers;
+        } else {
+            h = h->wb_next;
+        }
+    }
+    pthread_mutex_unlock(&_wbmutex);
+    return flushed;
+}
+
+/* Extend the server's view of a node in 'st' by the writes still buffered */
+static void wb_stat(uint64_t nodeid, struct stat* st)
+{
+    udtfs_handle_t* h;
+    wb_extent_t* e;
+    if (_wb_dirty == 0) { return; }
+    pthread_mutex_lock(&_wbmutex);
+    for (h = _wb_writers; h != NULL; h = h->wb_next) {
+        if (h->nodeid != nodeid) { continue; }
+        for (e = h->dirty; e != NULL; e = e->next) {
+            if ((e->offset + (off64_t)e->len) > st->st_size) { st->st_size = e->offset + e->len; }
+        }
+        if ((h->wb_busy > 0) && (h->wb_hi > st->st_size)) { st->st_size = h->wb_hi; }
+    }
+    pthread_mutex_unlock(&_wbmutex);
+}
+
+static void* writeback_thread(void* arg)
+{
+    int i;
+    pthread_mutex_lock(&_wbmutex);
+    while (1) {
+        wb_extent_t* e = _wb_queue;
+        if (e == NULL) {
+            if (_wb_quit) { break; }
+            pthread_cond_wait(&_wbcond, &_wbmutex);
+            continue;
+        }
+        _wb_queue = e->next;
+        if (_wb_queue == NULL) { _wb_queuetail = NULL; }
+        pthread_mutex_unlock(&_wbmutex);
+
+        udtfs_handle_t* h = e->h;
+        int rc = client_reqwrite(pick_conn(), h->fh, e->data, e->len, e->offset);
+        if (rc != (int)e->len) {
+            fprintf(stderr, "udtfs: write-back of %Lu bytes at %Lu to node %Lu failed\n",
+                    (ull_t)e->len, (ull_t)e->offset, (ull_t)h->nodeid);
+        }
+
+        /* Blocks may have been fetched again while the data was buffered */
+        off64_t b;
+        for (b = e->offset / BC_BLOCK_SIZE; b <= (off64_t)((e->offset + e->len - 1) / BC_BLOCK_SIZE); b++) {
+            bcache_invalidate(h->nodeid, b);
+        }
+        /* A stat taken before this landed must not be cached over it, and
+         * the readers of the node take the size it has now */
+        __sync_add_and_fetch(&_notify_seq, 1);
+        acache_invalidate(h->nodeid);
+        for (i = 0; i < MAX_OPEN_FILES; i++) {
+            if (_handles[i].in_use && (_handles[i].nodeid == h->nodeid)) { _handles[i].stale = 1; }
+        }
+
+        pthread_mutex_lock(&_wbmutex);
+        if (rc != (int)e->len) { h->wb_error = (rc < 0) ? -rc : EIO; }
+        h->wb_busy--;
+        _wb_dirty -= e->len;
+        pthread_cond_broadcast(&_wbdone);
+        free(e->data);
+        free(e);
+    }
+    pthread_mutex_unlock(&_wbmutex);
+    return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////
+// CALLBACKS -- the server recalls what another client changed
+//////////////////////////////////////////////////////////////////////
+
+static void inval_queue(uint64_t ino, const char* name)
+{
+    inval_t* inv = (inval_t*)calloc(1, sizeof(inval_t));
+    if (inv == NULL) { return; }
+    inv->ino = ino;
+    inv->name = (name != NULL) ? strdup(name) : NULL;
+    pthread_mutex_lock(&_invmutex);
+    inv->next = _inv_queue;
+    _inv_queue = inv;
+    pthread_cond_signal(&_invcond);
+    pthread_mutex_unlock(&_invmutex);
+}
+
+/* The kernel may be waiting on one of our replies while it takes the
+ * invalidation, so it is never sent from the dispatcher of a connection */
+static void* inval_thread(void* arg)
+{
+    pthread_mutex_lock(&_invmutex);
+    while (1) {
+        inval_t* inv = _inv_queue;
+        if (inv == NULL) {
+            if (_inv_quit) { break; }
+            pthread_cond_wait(&_invcond, &_invmutex);
+            continue;
+        }
+        _inv_queue = inv->next;
+        pthread_mutex_unlock(&_invmutex);
+        if (_ch != NULL) {
+            if (inv->name != NULL) {
+                fuse_lowlevel_notify_inval_entry(_ch, inv->ino, inv->name, strlen(inv->name));
+            } else {
+                fuse_lowlevel_notify_inval_inode(_ch, inv->ino, 0, 0);
+            }
+        }
+        free(inv->name);
+        free(inv);
+        pthread_mutex_lock(&_invmutex);
+    }
+    pthread_mutex_unlock(&_invmutex);
+    return NULL;
+}
+
+static void notify_node(uint64_t nodeid)
+{
+    int i;
+    acache_invalidate(nodeid);
+    for (i = 0; i < MAX_OPEN_FILES; i++) {
+        if (_handles[i].in_use && (_handles[i].nodeid == nodeid)) { _handles[i].stale = 1; }
+    }
+    inval_queue(nodeid, NULL);
+}
+
+/* NOTIFY from the server, on the dispatcher thread of the connection. Bumps
+ * _notify_seq first: a reply that was on its way meanwhile may predate the
+ * change, so requests only cache what they got if the count did not move. */
+static void udtfs_notify(rpc_client_t* c, rpc_msg_t* m)
 {
-    if (_file_is_open) {
-        if (path[0]=='/') { path++; }
-        if (strncmp(path, _file_name, sizeof(_file_name)) == 0) { 
-            // fprintf(stderr, "udtfs_release: file closed (%20s)\n", _file_name);
-            _file_is_open = 0; 
-            _cache_offset = 0;
-            _cache_len = 0;
+    __sync_add_and_fetch(&_notify_seq, 1);
+    while (!rpc_at_end(m)) {
+        uint32_t kind = rpc_get_u32(m);
+        uint64_t nodeid = rpc_get_u64(m);
+        uint64_t child;
+        char* name = NULL;
+        if ((kind == RPC_NOTIFY_ENTRY) && ((name = rpc_get_str(m)) == NULL)) { break; }
+        if (m->err) {
+            free(name);
+            break;
+        }
+        if (kind == RPC_NOTIFY_NODE) {
+            notify_node(nodeid);
+        } else if (kind == RPC_NOTIFY_ENTRY) {
+            if (acache_lookup(nodeid, name, &child) == 1) { notify_node(child); }
+            acache_invalidate_entry(nodeid, name);
+            inval_queue(nodeid, name);
         }
+        free(name);
     }
+}
+
+//////////////////////////////////////////////////////////////////////
+// BATCHING -- getattr, unlink and create calls that the kernel makes
+// concurrently go to the server together. A call goes out at once while
+// fewer requests of its kind are in flight than there are connections;
+// otherwise it queues, and the first waiting thread to find a free slot
+// sends everything queued (up to BATCH_MAX) as one request.
+//////////////////////////////////////////////////////////////////////
+
+typedef int (*batch_send_t)(rpc_client_t* c, client_meta_t** ops, int n);
+
+typedef struct batch_op_tt {
+    client_meta_t m;
+    int    done;
+    struct batch_op_tt* next;
+} batch_op_t;
+
+typedef struct batch_queue_tt {
+    batch_send_t send;
+    batch_op_t* head;
+    batch_op_t* tail;
+    int    inflight;
+} batch_queue_t;
+
+static pthread_mutex_t _batchmutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _batchcond = PTHREAD_COND_INITIALIZER;
+static batch_queue_t _batch_attr = { client_reqattr_many, NULL, NULL, 0 };
+static batch_queue_t _batch_unlink = { client_requnlink_many, NULL, NULL, 0 };
+static batch_queue_t _batch_create = { client_reqcreate_many, NULL, NULL, 0 };
+
+/* Returns when 'op' has its result, possibly sending other threads' ops meanwhile */
+static void batch_run(batch_queue_t* q, batch_op_t* op)
+{
+    client_meta_t* ms[BATCH_MAX];
+    batch_op_t* taken;
+    batch_op_t* o;
+    batch_op_t* next;
+    int i, n;
+
+    op->done = 0;
+    op->next = NULL;
+    pthread_mutex_lock(&_batchmutex);
+    if (q->tail != NULL) { q->tail->next = op; }
+    else { q->head = op; }
+    q->tail = op;
+    while (!op->done) {
+        if ((q->head == NULL) || (q->inflight >= _pool.n)) {
+            pthread_cond_wait(&_batchcond, &_batchmutex);
+            continue;
+        }
+        taken = q->head;
+        for (n = 0, o = taken; (o != NULL) && (n < BATCH_MAX); o = o->next) {
+            ms[n++] = &o->m;
+        }
+        q->head = o;
+        if (o == NULL) { q->tail = NULL; }
+        q->inflight++;
+        pthread_mutex_unlock(&_batchmutex);
+
+        q->send(pick_conn(), ms, n);
+
+        /* The owners return once they see 'done', which they check under the lock */
+        pthread_mutex_lock(&_batchmutex);
+        q->inflight--;
+        for (i = 0, o = taken; i < n; i++, o = next) {
+            next = o->next;
+            o->done = 1;
+        }
+        pthread_cond_broadcast(&_batchcond);
+    }
+    pthread_mutex_unlock(&_batchmutex);
+}
+
+//////////////////////////////////////////////////////////////////////
+// FILE SYSTEM - GENERAL STUFF
+//////////////////////////////////////////////////////////////////////
+
+static int udtfs_stat(uint64_t nodeid, struct stat* st)
+{
+    uint64_t seq = _notify_seq;
+    batch_op_t op;
+    if (acache_getattr(nodeid, st) == 1) { return 0; }
+    op.m.node = nodeid;
+    batch_run(&_batch_attr, &op);
+    if (op.m.rc != 0) { return -1; }
+    *st = op.m.st;
+    if (seq == _notify_seq) { acache_putattr(nodeid, st); }
     return 0;
 }
 
+static void udtfs_reply_noent(fuse_req_t req)
+{
+    struct fuse_entry_param e;
+    if (_ttl <= 0) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    /* Node 0 lets the kernel cache the negative entry */
+    memset(&e, 0, sizeof(e));
+    e.entry_timeout = _ttl;
+    fuse_reply_entry(req, &e);
+}
+
+static void udtfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct fuse_entry_param e;
+    uint64_t nodeid;
+    uint64_t seq = _notify_seq;
+
+    node_sweep();
+    memset(&e, 0, sizeof(e));
+    e.attr_timeout = _ttl;
+    e.entry_timeout = _ttl;
+    switch (acache_lookup(parent, name, &nodeid)) {
+        case 0:
+            udtfs_reply_noent(req);
+            return;
+        case 1:
+            if ((acache_getattr(nodeid, &e.attr) == 1) && (node_hold(nodeid) == 0)) {
+                e.ino = nodeid;
+                fuse_reply_entry(req, &e);
+                return;
+            }
+    }
+    if (client_reqlookup(pick_conn(), parent, name, &nodeid, &e.attr) != 0) {
+        if (seq == _notify_seq) { acache_putentry(parent, name, 0); }
+        udtfs_reply_noent(req);
+        return;
+    }
+    node_ref(nodeid, 1);
+    if (seq == _notify_seq) {
+        acache_putentry(parent, name, nodeid);
+        acache_putattr(nodeid, &e.attr);
+    }
+    e.ino = nodeid;
+    fuse_reply_entry(req, &e);
+}
+
+static void udtfs_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    node_forget(ino, nlookup);
+    node_sweep();
+    fuse_reply_none(req);
+}
+
+static void udtfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct stat st;
+    uint64_t seq;
+    int tries = 0;
+    /* Buffered writes stay buffered, only the size they make is reported.
+     * An extent landing in between may be in neither view, so look again. */
+    do {
+        seq = _notify_seq;
+        if (udtfs_stat(ino, &st) != 0) {
+            fuse_reply_err(req, ENOENT);
+            return;
+        }
+        wb_stat(ino, &st);
+    } while ((seq != _notify_seq) && (++tries < 3));
+    fuse_reply_attr(req, &st, _ttl);
+}
+
+static void dirbuf_add(fuse_req_t req, udtfs_dirbuf_t* b, const char* name, const struct stat* st)
+{
+    size_t entlen = fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+    if ((b->len + entlen) > b->cap) {
+        size_t cap = (b->cap > 0) ? (2 * b->cap) : 4096;
+        while ((b->len + entlen) > cap) { cap *= 2; }
+        char* buf = (char*)realloc(b->buf, cap);
+        if (buf == NULL) { return; }
+        b->buf = buf;
+        b->cap = cap;
+    }
+    fuse_add_direntry(req, b->buf + b->len, entlen, name, st, b->len + entlen);
+    b->len += entlen;
+}
+
+/* The whole listing is fetched here, readdir returns slices of it */
+static void udtfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    rpc_msg_t* entries;
+    rpc_msg_t* chunk;
+    udtfs_dirbuf_t* b;
+    struct stat st;
+    uint64_t nodeid;
+    uint64_t seq = _notify_seq;
+    char* name;
+
+    node_sweep();
+    if ((entries = client_reqdirplus(pick_conn(), ino)) == NULL) { 
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    b = (udtfs_dirbuf_t*)calloc(1, sizeof(udtfs_dirbuf_t));
+    if (b == NULL) {
+        rpc_msg_free(entries);
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFDIR;
+    st.st_ino = ino;
+    dirbuf_add(req, b, ".", &st);
+    dirbuf_add(req, b, "..", &st);
+    for (chunk = entries; chunk != NULL; chunk = chunk->next) {
+        while (!rpc_at_end(chunk) && ((name = rpc_get_str(chunk)) != NULL)) {
+            nodeid = rpc_get_u64(chunk);
+            rpc_get_stat(chunk, &st);
+            if (chunk->err) {
+                free(name);
+                break;
+            }
+            /* Prime the caches, "ls -l" looks up every entry next */
+            node_ref(nodeid, 0);
+            if (seq == _notify_seq) {
+                acache_putentry(ino, name, nodeid);
+                acache_putattr(nodeid, &st);
+            }
+            dirbuf_add(req, b, name, &st);
+            free(name);
+        }
+    }
+    rpc_msg_free(entries);
+    fi->fh = (uint64_t)(uintptr_t)b;
+    fuse_reply_open(req, fi);
+}
+
+static void udtfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                          struct fuse_file_info *fi)
+{
+    udtfs_dirbuf_t* b = (udtfs_dirbuf_t*)(uintptr_t)fi->fh;
+    if ((b == NULL) || (offset < 0) || ((size_t)offset >= b->len)) {
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+    if (size > (b->len - offset)) {
+        size = b->len - offset;
+    }
+    fuse_reply_buf(req, b->buf + offset, size);
+}
+
+static void udtfs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    udtfs_dirbuf_t* b = (udtfs_dirbuf_t*)(uintptr_t)fi->fh;
+    if (b != NULL) {
+        free(b->buf);
+        free(b);
+    }
+    fuse_reply_err(req, 0);
+}
+
+static void udtfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct stat stats;
+    uint64_t seq = _notify_seq;
+    uint64_t fh;
+    int h;
+    /* The server keeps the file open until release, the reply has its attributes */
+    rpc_client_t* c = pick_conn();
+    if (client_reqopen(c, ino, fi->flags & O_ACCMODE, &fh, &stats) != 0) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if (seq == _notify_seq) { acache_putattr(ino, &stats); }
+    h = handle_alloc(ino, fh, &stats);
+    if (h < 0) {
+        fprintf(stderr, "udtfs_open: all %d file handles are in use\n", MAX_OPEN_FILES);
+        client_reqrelease(c, fh);
+        fuse_reply_err(req, ENFILE);
+        return;
+    }
+    fi->fh = h;
+    fuse_reply_open(req, fi);
+}
+
+static void udtfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    udtfs_handle_t* h = handle_get(fi);
+    if (h != NULL) {
+        wb_flush(h, 1);
+        client_reqrelease(pick_conn(), h->fh);
+        handle_free(h);
+    }
+    fuse_reply_err(req, 0);
+}
+
+/* close() and fsync() both wait for the buffered writes of the handle */
+static void udtfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    udtfs_handle_t* h = handle_get(fi);
+    if (h == NULL) {
+        fuse_reply_err(req, EBADF);
+        return;
+    }
+    fuse_reply_err(req, -wb_flush(h, 1));
+}
+
+static void udtfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+    udtfs_flush(req, ino, fi);
+}
+
 //////////////////////////////////////////////////////////////////////
 // FILE SYSTEM - READING AND WRITING A FILE
 //////////////////////////////////////////////////////////////////////
 
-static int udtfs_read(const char *path, char *buf, size_t size, off64_t offset,
-                      struct fuse_file_info *fi)
+/* Fetch 'nblocks' consecutive blocks starting at 'blockno' into the block cache */
+static int fetch_blocks(uint64_t nodeid, uint64_t fh, uint64_t version, off64_t filesize,
+                        off64_t blockno, int nblocks, char* tmp)
+{
+    off64_t offset = blockno * BC_BLOCK_SIZE;
+    size_t fetchsize = (size_t)nblocks * BC_BLOCK_SIZE;
+    int i;
+
+    if ((filesize - offset) < (off64_t)fetchsize) {
+        fetchsize = filesize - offset;
+    }
+
+    int got = client_reqsegment(pick_conn(), fh, offset, fetchsize, tmp);
+    if (got < 0) {
+        fprintf(stderr, "udtfs_read: segment request for node %Lu failed\n", (ull_t)nodeid);
+        return -1;
+    }
+    if ((size_t)got < fetchsize) {
+        /* File shrank on the server since open */
+        memset(tmp + got, 0, fetchsize - got);
+    }
+
+    for (i = 0; i < nblocks; i++) {
+        size_t len = BC_BLOCK_SIZE;
+        if (((size_t)i * BC_BLOCK_SIZE + len) > fetchsize) {
+            len = fetchsize - (size_t)i * BC_BLOCK_SIZE;
+        }
+        bcache_put(nodeid, version, blockno + i, tmp + (size_t)i * BC_BLOCK_SIZE, len);
+    }
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// READAHEAD
+//////////////////////////////////////////////////////////////////////
+
+/* Update the stream state of a handle after a read of [offset, offset+size),
+ * returns a prefetch job for the next segment or NULL */
+static ra_job_t* readahead_advance(udtfs_handle_t* h, off64_t offset, size_t size)
+{
+    ra_job_t* job = NULL;
+    off64_t end = offset + size;
+
+    pthread_mutex_lock(&h->lock);
+    if ((offset == h->ra_next) && (offset > 0 || h->ra_blocks > 0)) {
+        /* Sequential: grow the window geometrically */
+        if (h->ra_blocks == 0) {
+            h->ra_blocks = RA_MIN_BLOCKS;
+        } else if (h->ra_blocks < RA_MAX_BLOCKS) {
+            h->ra_blocks *= 2;
+        }
+    } else if (offset != 0) {
+        /* Random: collapse the window */
+        h->ra_blocks = 0;
+        h->ra_issued = 0;
+    }
+    h->ra_next = end;
+
+    /* Keep at least half a window of prefetched data ahead of the reader */
+    off64_t window = (off64_t)h->ra_blocks * BC_BLOCK_SIZE;
+    if ((h->ra_blocks > 0) && ((h->ra_issued - end) < (window / 2)) && (end < h->stats.st_size)) {
+        off64_t from = (h->ra_issued > end) ? h->ra_issued : end;
+        off64_t blockno = from / BC_BLOCK_SIZE;
+        off64_t last = (end + window - 1) / BC_BLOCK_SIZE;
+        off64_t lastfile = (h->stats.st_size - 1) / BC_BLOCK_SIZE;
+        if (last > lastfile) { last = lastfile; }
+        if (last >= blockno) {
+            job = (ra_job_t*)calloc(1, sizeof(ra_job_t));
+        }
+        if (job != NULL) {
+            job->nodeid = h->nodeid;
+            job->fh = h->fh;
+            job->version = h->version;
+            job->size = h->stats.st_size;
+            job->blockno = blockno;
+            job->nblocks = last - blockno + 1;
+            if (job->nblocks > MAX_FETCH_BLOCKS) { job->nblocks = MAX_FETCH_BLOCKS; }
+            h->ra_issued = (blockno + job->nblocks) * BC_BLOCK_SIZE;
+        }
+    }
+    pthread_mutex_unlock(&h->lock);
+    return job;
+}
+
+static void readahead_submit(ra_job_t* job)
+{
+    ra_job_t** pp;
+    pthread_mutex_lock(&_ramutex);
+    for (pp = &_ra_queue; *pp != NULL; pp = &((*pp)->next)) { }
+    *pp = job;
+    pthread_cond_broadcast(&_racond);
+    pthread_mutex_unlock(&_ramutex);
+}
+
+/* Wait while a prefetch covering the block is on the wire, so the reader
+ * does not request the same data a second time */
+static void readahead_wait(uint64_t nodeid, uint64_t version, off64_t blockno)
+{
+    ra_job_t* a;
+    pthread_mutex_lock(&_ramutex);
+    for (a = _ra_active; a != NULL; ) {
+        if ((a->nodeid == nodeid) && (a->version == version)
+            && (blockno >= a->blockno) && (blockno < (a->blockno + a->nblocks))) {
+            pthread_cond_wait(&_racond, &_ramutex);
+            a = _ra_active;
+        } else {
+            a = a->next;
+        }
+    }
+    pthread_mutex_unlock(&_ramutex);
+}
+
+/* Caller holds _ramutex */
+static int readahead_busy(uint64_t fh)
+{
+    ra_job_t* a;
+    for (a = _ra_active; (a != NULL) && (a->fh != fh); a = a->next) { }
+    return (a != NULL);
+}
+
+/* One of RA_FETCHERS threads. Each stream has one segment on the wire at a
+ * time, so its prefetches arrive in order, while other streams proceed. */
+static void* readahead_thread(void* arg)
+{
+    ra_job_t** pp;
+    char* tmp = (char*)memalign(128, (size_t)MAX_FETCH_BLOCKS * BC_BLOCK_SIZE);
+    if (tmp == NULL) {
+        fprintf(stderr, "readahead_thread: out of memory, one prefetch thread less\n");
+        return NULL;
+    }
+    pthread_mutex_lock(&_ramutex);
+    while (!_ra_quit) {
+        for (pp = &_ra_queue; (*pp != NULL) && readahead_busy((*pp)->fh); pp = &((*pp)->next)) { }
+        ra_job_t* job = *pp;
+        if (job == NULL) {
+            pthread_cond_wait(&_racond, &_ramutex);
+            continue;
+        }
+        *pp = job->next;
+
+        /* Skip blocks a reader fetched in the meantime */
+        while ((job->nblocks > 0) && bcache_contains(job->nodeid, job->version, job->blockno)) {
+            job->blockno++;
+            job->nblocks--;
+        }
+        if (job->nblocks > 0) {
+            job->next = _ra_active;
+            _ra_active = job;
+            pthread_mutex_unlock(&_ramutex);
+            fetch_blocks(job->nodeid, job->fh, job->version, job->size, job->blockno, job->nblocks, tmp);
+            pthread_mutex_lock(&_ramutex);
+            for (pp = &_ra_active; *pp != job; pp = &((*pp)->next)) { }
+            *pp = job->next;
+            /* Readers of these blocks, and threads held back by this stream */
+            pthread_cond_broadcast(&_racond);
+        }
+        free(job);
+    }
+    while (_ra_queue != NULL) {
+        ra_job_t* job = _ra_queue;
+        _ra_queue = job->next;
+        free(job);
+    }
+    pthread_mutex_unlock(&_ramutex);
+    free(tmp);
+    return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////
+// READ
+//////////////////////////////////////////////////////////////////////
+
+/* Copy [offset, offset+size) of the open file to 'buf', returns the byte count or -errno */
+static int read_handle(udtfs_handle_t* h, char *buf, size_t size, off64_t offset)
 {
+    char* tmp = NULL;
+    ra_job_t* job;
+
     /* Crop at EOF */
     size_t actualsize = size;
-    if ((_file_stats.st_size - offset) < size) {
-        actualsize = _file_stats.st_size - offset;
+    if ((h->stats.st_size - offset) < (off64_t)size) {
+        actualsize = h->stats.st_size - offset;
     }
-    if (actualsize <= 0) {
+    if ((h->stats.st_size <= offset) || (actualsize <= 0)) {
         return 0;
     }
 
-    /* Refill the cache if necessary */
-    if ((offset < _cache_offset) || ((offset + actualsize) > (_cache_offset + _cache_len))) {
+    /* Queue the next segment before serving this one */
+    job = readahead_advance(h, offset, actualsize);
+    if (job != NULL) {
+        readahead_submit(job);
+    }
 
-        size_t fetchsize = MAX_CACHE_SIZE;
-        if (_file_stats.st_size < MAX_CACHE_SIZE) {
-            fetchsize = _file_stats.st_size;
+    /* Copy block by block, fetching runs of missing blocks in one segment */
+    size_t done = 0;
+    while (done < actualsize) {
+        off64_t pos = offset + done;
+        off64_t blockno = pos / BC_BLOCK_SIZE;
+        size_t inoff = pos % BC_BLOCK_SIZE;
+        size_t len = BC_BLOCK_SIZE - inoff;
+        if (len > (actualsize - done)) {
+            len = actualsize - done;
         }
 
-        pthread_mutex_lock(&_tcpmutex);
-        if (send_cmd(_fd, "read") < 0) { 
-            fprintf(stderr,"udtfs_read: cmd send error"); 
-            pthread_mutex_unlock(&_tcpmutex);
-            return -ENOENT; 
+        if (!bcache_contains(h->nodeid, h->version, blockno)) {
+            readahead_wait(h->nodeid, h->version, blockno);
         }
-        pthread_mutex_lock(&_udtmutex);
-        client_reqsegment(_fd, _ufd, _file_name, offset, fetchsize);
-        pthread_mutex_unlock(&_tcpmutex); 
-        client_recvsegment(_fd, _ufd, fetchsize, _cache);
-        pthread_mutex_unlock(&_udtmutex);
-        _cache_offset = offset;
-        _cache_len = fetchsize;
-
+        if (bcache_get(h->nodeid, h->version, blockno, buf + done, inoff, len) != 0) {
+            off64_t last = (offset + actualsize - 1) / BC_BLOCK_SIZE;
+            int nblocks = last - blockno + 1;
+            if (nblocks > MAX_FETCH_BLOCKS) { nblocks = MAX_FETCH_BLOCKS; }
+            if (tmp == NULL) {
+                tmp = (char*)memalign(128, (size_t)nblocks * BC_BLOCK_SIZE);
+                if (tmp == NULL) { return -ENOMEM; }
+            }
+            if (fetch_blocks(h->nodeid, h->fh, h->version, h->stats.st_size, blockno, nblocks, tmp) != 0) {
+                free(tmp);
+                return -EIO;
+            }
+            memcpy(buf + done, tmp + inoff, len);
+        }
+        done += len;
     }
 
-    /* Return the data */
-    memcpy(buf, _cache + (offset-_cache_offset), actualsize);
+    free(tmp);
     return actualsize;
 }
 
-static int udtfs_truncate(const char *path, off_t newsize)
+static void udtfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                       struct fuse_file_info *fi)
 {
-    if (send_cmd(_fd, "truncate") < 0) { 
-            fprintf(stderr,"udtfs_read: cmd send error"); 
-            pthread_mutex_unlock(&_tcpmutex);
-            return -ENOENT; 
+    udtfs_handle_t* h = handle_get(fi);
+    char* buf;
+    int rc;
+    if (h == NULL) {
+        fuse_reply_err(req, EBADF);
+        return;
     }
+    if ((buf = (char*)malloc(size)) == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    int stale = __sync_lock_test_and_set(&h->stale, 0);
+    if (wb_flush_node(h->nodeid) || stale) {
+        /* Read back what was written or another client changed, at its new size */
+        struct stat st;
+        if (udtfs_stat(h->nodeid, &st) == 0) {
+            pthread_mutex_lock(&h->lock);
+            h->stats = st;
+            h->version = bcache_version(&st);
+            pthread_mutex_unlock(&h->lock);
+        }
+    }
+    rc = read_handle(h, buf, size, offset);
+    if (rc < 0) {
+        fuse_reply_err(req, -rc);
+    } else {
+        fuse_reply_buf(req, buf, rc);
+    }
+    free(buf);
+}
 
-    client_reqtruncate(_fd, _ufd, _file_name, newsize);
-
-    return newsize;
+static void udtfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+                          struct fuse_file_info *fi)
+{
+    struct stat st;
+    if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+        fuse_reply_err(req, ENOSYS);
+        return;
+    }
+    udtfs_handle_t* h = handle_get(fi);
+    struct timespec times[2];
+    int rc;
+    wb_flush_node(ino);
+    acache_invalidate(ino);
+    if ((to_set & FUSE_SET_ATTR_SIZE)
+        && ((rc = client_reqtruncate(pick_conn(), ino, (h != NULL) ? h->fh : 0, attr->st_size)) < 0)) {
+        fuse_reply_err(req, -rc);
+        return;
+    }
+    if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+        times[0] = attr->st_atim;
+        times[1] = attr->st_mtim;
+        if (to_set & FUSE_SET_ATTR_ATIME_NOW) { times[0].tv_nsec = UTIME_NOW; }
+        if (to_set & FUSE_SET_ATTR_MTIME_NOW) { times[1].tv_nsec = UTIME_NOW; }
+        if (!(to_set & FUSE_SET_ATTR_ATIME)) { times[0].tv_nsec = UTIME_OMIT; }
+        if (!(to_set & FUSE_SET_ATTR_MTIME)) { times[1].tv_nsec = UTIME_OMIT; }
+        if ((rc = client_requtime(pick_conn(), ino, times)) < 0) {
+            fuse_reply_err(req, -rc);
+            return;
+        }
+    }
+    if (udtfs_stat(ino, &st) != 0) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    fuse_reply_attr(req, &st, _ttl);
 }
 
-static int udtfs_write (const char *path, const char *data, size_t size, off_t offset,
-              struct fuse_file_info *fi)
+static void udtfs_write(fuse_req_t req, fuse_ino_t ino, const char *data, size_t size,
+                        off_t offset, struct fuse_file_info *fi)
 {
-    if (send_cmd(_fd, "write") < 0) { 
-            fprintf(stderr,"udtfs_read: cmd send error"); 
-            pthread_mutex_unlock(&_tcpmutex);
-            return -ENOENT; 
+    udtfs_handle_t* h = handle_get(fi);
+    int rc;
+    if (h == NULL) {
+        fuse_reply_err(req, EBADF);
+        return;
+    }
+    acache_invalidate(h->nodeid);
+    if ((rc = wb_write(h, data, size, offset)) != 0) {
+        fuse_reply_err(req, -rc);
+        return;
     }
 
-    client_reqwrite(_fd, _ufd, _file_name, data, size, offset);
+    off64_t b;
+    for (b = offset / BC_BLOCK_SIZE; b <= (off64_t)((offset + size - 1) / BC_BLOCK_SIZE); b++) {
+        bcache_invalidate(h->nodeid, b);
+    }
 
-    return size;
+    fuse_reply_write(req, size);
 }
 
 /////////////////////////////////////////////////////////////////////
 // MOVE COMMAND
 /////////////////////////////////////////////////////////////////////
 
-static int udtfs_rename (const char *path, const char *newpath)
+static void udtfs_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                         fuse_ino_t newparent, const char *newname)
 {
-    printf("rename called!!\n");
-    printf("path: %s, newpath: %s, _file_name: %s\n",path, newpath, _file_name);
-    if (send_cmd(_fd, "rename") < 0) { 
-            fprintf(stderr,"udtfs_read: cmd send error"); 
-            pthread_mutex_unlock(&_tcpmutex);
-            return -ENOENT; 
-    }
-    client_reqrename(_fd, _ufd, path, newpath);
-    return 0;
+    /* The node keeps its id, only the two names change */
+    acache_invalidate_entry(parent, name);
+    acache_invalidate_entry(newparent, newname);
+    fuse_reply_err(req, -client_reqrename(pick_conn(), parent, name, newparent, newname, 0));
 }
 
 /////////////////////////////////////////////////////////////////////
 // REMOVE COMMAND
 /////////////////////////////////////////////////////////////////////
 
-static int udtfs_unlink (const char *path)
+/* 'flags' 0 or AT_REMOVEDIR */
+static void udtfs_remove(fuse_req_t req, fuse_ino_t parent, const char *name, int flags)
 {
-    printf("unlink called!!\n");
-    printf("path: %s, _file_name: %s\n",path, _file_name);
-    if (send_cmd(_fd, "unlink") < 0) { 
-            fprintf(stderr,"udtfs_read: cmd send error"); 
-            pthread_mutex_unlock(&_tcpmutex);
-            return -ENOENT; 
+    batch_op_t op;
+    uint64_t nodeid;
+    if (acache_lookup(parent, name, &nodeid) == 1) {
+        acache_invalidate(nodeid);
     }
-    client_requnlink(_fd, _ufd, path);
-    return 0;
+    acache_invalidate_entry(parent, name);
+    acache_invalidate(parent);
+    op.m.node = parent;
+    op.m.name = name;
+    op.m.arg = flags;
+    batch_run(&_batch_unlink, &op);
+    fuse_reply_err(req, -op.m.rc);
+}
+
+static void udtfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    udtfs_remove(req, parent, name, 0);
+}
+
+static void udtfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    udtfs_remove(req, parent, name, AT_REMOVEDIR);
 }
 
 /////////////////////////////////////////////////////////////////////
-// TOUCH COMMAND
+// CREATE COMMANDS
 /////////////////////////////////////////////////////////////////////
 
-static int udtfs_utimens(const char *path, const struct timespec tv[2])
+static void udtfs_make(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
 {
-    printf("utime called!!\n");
-    if (send_cmd(_fd, "utime") < 0) { 
-            fprintf(stderr,"udtfs_read: cmd send error"); 
-            pthread_mutex_unlock(&_tcpmutex);
-            return -ENOENT; 
+    struct fuse_entry_param e;
+    uint64_t seq = _notify_seq;
+    batch_op_t op;
+
+    acache_invalidate_entry(parent, name);
+    acache_invalidate(parent);
+    op.m.node = parent;
+    op.m.name = name;
+    op.m.arg = mode;
+    batch_run(&_batch_create, &op);
+    if (op.m.rc != 0) {
+        fuse_reply_err(req, -op.m.rc);
+        return;
     }
-    client_requtime(_fd, _ufd, path);
-    return 0;
+    node_ref(op.m.nodeid, 1);
+    if (seq == _notify_seq) {
+        acache_putentry(parent, name, op.m.nodeid);
+        acache_putattr(op.m.nodeid, &op.m.st);
+    }
+    memset(&e, 0, sizeof(e));
+    e.ino = op.m.nodeid;
+    e.attr = op.m.st;
+    e.attr_timeout = _ttl;
+    e.entry_timeout = _ttl;
+    fuse_reply_entry(req, &e);
+}
+
+static void udtfs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+{
+    udtfs_make(req, parent, name, mode);
+}
+
+static void udtfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+    udtfs_make(req, parent, name, S_IFDIR | (mode & 07777));
+}
+
+//////////////////////////////////////////////////////////////////////
+// INIT AND TEARDOWN -- threads are started here, after FUSE has daemonized
+//////////////////////////////////////////////////////////////////////
+
+static void udtfs_init(void *userdata, struct fuse_conn_info *conn)
+{
+    int i;
+    for (i = 0; i < _pool.n; i++) {
+        rpc_client_start(&_conns[i], _fds[i], _ufds[i], udtfs_notify);
+    }
+    pthread_create(&_invthread, NULL, inval_thread, NULL);
+    for (i = 0; i < RA_FETCHERS; i++) {
+        if (pthread_create(&_rathreads[i], NULL, readahead_thread, NULL) != 0) { break; }
+    }
+    _ranthreads = i;
+    for (i = 0; i < (_pool.n * WB_FLUSHERS_PER_CONN); i++) {
+        if (pthread_create(&_wbthreads[i], NULL, writeback_thread, NULL) != 0) { break; }
+    }
+    _wbnthreads = i;
+}
+
+static void udtfs_destroy(void *userdata)
+{
+    int i;
+    pthread_mutex_lock(&_ramutex);
+    _ra_quit = 1;
+    pthread_cond_broadcast(&_racond);
+    pthread_mutex_unlock(&_ramutex);
+    for (i = 0; i < _ranthreads; i++) {
+        pthread_join(_rathreads[i], NULL);
+    }
+    for (i = 0; i < MAX_OPEN_FILES; i++) {
+        if (_handles[i].in_use) { wb_flush(&_handles[i], 0); }
+    }
+    pthread_mutex_lock(&_wbmutex);
+    _wb_quit = 1;
+    pthread_cond_broadcast(&_wbcond);
+    pthread_mutex_unlock(&_wbmutex);
+    for (i = 0; i < _wbnthreads; i++) {
+        pthread_join(_wbthreads[i], NULL);
+    }
+    for (i = 0; i < _pool.n; i++) {
+        rpc_client_stop(&_conns[i]);
+    }
+    pthread_mutex_lock(&_invmutex);
+    _inv_quit = 1;
+    pthread_cond_broadcast(&_invcond);
+    pthread_mutex_unlock(&_invmutex);
+    pthread_join(_invthread, NULL);
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -257,21 +1458,36 @@ int main(int argc, char *argv[])
     char* fuseargv[64];
     int fuseargc = 0;
     char* hostname = NULL;
-    int i, rc;
+    char* mountpoint = NULL;
+    int multithreaded = 0, foreground = 0;
+    size_t cachesize = BC_DEFAULT_BUDGET;
+    int nconns = DEFAULT_CONNECTIONS;
+    uint64_t session = 0;
+    struct fuse_session* se;
+    int i, rc = -1;
 
     /* Fill the operations struct */
-    memset(&_udtfs_oper, 0, sizeof(struct fuse_operations));
+    memset(&_udtfs_oper, 0, sizeof(struct fuse_lowlevel_ops));
+    _udtfs_oper.lookup = udtfs_lookup;
+    _udtfs_oper.forget = udtfs_forget;
     _udtfs_oper.getattr = udtfs_getattr;
-    _udtfs_oper.readdir = udtfs_readdir;
+    _udtfs_oper.setattr = udtfs_setattr;
     _udtfs_oper.opendir = udtfs_opendir;
+    _udtfs_oper.readdir = udtfs_readdir;
+    _udtfs_oper.releasedir = udtfs_releasedir;
     _udtfs_oper.open = udtfs_open;
     _udtfs_oper.release = udtfs_release;
+    _udtfs_oper.flush = udtfs_flush;
+    _udtfs_oper.fsync = udtfs_fsync;
     _udtfs_oper.read = udtfs_read;
-    _udtfs_oper.truncate = udtfs_truncate;
     _udtfs_oper.write = udtfs_write;
     _udtfs_oper.rename = udtfs_rename;
     _udtfs_oper.unlink = udtfs_unlink;
-    _udtfs_oper.utimens = udtfs_utimens;
+    _udtfs_oper.rmdir = udtfs_rmdir;
+    _udtfs_oper.mknod = udtfs_mknod;
+    _udtfs_oper.mkdir = udtfs_mkdir;
+    _udtfs_oper.init = udtfs_init;
+    _udtfs_oper.destroy = udtfs_destroy;
 
     /* Handle the arguments for tfs and fuse */
     if ((argc < 3) || (argv[1][0]=='-') || (argv[2][0]=='-')) {
@@ -280,38 +1496,116 @@ int main(int argc, char *argv[])
     }
     fuseargv[fuseargc++] = strdup(argv[0]);
     hostname = strdup(argv[1]);
-    for (i = 2; i < argc; i++) {
+    for (i = 2; (i < argc) && (fuseargc < 63); i++) {
+        if (strncmp(argv[i], "--cache-size=", 13) == 0) {
+            cachesize = (size_t)atoll(argv[i] + 13) * 1024 * 1024;
+            continue;
+        }
+        if (strncmp(argv[i], "--writeback-size=", 17) == 0) {
+            _wb_budget = (size_t)atoll(argv[i] + 17) * 1024 * 1024;
+            continue;
+        }
+        if (strncmp(argv[i], "--ttl=", 6) == 0) {
+            /* Nothing is cached past the lease that keeps it coherent */
+            _ttl = atof(argv[i] + 6);
+            if (_ttl > (RPC_LEASE_TIME - 1)) { _ttl = RPC_LEASE_TIME - 1; }
+            continue;
+        }
+        if (strncmp(argv[i], "--connections=", 14) == 0) {
+            nconns = atoi(argv[i] + 14);
+            if (nconns < 1) { nconns = 1; }
+            if (nconns > M_MAX_CONNECTIONS) { nconns = M_MAX_CONNECTIONS; }
+            continue;
+        }
         fuseargv[fuseargc++] = strdup(argv[i]);
     }
-
-    /* Allocate our cache(s) */
-    _cache = (char*)memalign(128, MAX_CACHE_SIZE);
-    if (_cache == NULL) {
-        printf("Malloc for %d-byte cache failed!\n", MAX_CACHE_SIZE);
+    fuseargv[fuseargc] = NULL;
+    struct fuse_args args = FUSE_ARGS_INIT(fuseargc, fuseargv);
+    if ((fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1) || (mountpoint == NULL)) {
+        fprintf(stderr, "udtfs: no mount point given\n");
         return -1;
     }
-    _cache_offset = 0;
-    _cache_len = 0;    
 
-    /* Prepare the connection */
-    if ((_fd = client_open_socket(hostname)) < 0) {
+    /* Block cache shared by all open files */
+    if (bcache_init(cachesize) != 0) {
         return -1;
     }
-    if (exchange_versions(_fd) != 0) {
-        close(_fd);
+    if (acache_init(_ttl) != 0) {
         return -1;
     }
+
+    /* Open file table */
+    memset(_handles, 0, sizeof(_handles));
+    for (i = 0; i < MAX_OPEN_FILES; i++) {
+        pthread_mutex_init(&_handles[i].lock, NULL);
+    }
+    pthread_mutex_init(&_handlesmutex, NULL);
+    pthread_mutex_init(&_nodesmutex, NULL);
+
+    /* Prepare the connections, all in one server session so node ids are shared */
     UDT::startup();
-    _ufd = client_connect_udt(_fd);
-    pthread_mutex_init(&_tcpmutex, NULL);
-    pthread_mutex_init(&_udtmutex, NULL);
-
-    /* Provide the file system */
-    rc = fuse_main(fuseargc, fuseargv, &_udtfs_oper, NULL);
-    
-    close_socket(_fd);
+    for (i = 0; i < nconns; i++) {
+        if (client_open_connection(hostname, &session, &_fds[i], &_ufds[i]) != 0) {
+            break;
+        }
+    }
+    if (i == 0) {
+        return -1;
+    }
+    if (i < nconns) {
+        fprintf(stderr, "udtfs: continuing with %d of %d connections\n", i, nconns);
+    }
+    _pool.n = i;
+    _pool.conns = _conns;
+    pthread_mutex_init(&_ramutex, NULL);
+    pthread_cond_init(&_racond, NULL);
+    pthread_mutex_init(&_wbmutex, NULL);
+    pthread_cond_init(&_wbcond, NULL);
+    pthread_cond_init(&_wbdone, NULL);
+    pthread_mutex_init(&_invmutex, NULL);
+    pthread_cond_init(&_invcond, NULL);
+
+    /* Provide the file system; the kernel caches lookups and attributes as long as we do */
+    if ((_ch = fuse_mount(mountpoint, &args)) != NULL) {
+        se = fuse_lowlevel_new(&args, &_udtfs_oper, sizeof(_udtfs_oper), NULL);
+        if (se != NULL) {
+            if (fuse_set_signal_handlers(se) != -1) {
+                fuse_session_add_chan(se, _ch);
+                fuse_daemonize(foreground);
+                rc = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(_ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, _ch);
+        _ch = NULL;
+    }
+    fuse_opt_free_args(&args);
+
+    pthread_mutex_destroy(&_ramutex);
+    pthread_cond_destroy(&_racond);
+    pthread_mutex_destroy(&_wbmutex);
+    pthread_cond_destroy(&_wbcond);
+    pthread_cond_destroy(&_wbdone);
+    pthread_mutex_destroy(&_invmutex);
+    pthread_cond_destroy(&_invcond);
+
     UDT::cleanup();
-    pthread_mutex_destroy(&_tcpmutex);
-    pthread_mutex_destroy(&_udtmutex);
+    for (i = 0; i < MAX_OPEN_FILES; i++) {
+        pthread_mutex_destroy(&_handles[i].lock);
+    }
+    bcache_stats_t stats;
+    bcache_getstats(&stats);
+    fprintf(stderr, "block cache: %Lu hits, %Lu misses, %Lu evictions, %Lu MB budget\n",
+            stats.hits, stats.misses, stats.evictions, (ull_t)(stats.budget/(1024*1024)));
+    bcache_destroy();
+    acache_stats_t astats;
+    acache_getstats(&astats);
+    fprintf(stderr, "attribute cache: %Lu hits, %Lu negative hits, %Lu misses\n",
+            astats.hits, astats.neghits, astats.misses);
+    acache_destroy();
+    pthread_mutex_destroy(&_handlesmutex);
+    pthread_mutex_destroy(&_nodesmutex);
     return rc;
 }
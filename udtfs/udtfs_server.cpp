@@ -16,8 +16,13 @@
 #include <sys/wait.h>
 #include <signal.h>
 #include <pthread.h>
+#include <sys/resource.h>
 
 #include "common.h"
+#include "rpc.h"
+#include "nodes.h"
+#include "metacache.h"
+#include "fileio.h"
 #include <udt.h>
 
 
@@ -28,16 +33,13 @@
 static volatile int _num_clients = 0;
 static struct sigaction _sa_int_orig;
 
-void sigchld_handler(int s)
-{
-    while(waitpid(-1, NULL, WNOHANG) > 0);
-    _num_clients--;
-    fprintf(stderr, "client handler terminated\n");
-}
-
 void sigint_handler(int s)
 {
     if (_num_clients <= 0) {
+        mcache_stats_t stats;
+        mcache_getstats(&stats);
+        fprintf(stderr, "metadata cache: %llu hits, %llu misses, %llu invalidations\n",
+                stats.hits, stats.misses, stats.invalidations);
         fprintf(stderr, "SIGINT: no clients, done!\n");
         sigaction(SIGINT, &_sa_int_orig, NULL);
         kill(0, SIGINT);
@@ -50,64 +52,81 @@ void sigint_handler(int s)
 // CLIENT SERVING LOOP
 //////////////////////////////////////////////////////////////////////
 
-int client_handler(int fd, int udtport)
+static int client_dispatch(rpc_server_t* s, rpc_msg_t* req)
 {
-    char rcvbuf[512];
-    ssize_t n;
+    switch (req->op) {
+        case RPC_OP_LOOKUP:   return server_lookup(s, req);
+        case RPC_OP_FORGET:   return server_forget(s, req);
+        case RPC_OP_GETATTR:  return server_sendattr(s, req);
+        case RPC_OP_READDIRPLUS: return server_senddirplus(s, req);
+        case RPC_OP_READ:     return server_sendsegment(s, req);
+        case RPC_OP_TRUNCATE: return server_truncate(s, req);
+        case RPC_OP_WRITE:    return server_write(s, req);
+        case RPC_OP_RENAME:   return server_rename(s, req);
+        case RPC_OP_UNLINK:   return server_unlink(s, req);
+        case RPC_OP_UTIME:    return server_utime(s, req);
+        case RPC_OP_OPEN:     return server_open(s, req);
+        case RPC_OP_RELEASE:  return server_release(s, req);
+        case RPC_OP_GETATTR_MANY: return server_attr_many(s, req);
+        case RPC_OP_UNLINK_MANY:  return server_unlink_many(s, req);
+        case RPC_OP_CREATE_MANY:  return server_create_many(s, req);
+    }
+    fprintf(stderr, "unknown opcode %u\n", req->op);
+    return rpc_reply(s, req, -1, NULL);
+}
+
+//////////////////////////////////////////////////////////////////////
+// CONNECTION HANDLER -- pairs a control connection with its data one, then
+// sleeps until the client is gone to tear the connection down
+//////////////////////////////////////////////////////////////////////
+
+static void* client_handler(void* arg)
+{
+    int fd = (int)(intptr_t)arg;
+    server_session_t* ss = NULL;
+    uint64_t sessionid;
     UDTSOCKET ufd;
+    rpc_server_t server;
 
-    /* Ignore SIGINTs, the parent handles them */
-    struct sigaction sa_ignore;
-    sa_ignore.sa_handler = SIG_IGN;
-    sa_ignore.sa_flags = SA_SIGINFO;
-    sigemptyset(&sa_ignore.sa_mask);
-    sigaction(SIGINT, &sa_ignore, NULL);
-
-    /* Do "auth" */
-    if (exchange_versions(fd) != 0) {
-       close_socket(fd); 
-       exit(0);
+    /* Do "auth", then join the client's session */
+    if ((exchange_versions(fd) != 0) || (recv_session(fd, &sessionid) != 0)) {
+        close_socket(fd);
+        __sync_fetch_and_sub(&_num_clients, 1);
+        return NULL;
+    }
+    ss = session_join(sessionid);
+    if (ss == NULL) {
+        fprintf(stderr, "refusing connection: unknown session\n");
+        send_session(fd, 0);
+    }
+    if ((ss == NULL) || (send_session(fd, ss->id) != 0)) {
+        if (ss != NULL) { session_leave(ss); }
+        close_socket(fd);
+        __sync_fetch_and_sub(&_num_clients, 1);
+        return NULL;
     }
 
-    /* Tell our UDT port number and wait for connection */  
-    fprintf(stderr, "Waiting for UDT client connection on port %d\n", udtport);
-    ufd = server_accept_udt(fd, udtport);
-    fprintf(stderr, "Now accepting client commands.\n");
-
-    /* Handle commands */
-    while (1) {
-        n = recv_str(fd, rcvbuf, sizeof(rcvbuf), 0);
-        if (n <= 0) {
-            perror("recv");
-            break;
-        }
-        if (strcasecmp(rcvbuf, "dir") == 0) {
-            server_senddir(fd);
-        } else
-        if (strcasecmp(rcvbuf, "getattr") == 0) {
-            server_sendattr(fd);
-        } else
-        if (strcasecmp(rcvbuf, "read") == 0) {
-            server_sendsegment(fd, ufd);
-        } else
-        if (strcasecmp(rcvbuf, "truncate") == 0) {
-            server_truncate(fd,ufd);
-        } else
-        if (strcasecmp(rcvbuf, "write") == 0) {
-            server_write(fd,ufd);
-        } else
-        if (strcasecmp(rcvbuf, "rename") == 0) {
-            server_rename(fd,ufd);
-        } else
-        if (strcasecmp(rcvbuf, "unlink") == 0) {
-            server_unlink(fd,ufd);
-        }
-        if (strcasecmp(rcvbuf, "utime") == 0) {
-            server_utime(fd,ufd);
+    /* Tell our UDT port number and the token, wait for the data connection */
+    ufd = server_accept_udt(fd);
+    if (ufd != UDT::INVALID_SOCK) {
+        fprintf(stderr, "Now accepting commands for session %llu.\n", (unsigned long long)ss->id);
+
+        /* Handle commands, several at a time and answered in any order;
+         * callbacks for the session may go out on this connection meanwhile */
+        server.session = ss;
+        if (rpc_server_open(&server, fd, ufd, client_dispatch) == 0) {
+            session_attach(ss, &server);
+            rpc_server_wait(&server);
+            session_detach(ss, &server);
         }
+        rpc_server_close(&server);
     }
+
     close_socket(fd);
-    exit(0);
+    session_leave(ss);
+    __sync_fetch_and_sub(&_num_clients, 1);
+    fprintf(stderr, "client connection terminated\n");
+    return NULL;
 }
 
 void *get_in_addr(struct sockaddr *sa)
@@ -128,26 +147,20 @@ int main(int argc, char** argv)
     socklen_t sin_size;
     int child_fd;
     int sockfd;
-    int udtport = M_PORT_UDTBASE;
     struct sockaddr_storage remoteaddr;
     char s[INET6_ADDRSTRLEN];
-    struct sigaction sa_chld;
     struct sigaction sa_int;
+    pthread_attr_t attr;
+    pthread_t thread;
 
     /* Library init */
     UDT::startup();
 
     /* Server init */
     sockfd = server_open_socket();
-
-    /* Signal handlers -- SIGCHLD: reap all dead processes */
-    sa_chld.sa_handler = sigchld_handler;
-    sigemptyset(&sa_chld.sa_mask);
-    sa_chld.sa_flags = SA_RESTART;
-    if (sigaction(SIGCHLD, &sa_chld, NULL) == -1) {
-        perror("sigaction SIGCHLD");
-        exit(1);
-    }
+    signal(SIGPIPE, SIG_IGN);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
     /* Signal handlers -- SIGINT: prevent Control-C with open remote mounts */
     sa_int.sa_handler = sigint_handler;
@@ -166,6 +179,28 @@ int main(int argc, char** argv)
     getcwd(sharedpath, PATH_MAX);
     fprintf(stderr, "Sharing directory %s\n", sharedpath);
 
+    /* Clients address files by node, each looked up directory holds a descriptor;
+     * stat results and listings are cached for all of them */
+    if ((mcache_init() != 0) || (nodes_init(sharedpath) != 0)) {
+        exit(1);
+    }
+
+    /* One event loop and one worker pool serve the requests of all clients,
+     * their file writes share one io_uring */
+    if ((fio_init() < 0) || (rpc_server_init(RPC_SERVER_WORKERS) != 0)) {
+        exit(1);
+    }
+
+    /* The data connections of all clients share one UDT port */
+    if (server_listen_udt(M_PORT_UDT) != 0) {
+        exit(1);
+    }
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
     /* Client wait */
     while(1) {
         sin_size = sizeof(remoteaddr);
@@ -177,16 +212,11 @@ int main(int argc, char** argv)
 
         inet_ntop(remoteaddr.ss_family, get_in_addr((struct sockaddr *)&remoteaddr), s, sizeof(s));
 
-        udtport = M_PORT_UDTBASE + (_num_clients % M_MAX_CLIENTS);
-         _num_clients++;
-
-        if (!fork()) {
-            /* child */
-            close(sockfd);
-            client_handler(child_fd, udtport);
-        } else {
-            /* parent */
+        __sync_fetch_and_add(&_num_clients, 1);
+        if (pthread_create(&thread, &attr, client_handler, (void*)(intptr_t)child_fd) != 0) {
+            perror("pthread_create");
             close(child_fd);
+            __sync_fetch_and_sub(&_num_clients, 1);
         }
     }
     return 0;